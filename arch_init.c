@@ -27,19 +27,24 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <zlib.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
+#include "sysemu/balloon.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -52,6 +57,7 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -107,12 +113,32 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static void mig_throttle_set(int pct);
+static void mig_throttle_update(int64_t bytes_dirtied, int64_t bytes_xfer);
+static void mig_throttle_timer_tick(void *opaque);
 
 static uint64_t bitmap_sync_count;
 
+/* Auto-converge takes mig_throttle_pct percent of the vCPU time away from
+ * the guest, by having each vCPU sleep after every timeslice it has run.
+ */
+#define MIG_THROTTLE_MAX_PCT 99
+#define MIG_THROTTLE_TIMESLICE_NS (10 * SCALE_MS)
+
+static int mig_throttle_pct;
+static QEMUTimer *mig_throttle_timer;
+
+static int mig_throttle_get(void)
+{
+    return atomic_read(&mig_throttle_pct);
+}
+
+static int64_t mig_throttle_sleep_ns(int pct)
+{
+    return MIG_THROTTLE_TIMESLICE_NS * pct / (100 - pct);
+}
+
 /***********************************************************/
 /* ram save/restore */
 
@@ -124,6 +150,18 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+/* Only together with MEM_SIZE, reuses the obsolete FULL flag */
+#define RAM_SAVE_FLAG_MAPPED_RAM       RAM_SAVE_FLAG_FULL
+/* Only together with COMPRESS: the fill byte is followed by a be32 count
+ * of pages, see ram_save_zero_run_flush.
+ */
+#define RAM_SAVE_FLAG_RUN              RAM_SAVE_FLAG_FULL
+/* Only together with MEM_SIZE: the destination may drop its RAM and skip
+ * zero runs over the pages it has not written since.
+ */
+#define RAM_SAVE_FLAG_ZERO_RUNS        RAM_SAVE_FLAG_CONTINUE
 
 static struct defconfig_file {
     const char *filename;
@@ -157,7 +195,7 @@ int qemu_read_default_config_files(bool userconfig)
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -195,7 +233,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -208,16 +245,12 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* The pages already cached stay usable for the next iteration */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -329,6 +362,26 @@ static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* The destination runs the guest, and requests the pages it needs */
+static bool ram_postcopy;
+/* Background snapshot: RAM is saved in a single pass as it was when write
+ * tracking started, and the pages the guest writes to are saved first.
+ */
+static bool ram_background;
+
+/* Pages requested by the destination in postcopy; they are sent before
+ * the next dirty page found by the normal scan.
+ */
+typedef struct RAMSrcPageRequest {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next;
+} RAMSrcPageRequest;
+
+static QemuMutex page_request_mutex;
+static QSIMPLEQ_HEAD(, RAMSrcPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
 
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
@@ -363,8 +416,9 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                 return -1;
             } else {
                 /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+                   inserted into cache; this is not a hit, the page
+                   has only been sent once */
+                *current_data = cache_peek_data(XBZRLE.cache, current_addr);
             }
         }
         return -1;
@@ -410,6 +464,397 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return bytes_sent;
 }
 
+/* Multi-threaded XBZRLE encoding, see the xbzrle-threads parameter.
+ *
+ * As with compression, the migration thread hands each page found in
+ * the cache to an idle encoding thread, and writes out the result the
+ * next time it picks that thread or at the end of the iteration.  The
+ * threads encode copies of the cached and the current page, and only
+ * take XBZRLE.lock to exchange them with the cache.
+ */
+typedef struct XbzrleParam {
+    QemuThread thread;
+    /* Protects start and quit */
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* Protected by xbzrle_done_lock; the thread is idle and the fields
+     * below belong to the migration thread while done is true.
+     */
+    bool done;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *page;
+    bool last_stage;
+    /* The page was dropped from the cache before the thread got to it */
+    bool cache_miss;
+    uint8_t *old_buf;
+    uint8_t *new_buf;
+    uint8_t *encoded_buf;
+    int encoded_len;
+} XbzrleParam;
+
+static XbzrleParam *xbzrle_param;
+static int xbzrle_thread_count;
+static QemuMutex xbzrle_done_lock;
+static QemuCond xbzrle_done_cond;
+
+static void xbzrle_encode_page(XbzrleParam *param)
+{
+    ram_addr_t current_addr = param->block->offset + param->offset;
+    uint8_t *prev_cached_page;
+
+    /* This copy is sent, and replaces the cached page */
+    memcpy(param->new_buf, param->page, TARGET_PAGE_SIZE);
+
+    XBZRLE_cache_lock();
+    param->cache_miss = !cache_is_cached(XBZRLE.cache, current_addr);
+    if (param->cache_miss) {
+        XBZRLE_cache_unlock();
+        param->encoded_len = -1;
+        return;
+    }
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    memcpy(param->old_buf, prev_cached_page, TARGET_PAGE_SIZE);
+    if (!param->last_stage) {
+        memcpy(prev_cached_page, param->new_buf, TARGET_PAGE_SIZE);
+    }
+    XBZRLE_cache_unlock();
+
+    param->encoded_len = xbzrle_encode_buffer(param->old_buf, param->new_buf,
+                                              TARGET_PAGE_SIZE,
+                                              param->encoded_buf,
+                                              TARGET_PAGE_SIZE);
+}
+
+static void *do_data_xbzrle(void *opaque)
+{
+    XbzrleParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        xbzrle_encode_page(param);
+
+        qemu_mutex_lock(&xbzrle_done_lock);
+        param->done = true;
+        qemu_cond_signal(&xbzrle_done_cond);
+        qemu_mutex_unlock(&xbzrle_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_xbzrle_threads_create(void)
+{
+    int i;
+
+    xbzrle_thread_count = migrate_xbzrle_threads();
+    xbzrle_param = g_new0(XbzrleParam, xbzrle_thread_count);
+    qemu_mutex_init(&xbzrle_done_lock);
+    qemu_cond_init(&xbzrle_done_cond);
+    for (i = 0; i < xbzrle_thread_count; i++) {
+        xbzrle_param[i].old_buf = g_malloc(TARGET_PAGE_SIZE);
+        xbzrle_param[i].new_buf = g_malloc(TARGET_PAGE_SIZE);
+        xbzrle_param[i].encoded_buf = g_malloc(TARGET_PAGE_SIZE);
+        xbzrle_param[i].done = true;
+        qemu_mutex_init(&xbzrle_param[i].mutex);
+        qemu_cond_init(&xbzrle_param[i].cond);
+        qemu_thread_create(&xbzrle_param[i].thread, "xbzrle",
+                           do_data_xbzrle, &xbzrle_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migrate_xbzrle_threads_join(void)
+{
+    int i;
+
+    if (!xbzrle_param) {
+        return;
+    }
+    for (i = 0; i < xbzrle_thread_count; i++) {
+        qemu_mutex_lock(&xbzrle_param[i].mutex);
+        xbzrle_param[i].quit = true;
+        qemu_cond_signal(&xbzrle_param[i].cond);
+        qemu_mutex_unlock(&xbzrle_param[i].mutex);
+        qemu_thread_join(&xbzrle_param[i].thread);
+        qemu_mutex_destroy(&xbzrle_param[i].mutex);
+        qemu_cond_destroy(&xbzrle_param[i].cond);
+        g_free(xbzrle_param[i].old_buf);
+        g_free(xbzrle_param[i].new_buf);
+        g_free(xbzrle_param[i].encoded_buf);
+    }
+    qemu_mutex_destroy(&xbzrle_done_lock);
+    qemu_cond_destroy(&xbzrle_done_cond);
+    g_free(xbzrle_param);
+    xbzrle_param = NULL;
+}
+
+/* Write out the result of an idle encoding thread, if any.  */
+static int save_xbzrle_encoded_page(QEMUFile *f, XbzrleParam *param)
+{
+    RAMBlock *block = param->block;
+    int bytes_sent;
+    int cont;
+
+    if (!block) {
+        return 0;
+    }
+
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (param->encoded_len == 0) {
+        /* Unmodified page */
+        bytes_sent = 0;
+    } else if (param->encoded_len > 0) {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+        qemu_put_be16(f, param->encoded_len);
+        qemu_put_buffer(f, param->encoded_buf, param->encoded_len);
+        bytes_sent += param->encoded_len + 1 + 2;
+        acct_info.xbzrle_pages++;
+        acct_info.xbzrle_bytes += bytes_sent;
+    } else {
+        if (param->cache_miss) {
+            acct_info.xbzrle_cache_miss++;
+        } else {
+            acct_info.xbzrle_overflows++;
+        }
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->new_buf, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
+    param->block = NULL;
+
+    return bytes_sent;
+}
+
+/* Queue a cached page for encoding, and write out the previous result
+ * of the thread that takes it.  Returns the number of bytes written.
+ * Must be called without XBZRLE.lock.
+ */
+static int xbzrle_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                         ram_addr_t offset, uint8_t *p,
+                                         bool last_stage)
+{
+    XbzrleParam *param;
+    int bytes_sent;
+    int i;
+
+    qemu_mutex_lock(&xbzrle_done_lock);
+    for (;;) {
+        for (i = 0; i < xbzrle_thread_count; i++) {
+            if (xbzrle_param[i].done) {
+                break;
+            }
+        }
+        if (i < xbzrle_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&xbzrle_done_cond, &xbzrle_done_lock);
+    }
+    param = &xbzrle_param[i];
+    qemu_mutex_unlock(&xbzrle_done_lock);
+
+    bytes_sent = save_xbzrle_encoded_page(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    param->page = p;
+    param->last_stage = last_stage;
+    qemu_mutex_lock(&xbzrle_done_lock);
+    param->done = false;
+    qemu_mutex_unlock(&xbzrle_done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/* Wait for all encoding threads and write out their results.  */
+static int flush_xbzrle_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    if (!xbzrle_param) {
+        return 0;
+    }
+
+    for (i = 0; i < xbzrle_thread_count; i++) {
+        qemu_mutex_lock(&xbzrle_done_lock);
+        while (!xbzrle_param[i].done) {
+            qemu_cond_wait(&xbzrle_done_cond, &xbzrle_done_lock);
+        }
+        qemu_mutex_unlock(&xbzrle_done_lock);
+
+        bytes_sent += save_xbzrle_encoded_page(f, &xbzrle_param[i]);
+    }
+
+    return bytes_sent;
+}
+
+/* Free page hints.  During the bulk stage a device such as virtio-balloon
+ * asks the guest for the pages on its free lists, and those pages are
+ * dropped from migration_bitmap instead of being sent.  If the guest
+ * allocates and writes one of them later, the dirty log has it and the
+ * next bitmap sync marks it again.  A hint that arrives after that sync
+ * could be older than the write, though, so each sync first stops the
+ * report and applies the hints queued until then; the device drops what
+ * the guest sends for a stopped report.
+ *
+ * The hints are queued under the iothread lock and applied by the
+ * migration thread, the only one that touches migration_bitmap.
+ */
+typedef struct RAMFreePageHint {
+    ram_addr_t addr;
+    ram_addr_t length;
+} RAMFreePageHint;
+
+static NotifierList free_page_hint_notifiers =
+    NOTIFIER_LIST_INITIALIZER(free_page_hint_notifiers);
+static QemuMutex free_page_hint_mutex;
+static GArray *free_page_hints;
+/* A report is running; protected by the iothread lock */
+static bool free_page_hint_running;
+/* Some report was requested during this migration */
+static bool free_page_hint_requested;
+/* Some page was dropped, so the bulk stage can't assume all are dirty */
+static bool free_page_hinted;
+static unsigned long migration_bitmap_pages;
+
+void ram_add_free_page_hint_notifier(Notifier *notify)
+{
+    notifier_list_add(&free_page_hint_notifiers, notify);
+}
+
+void ram_remove_free_page_hint_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+static void free_page_hint_notify(FreePageHintEvent event)
+{
+    notifier_list_notify(&free_page_hint_notifiers, &event);
+}
+
+/*
+ * ram_free_page_hint: The guest does not use the @len bytes of RAM at
+ * @host, which must be in one RAM block.  Needs iothread lock.
+ */
+void ram_free_page_hint(void *host, size_t len)
+{
+    RAMFreePageHint hint;
+    MemoryRegion *mr;
+    ram_addr_t start, end;
+
+    if (!free_page_hint_running) {
+        return;
+    }
+    mr = qemu_ram_addr_from_host(host, &start);
+    if (!mr) {
+        return;
+    }
+    end = MIN(start + len, mr->ram_addr + memory_region_size(mr));
+    start = TARGET_PAGE_ALIGN(start);
+    end &= TARGET_PAGE_MASK;
+    if (end <= start) {
+        return;
+    }
+
+    hint.addr = start;
+    hint.length = end - start;
+    qemu_mutex_lock(&free_page_hint_mutex);
+    g_array_append_val(free_page_hints, hint);
+    qemu_mutex_unlock(&free_page_hint_mutex);
+}
+
+static void ram_apply_free_page_hints(void)
+{
+    uint64_t pages = 0;
+    guint i;
+
+    qemu_mutex_lock(&free_page_hint_mutex);
+    for (i = 0; i < free_page_hints->len; i++) {
+        RAMFreePageHint *hint = &g_array_index(free_page_hints,
+                                               RAMFreePageHint, i);
+        unsigned long nr = hint->addr >> TARGET_PAGE_BITS;
+        unsigned long end = nr + (hint->length >> TARGET_PAGE_BITS);
+
+        if (end > migration_bitmap_pages) {
+            continue;
+        }
+        for (nr = find_next_bit(migration_bitmap, end, nr); nr < end;
+             nr = find_next_bit(migration_bitmap, end, nr + 1)) {
+            clear_bit(nr, migration_bitmap);
+            pages++;
+        }
+    }
+    g_array_set_size(free_page_hints, 0);
+    qemu_mutex_unlock(&free_page_hint_mutex);
+
+    if (pages) {
+        migration_dirty_pages -= pages;
+        free_page_hinted = true;
+        trace_ram_free_page_hints(pages);
+    }
+}
+
+/* Before a bitmap sync; needs iothread lock */
+static void ram_free_page_hint_stop(void)
+{
+    if (free_page_hint_running) {
+        free_page_hint_running = false;
+        free_page_hint_notify(FREE_PAGE_HINT_STOP);
+    }
+    ram_apply_free_page_hints();
+}
+
+/* After a bitmap sync; needs iothread lock.  Postcopy sends only the
+ * pages that are still dirty when the destination asks for them, so a
+ * page that was never sent must stay dirty.
+ */
+static void ram_free_page_hint_start(void)
+{
+    if (ram_bulk_stage && !migrate_postcopy_ram() && runstate_is_running()) {
+        free_page_hint_running = true;
+        free_page_hint_requested = true;
+        free_page_hint_notify(FREE_PAGE_HINT_START);
+    }
+}
+
+/* At the end of the migration; needs iothread lock */
+static void ram_free_page_hint_done(void)
+{
+    free_page_hint_running = false;
+    if (free_page_hint_requested) {
+        free_page_hint_requested = false;
+        free_page_hint_notify(FREE_PAGE_HINT_DONE);
+    }
+    qemu_mutex_lock(&free_page_hint_mutex);
+    g_array_set_size(free_page_hints, 0);
+    qemu_mutex_unlock(&free_page_hint_mutex);
+}
+
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
                                                  ram_addr_t start)
@@ -421,7 +866,7 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
     unsigned long next;
 
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && nr > base && !free_page_hinted) {
         next = nr + 1;
     } else {
         next = find_next_bit(migration_bitmap, size, nr);
@@ -488,7 +933,7 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    uint64_t num_dirty_pages_init;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
     static int64_t bytes_xfer_prev;
@@ -499,6 +944,8 @@ static void migration_bitmap_sync(void)
     static uint64_t iterations_prev;
 
     bitmap_sync_count++;
+    ram_free_page_hint_stop();
+    num_dirty_pages_init = migration_dirty_pages;
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -522,23 +969,24 @@ static void migration_bitmap_sync(void)
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
+            /* Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
                were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+               we turn on the throttle down logic, which then adjusts the
+               throttle on every period. */
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+            if (mig_throttle_get() ||
+                (s->dirty_pages_rate &&
+                 (num_dirty_pages_period * TARGET_PAGE_SIZE >
+                     (bytes_xfer_now - bytes_xfer_prev)/2) &&
+                 (dirty_rate_high_cnt++ > 4))) {
+                mig_throttle_update(num_dirty_pages_period * TARGET_PAGE_SIZE,
+                                    bytes_xfer_now - bytes_xfer_prev);
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         } else {
-             mig_throttle_on = false;
+            mig_throttle_set(0);
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -557,97 +1005,1597 @@ static void migration_bitmap_sync(void)
         num_dirty_pages_period = 0;
         s->dirty_sync_count = bitmap_sync_count;
     }
+
+    ram_free_page_hint_start();
 }
 
-/*
- * ram_save_page: Send the given page to the stream
+/* Guest dirty rate measurement, see calc-dirty-rate.
  *
- * Returns: Number of bytes written.
+ * Dirty logging is only enabled for the duration of the measurement.  The
+ * DIRTY_MEMORY_MIGRATION bitmap is cleared when it starts and counted when
+ * it ends, so a migration cannot run at the same time: starting one
+ * interrupts the measurement.  Everything runs with the iothread lock held.
  */
-static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
-                         bool last_stage)
-{
-    int bytes_sent;
-    int cont;
-    ram_addr_t current_addr;
-    MemoryRegion *mr = block->mr;
-    uint8_t *p;
-    int ret;
-    bool send_async = true;
-
-    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+#define DIRTY_RATE_MAX_CALC_TIME 60
 
-    p = memory_region_get_ram_ptr(mr) + offset;
+static struct {
+    DirtyRateStatus status;
+    QEMUTimer *timer;
+    int64_t start_time;
+    int64_t calc_time;
+    uint64_t dirty_pages;
+    RamBlockDirtyRateList *blocks;
+} dirty_rate;
+
+/* Count the pages of @block dirtied since the last call, and clear them */
+static uint64_t dirty_rate_sync_block(RAMBlock *block)
+{
+    unsigned long *bitmap = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    unsigned long start = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = start + (block->length >> TARGET_PAGE_BITS);
+    unsigned long page;
+    uint64_t pages = 0;
+
+    for (page = find_next_bit(bitmap, end, start); page < end;
+         page = find_next_bit(bitmap, end, page + 1)) {
+        pages++;
+    }
+    cpu_physical_memory_reset_dirty(block->offset, block->length,
+                                    DIRTY_MEMORY_MIGRATION);
+    return pages;
+}
 
-    /* In doubt sent page as normal */
-    bytes_sent = -1;
-    ret = ram_control_save_page(f, block->offset,
-                           offset, TARGET_PAGE_SIZE, &bytes_sent);
+static void dirty_rate_free_blocks(void)
+{
+    qapi_free_RamBlockDirtyRateList(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+}
 
-    XBZRLE_cache_lock();
+static void dirty_rate_timer_cb(void *opaque)
+{
+    RamBlockDirtyRateList **tail = &dirty_rate.blocks;
+    RamBlockDirtyRateList *entry;
+    RAMBlock *block;
+    int64_t end_time;
 
-    current_addr = block->offset + offset;
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_sent > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_sent == 0) {
-                acct_info.dup_pages++;
-            }
-        }
-    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        acct_info.dup_pages++;
-        bytes_sent = save_block_hdr(f, block, offset, cont,
-                                    RAM_SAVE_FLAG_COMPRESS);
-        qemu_put_byte(f, 0);
-        bytes_sent++;
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        xbzrle_cache_zero_page(current_addr);
-    } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-        bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
-                                      offset, cont, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
-        }
-    }
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirty_rate.calc_time = MAX(end_time - dirty_rate.start_time, 1);
+    dirty_rate.dirty_pages = 0;
 
-    /* XBZRLE overflow or normal page */
-    if (bytes_sent == -1) {
-        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-        if (send_async) {
-            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-        } else {
-            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-        }
-        bytes_sent += TARGET_PAGE_SIZE;
-        acct_info.norm_pages++;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->dirty_pages = dirty_rate_sync_block(block);
+        entry->value->dirty_pages_rate = entry->value->dirty_pages * 1000 /
+                                         dirty_rate.calc_time;
+        dirty_rate.dirty_pages += entry->value->dirty_pages;
+        *tail = entry;
+        tail = &entry->next;
     }
 
-    XBZRLE_cache_unlock();
-
-    return bytes_sent;
+    memory_global_dirty_log_stop();
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirty_rate_measured(dirty_rate.dirty_pages, dirty_rate.calc_time);
 }
 
-/*
- * ram_find_and_save_block: Finds a page to send and sends it to f
- *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
- */
+/* Called when a migration starts; it takes over dirty logging */
+static void dirty_rate_abort(void)
+{
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        timer_del(dirty_rate.timer);
+        dirty_rate.status = DIRTY_RATE_STATUS_UNSTARTED;
+    }
+}
 
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
+    RAMBlock *block;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a value between 1 and 60");
+        return;
+    }
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "Dirty rate measurement already in progress");
+        return;
+    }
+    if (migration_bitmap) {
+        error_setg(errp, "Dirty rate can't be measured during migration");
+        return;
+    }
+
+    if (!dirty_rate.timer) {
+        dirty_rate.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                        dirty_rate_timer_cb, NULL);
+    }
+    dirty_rate_free_blocks();
+
+    /* Start from a clean bitmap, dirty logging may have been off */
+    memory_global_dirty_log_start();
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset, block->length,
+                                        DIRTY_MEMORY_MIGRATION);
+    }
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    timer_mod(dirty_rate.timer, dirty_rate.start_time + calc_time * 1000);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    RamBlockDirtyRateList *entry, **tail = &info->blocks;
+
+    info->status = dirty_rate.status;
+    if (dirty_rate.status == DIRTY_RATE_STATUS_UNSTARTED) {
+        return info;
+    }
+    info->has_start_time = true;
+    info->start_time = dirty_rate.start_time;
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        return info;
+    }
+
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_dirty_pages_rate = true;
+    info->dirty_pages_rate = dirty_rate.dirty_pages * 1000 /
+                             dirty_rate.calc_time;
+    info->has_blocks = true;
+    for (entry = dirty_rate.blocks; entry; entry = entry->next) {
+        *tail = g_malloc0(sizeof(**tail));
+        (*tail)->value = g_memdup(entry->value, sizeof(*entry->value));
+        (*tail)->value->id = g_strdup(entry->value->id);
+        tail = &(*tail)->next;
+    }
+    return info;
+}
+
+/* Multi-threaded compression of pages, see the compress capability.
+ *
+ * The migration thread hands each non-zero page to an idle compression
+ * thread, and writes out the result the next time it picks that thread.
+ * All results are written out at the end of each iteration, so that a
+ * page is never sent twice between two flushes and the destination
+ * cannot apply an older copy of a page after a newer one.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    /* Protects start and quit */
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* Protected by comp_done_lock; the thread is idle and the fields
+     * below belong to the migration thread while done is true.
+     */
+    bool done;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *page;
+    uint8_t *buf;
+    unsigned long len;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static int comp_level;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    uLongf len;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        len = compressBound(TARGET_PAGE_SIZE);
+        if (compress2(param->buf, &len, param->page, TARGET_PAGE_SIZE,
+                      comp_level) != Z_OK) {
+            /* Send the page uncompressed.  */
+            len = 0;
+        }
+
+        qemu_mutex_lock(&comp_done_lock);
+        param->len = len;
+        param->done = true;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_compress_threads_create(void)
+{
+    int i;
+
+    comp_thread_count = migrate_compress_threads();
+    comp_level = migrate_compress_level();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(&comp_param[i].thread, "compress",
+                           do_data_compress, &comp_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migrate_compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+        g_free(comp_param[i].buf);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    comp_param = NULL;
+}
+
+/* Write out the result of an idle compression thread, if any.  */
+static int save_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    int bytes_sent;
+    int cont;
+
+    if (!block) {
+        return 0;
+    }
+
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (param->len) {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 4 + param->len;
+    } else {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+    }
+    acct_info.norm_pages++;
+    last_sent_block = block;
+    param->block = NULL;
+
+    return bytes_sent;
+}
+
+/* Queue a page for compression, and write out the previous result of
+ * the thread that takes it.  Returns the number of bytes written.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, uint8_t *p)
+{
+    CompressParam *param;
+    int bytes_sent;
+    int i;
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (;;) {
+        for (i = 0; i < comp_thread_count; i++) {
+            if (comp_param[i].done) {
+                break;
+            }
+        }
+        if (i < comp_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+    param = &comp_param[i];
+    qemu_mutex_unlock(&comp_done_lock);
+
+    bytes_sent = save_compressed_page(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    param->page = p;
+    qemu_mutex_lock(&comp_done_lock);
+    param->done = false;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/* Wait for all compression threads and write out their results.  */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    if (!comp_param) {
+        return 0;
+    }
+
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_done_lock);
+        while (!comp_param[i].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+        qemu_mutex_unlock(&comp_done_lock);
+
+        bytes_sent += save_compressed_page(f, &comp_param[i]);
+    }
+
+    return bytes_sent;
+}
+
+/* Multiple channels for RAM pages, see the multifd capability.
+ *
+ * Each channel is an additional connection, served by one thread on
+ * either side.  The migration thread collects the pages of a block into
+ * packets and hands each packet to an idle channel; zero, XBZRLE and
+ * compressed pages, as well as device state, stay on the main channel.
+ *
+ * At the end of each iteration every channel sends a SYNC packet, and
+ * the main channel a RAM_SAVE_FLAG_MULTIFD_SYNC marker.  On the
+ * destination, a channel thread stops at its SYNC packet until ram_load
+ * reaches the marker, and ram_load waits at the marker until all
+ * channels have stopped and the pages of the main channel that were
+ * handed to load or decompression threads have been written.  Because
+ * a page is sent at most once per iteration, an older copy of a page
+ * is never written after a newer one.
+ *
+ * Each channel starts with a header of be32 magic, version, channel id
+ * and number of channels; the destination fails the migration unless
+ * the number of channels matches its own multifd-channels parameter,
+ * since it would otherwise wait forever for the missing ones.
+ *
+ * Packets are made of a be32 flags word and a be32 page count, followed
+ * for non-empty packets by the block id, the be64 page offsets within
+ * the block and the page contents.
+ */
+#define MULTIFD_MAGIC               0x11223344U
+#define MULTIFD_VERSION             1
+#define MULTIFD_PAGES_PER_PACKET    128
+
+#define MULTIFD_FLAG_PAGES          0x01
+#define MULTIFD_FLAG_SYNC           0x02
+#define MULTIFD_FLAG_QUIT           0x04
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* Protects flags */
+    QemuMutex mutex;
+    QemuCond cond;
+    uint32_t flags;
+    /* Protected by multifd_send_lock; the thread is idle and pages
+     * belongs to the migration thread while done is true.
+     */
+    bool done;
+    MultiFDPages pages;
+} MultiFDSendParams;
+
+static MultiFDSendParams *multifd_send;
+static int multifd_send_count;
+static int multifd_send_next;
+static MultiFDPages multifd_pages;
+static QemuMutex multifd_send_lock;
+static QemuCond multifd_send_cond;
+static int multifd_send_error;
+
+static void multifd_send_packet(QEMUFile *f, uint32_t flags,
+                                MultiFDPages *pages)
+{
+    RAMBlock *block = pages->block;
+    uint8_t *host;
+    int i;
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->num);
+    if (!pages->num) {
+        return;
+    }
+
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_buffer_async(f, host + pages->offset[i], TARGET_PAGE_SIZE);
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    uint32_t flags;
+    int ret;
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_put_be32(p->file, migrate_multifd_channels());
+    qemu_fflush(p->file);
+
+    qemu_mutex_lock(&p->mutex);
+    for (;;) {
+        if (!p->flags) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+        flags = p->flags;
+        p->flags = 0;
+        qemu_mutex_unlock(&p->mutex);
+
+        /* After an error the file discards everything, so the thread
+         * keeps going until it is told to quit.
+         */
+        multifd_send_packet(p->file, flags, &p->pages);
+        qemu_fflush(p->file);
+        ret = qemu_file_get_error(p->file);
+
+        qemu_mutex_lock(&multifd_send_lock);
+        if (ret < 0 && !multifd_send_error) {
+            multifd_send_error = ret;
+        }
+        p->pages.block = NULL;
+        p->pages.num = 0;
+        p->done = true;
+        qemu_cond_broadcast(&multifd_send_cond);
+        qemu_mutex_unlock(&multifd_send_lock);
+
+        if (flags & MULTIFD_FLAG_QUIT) {
+            break;
+        }
+        qemu_mutex_lock(&p->mutex);
+    }
+
+    return NULL;
+}
+
+/* Wait until channel @p is idle, and hand it a packet.  The pending
+ * pages go with it if @flags includes MULTIFD_FLAG_PAGES.
+ */
+static void multifd_send_queue(MultiFDSendParams *p, uint32_t flags)
+{
+    qemu_mutex_lock(&multifd_send_lock);
+    while (!p->done) {
+        qemu_cond_wait(&multifd_send_cond, &multifd_send_lock);
+    }
+    p->done = false;
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    if (flags & MULTIFD_FLAG_PAGES) {
+        p->pages = multifd_pages;
+        multifd_pages.block = NULL;
+        multifd_pages.num = 0;
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->flags = flags;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+}
+
+/* Send the pending pages through the first idle channel.  */
+static void multifd_send_pages(void)
+{
+    int i, n;
+
+    qemu_mutex_lock(&multifd_send_lock);
+    for (;;) {
+        for (i = 0; i < multifd_send_count; i++) {
+            n = (multifd_send_next + i) % multifd_send_count;
+            if (multifd_send[n].done) {
+                break;
+            }
+        }
+        if (i < multifd_send_count) {
+            break;
+        }
+        qemu_cond_wait(&multifd_send_cond, &multifd_send_lock);
+    }
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    multifd_send_next = (n + 1) % multifd_send_count;
+    multifd_send_queue(&multifd_send[n], MULTIFD_FLAG_PAGES);
+}
+
+static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    if (multifd_pages.num &&
+        (multifd_pages.block != block ||
+         multifd_pages.num == MULTIFD_PAGES_PER_PACKET)) {
+        multifd_send_pages();
+    }
+    multifd_pages.block = block;
+    multifd_pages.offset[multifd_pages.num++] = offset;
+}
+
+/* Send the pending pages and a SYNC packet on every channel, and the
+ * matching marker on the main channel.  The channels are idle when this
+ * returns, so no page of the iteration is read after the RAM list lock
+ * is dropped.  Returns the number of bytes written to @f.
+ */
+static int multifd_send_sync(QEMUFile *f)
+{
+    int ret;
+    int i;
+
+    if (!multifd_send) {
+        return 0;
+    }
+
+    if (multifd_pages.num) {
+        multifd_send_pages();
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_send_queue(&multifd_send[i], MULTIFD_FLAG_SYNC);
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        while (!multifd_send[i].done) {
+            qemu_cond_wait(&multifd_send_cond, &multifd_send_lock);
+        }
+    }
+    ret = multifd_send_error;
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 8;
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send) {
+        return;
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParams *p = &multifd_send[i];
+
+        multifd_send_queue(p, MULTIFD_FLAG_QUIT);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    qemu_mutex_destroy(&multifd_send_lock);
+    qemu_cond_destroy(&multifd_send_cond);
+    g_free(multifd_send);
+    multifd_send = NULL;
+}
+
+/* Unblock channels that are stuck writing to a dead connection.  */
+static void multifd_save_shutdown(void)
+{
+    int i;
+
+    for (i = 0; multifd_send && i < multifd_send_count; i++) {
+        shutdown(qemu_get_fd(multifd_send[i].file), SHUT_RDWR);
+    }
+}
+
+static int multifd_save_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    int count = migrate_multifd_channels();
+    int i;
+
+    multifd_send = g_new0(MultiFDSendParams, count);
+    multifd_send_count = 0;
+    multifd_send_next = 0;
+    multifd_send_error = 0;
+    multifd_pages.block = NULL;
+    multifd_pages.num = 0;
+    qemu_mutex_init(&multifd_send_lock);
+    qemu_cond_init(&multifd_send_cond);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send[i];
+
+        p->file = tcp_open_outgoing_channel(s, &local_err);
+        if (!p->file) {
+            error_report("Error opening multifd channel: %s",
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            multifd_save_shutdown();
+            multifd_save_cleanup();
+            return -1;
+        }
+        p->id = i;
+        p->done = true;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        multifd_send_count++;
+    }
+
+    return 0;
+}
+
+/* Fixed-offset RAM layout for file: migration, see the mapped-ram
+ * capability.
+ *
+ * The MEM_SIZE record carries RAM_SAVE_FLAG_MAPPED_RAM, and each block in
+ * it is followed by a be32 flags word and the be64 file offsets of the
+ * page bitmap and of the pages of the block.  Page N of a block is stored
+ * at pages_offset + N * TARGET_PAGE_SIZE, and bit N % 8 of byte N / 8 of
+ * the bitmap tells whether it was written; the other pages are zero.  The
+ * stream continues after the pages of the block, so that device state
+ * ends up behind the RAM.
+ *
+ * On the source, threads write runs of contiguous dirty pages straight
+ * from guest memory.  The threads are idle at the end of each iteration,
+ * so that an older copy of a page never lands after a newer one, and the
+ * bitmaps are written once the last iteration is done.  The destination
+ * reads every block back with several threads, using O_DIRECT if the
+ * source did and the file system allows it.
+ */
+#define MAPPED_RAM_ALIGN            (1024 * 1024)
+#define MAPPED_RAM_PAGES_PER_WRITE  (MAPPED_RAM_ALIGN / TARGET_PAGE_SIZE)
+#define MAPPED_RAM_MAX_LOAD_THREADS 16
+
+#define MAPPED_RAM_FLAG_DIRECT_IO   0x01
+
+/* Whether the running save uses the mapped-ram layout */
+static bool ram_mapped;
+
+#ifndef _WIN32
+
+typedef struct MappedRAMSendParams {
+    QemuThread thread;
+    /* Protects the run and quit */
+    QemuMutex mutex;
+    QemuCond cond;
+    bool quit;
+    /* Protected by mapped_ram_lock; the thread is idle and the run
+     * belongs to the migration thread while done is true.
+     */
+    bool done;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int num;
+} MappedRAMSendParams;
+
+static MappedRAMSendParams *mapped_ram_send;
+static int mapped_ram_send_count;
+static QemuMutex mapped_ram_lock;
+static QemuCond mapped_ram_cond;
+static int mapped_ram_error;
+/* Descriptor for the pages, opened with O_DIRECT if asked to */
+static int mapped_ram_fd = -1;
+static int mapped_ram_direct_fd = -1;
+/* The run of contiguous pages that is being collected */
+static RAMBlock *mapped_ram_block;
+static ram_addr_t mapped_ram_offset;
+static int mapped_ram_num;
+
+static int mapped_ram_pwrite(int fd, const uint8_t *buf, size_t len,
+                             off_t offset)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int mapped_ram_pread(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pread(fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *mapped_ram_send_thread(void *opaque)
+{
+    MappedRAMSendParams *p = opaque;
+    uint8_t *host;
+    int ret;
+
+    qemu_mutex_lock(&p->mutex);
+    while (!p->quit) {
+        if (!p->num) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+        qemu_mutex_unlock(&p->mutex);
+
+        host = memory_region_get_ram_ptr(p->block->mr) + p->offset;
+        ret = mapped_ram_pwrite(mapped_ram_fd, host,
+                                (size_t)p->num * TARGET_PAGE_SIZE,
+                                p->block->pages_offset + p->offset);
+
+        qemu_mutex_lock(&p->mutex);
+        p->num = 0;
+        qemu_mutex_unlock(&p->mutex);
+
+        qemu_mutex_lock(&mapped_ram_lock);
+        if (ret < 0 && !mapped_ram_error) {
+            mapped_ram_error = ret;
+        }
+        p->done = true;
+        qemu_cond_broadcast(&mapped_ram_cond);
+        qemu_mutex_unlock(&mapped_ram_lock);
+
+        qemu_mutex_lock(&p->mutex);
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+/* Hand the pending run to the first idle thread.  */
+static void mapped_ram_send_pages(void)
+{
+    MappedRAMSendParams *p;
+    int i;
+
+    qemu_mutex_lock(&mapped_ram_lock);
+    for (;;) {
+        for (i = 0; i < mapped_ram_send_count; i++) {
+            if (mapped_ram_send[i].done) {
+                break;
+            }
+        }
+        if (i < mapped_ram_send_count) {
+            break;
+        }
+        qemu_cond_wait(&mapped_ram_cond, &mapped_ram_lock);
+    }
+    p = &mapped_ram_send[i];
+    p->done = false;
+    qemu_mutex_unlock(&mapped_ram_lock);
+
+    qemu_mutex_lock(&p->mutex);
+    p->block = mapped_ram_block;
+    p->offset = mapped_ram_offset;
+    p->num = mapped_ram_num;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    mapped_ram_num = 0;
+}
+
+static void mapped_ram_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    if (mapped_ram_num &&
+        (mapped_ram_block != block ||
+         offset != mapped_ram_offset +
+                   (ram_addr_t)mapped_ram_num * TARGET_PAGE_SIZE ||
+         mapped_ram_num == MAPPED_RAM_PAGES_PER_WRITE)) {
+        mapped_ram_send_pages();
+    }
+    if (!mapped_ram_num) {
+        mapped_ram_block = block;
+        mapped_ram_offset = offset;
+    }
+    mapped_ram_num++;
+}
+
+/* Write the pending run, and wait until all threads are idle.  */
+static void mapped_ram_sync(QEMUFile *f)
+{
+    int ret;
+    int i;
+
+    if (!mapped_ram_send) {
+        return;
+    }
+    if (mapped_ram_num) {
+        mapped_ram_send_pages();
+    }
+
+    qemu_mutex_lock(&mapped_ram_lock);
+    for (i = 0; i < mapped_ram_send_count; i++) {
+        while (!mapped_ram_send[i].done) {
+            qemu_cond_wait(&mapped_ram_cond, &mapped_ram_lock);
+        }
+    }
+    ret = mapped_ram_error;
+    qemu_mutex_unlock(&mapped_ram_lock);
+
+    if (ret < 0) {
+        error_report("Error writing RAM to the migration file: %s",
+                     strerror(-ret));
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/*
+ * ram_save_mapped_page: Write the given page at its offset in the file
+ *
+ * Returns: Number of bytes accounted to the stream.
+ */
+static int ram_save_mapped_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, uint8_t *p)
+{
+    if (!block->file_bmap) {
+        error_report("RAM block %s was added during migration", block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return 1;
+    }
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        acct_info.dup_pages++;
+        /* Nothing is written, but stop the search like for other pages */
+        return 1;
+    }
+
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+    mapped_ram_queue_page(block, offset);
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    acct_info.norm_pages++;
+    return TARGET_PAGE_SIZE;
+}
+
+/* Reserve room for the bitmap and pages of @block after the stream, and
+ * continue the stream behind them.
+ */
+static void mapped_ram_put_block_header(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pages = block->length >> TARGET_PAGE_BITS;
+    int64_t offset;
+
+    /* The header is made of a be32 and two be64 */
+    offset = qemu_file_get_offset(f);
+    if (offset < 0) {
+        qemu_file_set_error(f, offset);
+        return;
+    }
+    block->bitmap_offset = offset + 4 + 8 + 8;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + DIV_ROUND_UP(pages, 8),
+                                   MAPPED_RAM_ALIGN);
+    block->file_bmap = bitmap_new(pages);
+
+    qemu_put_be32(f, mapped_ram_direct_fd >= 0 ? MAPPED_RAM_FLAG_DIRECT_IO : 0);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_set_offset(f, block->pages_offset + block->length);
+}
+
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    int64_t pages, i;
+    size_t size;
+    uint8_t *buf;
+    int ret;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!block->file_bmap) {
+            continue;
+        }
+        pages = block->length >> TARGET_PAGE_BITS;
+        size = DIV_ROUND_UP(pages, 8);
+        buf = g_malloc0(size);
+        for (i = find_first_bit(block->file_bmap, pages); i < pages;
+             i = find_next_bit(block->file_bmap, pages, i + 1)) {
+            buf[i / 8] |= 1 << (i % 8);
+        }
+        ret = mapped_ram_pwrite(qemu_get_fd(f), buf, size,
+                                block->bitmap_offset);
+        g_free(buf);
+        if (ret < 0) {
+            error_report("Error writing the RAM bitmap of %s: %s",
+                         block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+static void mapped_ram_save_cleanup(void)
+{
+    RAMBlock *block;
+    int i;
+
+    for (i = 0; mapped_ram_send && i < mapped_ram_send_count; i++) {
+        MappedRAMSendParams *p = &mapped_ram_send[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    if (mapped_ram_send) {
+        qemu_mutex_destroy(&mapped_ram_lock);
+        qemu_cond_destroy(&mapped_ram_cond);
+        g_free(mapped_ram_send);
+        mapped_ram_send = NULL;
+    }
+
+    if (mapped_ram_direct_fd >= 0) {
+        close(mapped_ram_direct_fd);
+        mapped_ram_direct_fd = -1;
+    }
+    mapped_ram_fd = -1;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    ram_mapped = false;
+}
+
+static int mapped_ram_save_setup(QEMUFile *f)
+{
+    int count = migrate_multifd_channels();
+    int64_t offset;
+    int i;
+
+    offset = qemu_file_get_offset(f);
+    if (offset < 0) {
+        error_report("mapped-ram needs a seekable file: %s",
+                     strerror(-offset));
+        return -1;
+    }
+
+    mapped_ram_fd = qemu_get_fd(f);
+    if (migrate_use_direct_io()) {
+        mapped_ram_direct_fd = file_open_direct(true);
+        if (mapped_ram_direct_fd < 0) {
+            error_report("Cannot open the migration file with O_DIRECT: %s",
+                         strerror(errno));
+            return -1;
+        }
+        mapped_ram_fd = mapped_ram_direct_fd;
+    }
+
+    mapped_ram_send = g_new0(MappedRAMSendParams, count);
+    mapped_ram_send_count = count;
+    mapped_ram_error = 0;
+    mapped_ram_num = 0;
+    qemu_mutex_init(&mapped_ram_lock);
+    qemu_cond_init(&mapped_ram_cond);
+
+    for (i = 0; i < count; i++) {
+        MappedRAMSendParams *p = &mapped_ram_send[i];
+
+        p->done = true;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "mapped_ram_send",
+                           mapped_ram_send_thread, p, QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+typedef struct MappedRAMLoadParams {
+    QemuThread thread;
+    uint8_t *host;
+    const uint8_t *bitmap;
+    int fd;
+    int buffered_fd;
+    uint64_t pages_offset;
+    int64_t start;
+    int64_t end;
+    int ret;
+} MappedRAMLoadParams;
+
+static inline bool mapped_ram_test_page(const uint8_t *bitmap, int64_t page)
+{
+    return bitmap[page / 8] & (1 << (page % 8));
+}
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRAMLoadParams *p = opaque;
+    int64_t page, run;
+    uint8_t *host;
+    size_t len;
+    off_t offset;
+    bool written;
+    int ret;
+
+    for (page = p->start; page < p->end; page = run) {
+        written = mapped_ram_test_page(p->bitmap, page);
+        for (run = page + 1; run < p->end &&
+             run - page < MAPPED_RAM_PAGES_PER_WRITE &&
+             mapped_ram_test_page(p->bitmap, run) == written; run++) {
+            /* nothing */
+        }
+
+        host = p->host + page * TARGET_PAGE_SIZE;
+        len = (run - page) * TARGET_PAGE_SIZE;
+        if (!written) {
+            ram_handle_compressed(host, 0, len);
+            continue;
+        }
+        offset = p->pages_offset + page * TARGET_PAGE_SIZE;
+        ret = mapped_ram_pread(p->fd, host, len, offset);
+        if (ret == -EINVAL && p->fd != p->buffered_fd) {
+            /* The target page size is below the O_DIRECT alignment */
+            p->fd = p->buffered_fd;
+            ret = mapped_ram_pread(p->fd, host, len, offset);
+        }
+        if (ret < 0) {
+            p->ret = ret;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Map the pages of @block from the file rather than reading them, so
+ * that the guest can run before its RAM is read.  The pages that are
+ * clear in the bitmap must read as zero; they are holes in the file,
+ * unless they were written before being zeroed by the guest.
+ */
+static int mapped_ram_map_block(RAMBlock *block, int fd, const uint8_t *bitmap,
+                                uint64_t pages_offset)
+{
+    int64_t pages = block->length >> TARGET_PAGE_BITS;
+    int64_t page, run;
+    off_t end, data;
+    bool written;
+    int ret;
+
+    ret = qemu_ram_map_file(block, fd, pages_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (page = 0; page < pages; page = run) {
+        written = mapped_ram_test_page(bitmap, page);
+        for (run = page + 1; run < pages &&
+             mapped_ram_test_page(bitmap, run) == written; run++) {
+            /* nothing */
+        }
+        if (written) {
+            continue;
+        }
+
+        end = pages_offset + run * TARGET_PAGE_SIZE;
+        data = -1;
+#ifdef SEEK_DATA
+        data = lseek(fd, pages_offset + page * TARGET_PAGE_SIZE, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {
+            data = end;
+        }
+#endif
+        if (data < end) {
+            ram_handle_compressed(block->host + page * TARGET_PAGE_SIZE, 0,
+                                  (run - page) * TARGET_PAGE_SIZE);
+        }
+    }
+    trace_ram_load_map_block(block->idstr, pages_offset);
+    return 0;
+}
+
+/* Read the pages of @block, whose header is next in @f, and continue the
+ * stream behind them.
+ */
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pages = block->length >> TARGET_PAGE_BITS;
+    size_t size = DIV_ROUND_UP(pages, 8);
+    MappedRAMLoadParams *params;
+    uint64_t bitmap_offset, pages_offset;
+    uint32_t flags;
+    uint8_t *bitmap;
+    int fd = qemu_get_fd(f);
+    int direct_fd = -1;
+    int count, i, ret;
+
+    flags = qemu_get_be32(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (flags & ~MAPPED_RAM_FLAG_DIRECT_IO) {
+        error_report("Unknown mapped-ram flags 0x%x for %s", flags,
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    bitmap = g_malloc(size);
+    ret = mapped_ram_pread(fd, bitmap, size, bitmap_offset);
+    if (ret < 0) {
+        error_report("Error reading the RAM bitmap of %s: %s", block->idstr,
+                     strerror(-ret));
+        g_free(bitmap);
+        return ret;
+    }
+
+    if (file_incoming_map_ram()) {
+        ret = mapped_ram_map_block(block, fd, bitmap, pages_offset);
+        if (ret != -ENOTSUP) {
+            g_free(bitmap);
+            if (ret < 0) {
+                error_report("Error mapping the RAM of %s: %s", block->idstr,
+                             strerror(-ret));
+                return ret;
+            }
+            return qemu_file_set_offset(f, pages_offset + block->length);
+        }
+        /* Read the blocks that cannot be mapped, such as file-backed RAM */
+        ret = 0;
+    }
+
+    if (flags & MAPPED_RAM_FLAG_DIRECT_IO) {
+        /* Fall back to the page cache if O_DIRECT is not possible */
+        direct_fd = file_open_direct(false);
+    }
+
+    count = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAPPED_RAM_MAX_LOAD_THREADS);
+    count = MIN(count, DIV_ROUND_UP(pages, MAPPED_RAM_PAGES_PER_WRITE));
+    count = MAX(count, 1);
+    params = g_new0(MappedRAMLoadParams, count);
+    for (i = 0; i < count; i++) {
+        MappedRAMLoadParams *p = &params[i];
+
+        p->host = memory_region_get_ram_ptr(block->mr);
+        p->bitmap = bitmap;
+        p->buffered_fd = fd;
+        p->fd = direct_fd >= 0 ? direct_fd : fd;
+        p->pages_offset = pages_offset;
+        p->start = pages * i / count;
+        p->end = pages * (i + 1) / count;
+        qemu_thread_create(&p->thread, "mapped_ram_load",
+                           mapped_ram_load_thread, p, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < count; i++) {
+        qemu_thread_join(&params[i].thread);
+        if (params[i].ret < 0 && ret == 0) {
+            ret = params[i].ret;
+        }
+    }
+    trace_ram_load_mapped_block(block->idstr, pages_offset, count,
+                                direct_fd >= 0);
+
+    g_free(params);
+    g_free(bitmap);
+    if (direct_fd >= 0) {
+        close(direct_fd);
+    }
+    if (ret < 0) {
+        error_report("Error reading the RAM of %s: %s", block->idstr,
+                     strerror(-ret));
+        return ret;
+    }
+    return qemu_file_set_offset(f, pages_offset + block->length);
+}
+
+#else
+
+static void mapped_ram_sync(QEMUFile *f)
+{
+}
+
+static int ram_save_mapped_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, uint8_t *p)
+{
+    abort();
+}
+
+static void mapped_ram_put_block_header(QEMUFile *f, RAMBlock *block)
+{
+    abort();
+}
+
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+}
+
+static void mapped_ram_save_cleanup(void)
+{
+}
+
+static int mapped_ram_save_setup(QEMUFile *f)
+{
+    error_report("mapped-ram is not supported on this host");
+    return -1;
+}
+
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block)
+{
+    error_report("mapped-ram is not supported on this host");
+    return -ENOTSUP;
+}
+
+#endif
+
+/* Runs of zero pages, see the zero-page-runs capability.
+ *
+ * Zero pages that follow each other in a block are gathered and sent as a
+ * single COMPRESS record with RAM_SAVE_FLAG_RUN, which carries the number
+ * of pages after the fill byte.  A run is written out when the next zero
+ * page does not extend it, when it reaches RAM_ZERO_RUN_MAX_PAGES, and at
+ * the end of each iteration.  Pages are sent at most once per iteration,
+ * so other pages written meanwhile cannot overlap it.  Postcopy places
+ * pages one at a time and does not use runs.
+ */
+#define RAM_ZERO_RUN_MAX_PAGES  (1 << 14)
+
+static bool ram_zero_runs;
+static RAMBlock *zero_run_block;
+static ram_addr_t zero_run_offset;
+static uint32_t zero_run_pages;
+
+static int ram_save_zero_run_flush(QEMUFile *f)
+{
+    int bytes_sent;
+    int cont;
+
+    if (!zero_run_pages) {
+        return 0;
+    }
+
+    cont = (zero_run_block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (zero_run_pages == 1) {
+        bytes_sent = save_block_hdr(f, zero_run_block, zero_run_offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else {
+        bytes_sent = save_block_hdr(f, zero_run_block, zero_run_offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS |
+                                    RAM_SAVE_FLAG_RUN);
+        qemu_put_byte(f, 0);
+        qemu_put_be32(f, zero_run_pages);
+        bytes_sent += 5;
+    }
+    trace_ram_save_zero_run(zero_run_block->idstr, zero_run_offset,
+                            zero_run_pages);
+
+    last_sent_block = zero_run_block;
+    zero_run_block = NULL;
+    zero_run_pages = 0;
+    return bytes_sent;
+}
+
+/* Add the zero page at @offset of @block to the current run.  Returns
+ * the number of bytes written, which is 0 unless a run was flushed.
+ */
+static int ram_save_zero_run(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    int bytes_sent = 0;
+
+    if (zero_run_pages &&
+        (block != zero_run_block ||
+         offset != zero_run_offset +
+                   ((ram_addr_t)zero_run_pages << TARGET_PAGE_BITS))) {
+        bytes_sent = ram_save_zero_run_flush(f);
+    }
+    if (!zero_run_pages) {
+        zero_run_block = block;
+        zero_run_offset = offset;
+    }
+    if (++zero_run_pages == RAM_ZERO_RUN_MAX_PAGES) {
+        bytes_sent += ram_save_zero_run_flush(f);
+    }
+    return bytes_sent;
+}
+
+/*
+ * ram_save_page: Send the given page to the stream
+ *
+ * Returns: Number of bytes written.
+ */
+static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int bytes_sent;
+    int cont;
+    ram_addr_t current_addr;
+    MemoryRegion *mr = block->mr;
+    uint8_t *p;
+    int ret;
+    /* In a background snapshot, the guest may change the page as soon as
+     * this returns.
+     */
+    bool send_async = !ram_background;
+
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    p = memory_region_get_ram_ptr(mr) + offset;
+
+    if (ram_mapped) {
+        return ram_save_mapped_page(f, block, offset, p);
+    }
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    ret = ram_control_save_page(f, block->offset,
+                           offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+    XBZRLE_cache_lock();
+
+    current_addr = block->offset + offset;
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        if (ram_zero_runs && !ram_postcopy) {
+            xbzrle_cache_zero_page(current_addr);
+            XBZRLE_cache_unlock();
+            /* The run takes care of last_sent_block when it is written */
+            return ram_save_zero_run(f, block, offset);
+        }
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+         * page would be stale
+         */
+        xbzrle_cache_zero_page(current_addr);
+    } else if (!ram_bulk_stage && !ram_postcopy && migrate_use_xbzrle()) {
+        /* The destination can't decode XBZRLE once it places pages
+         * atomically, so postcopy sends whole pages.
+         */
+        if (xbzrle_param && cache_is_cached(XBZRLE.cache, current_addr)) {
+            /* The page is written out later, like compressed pages.  */
+            XBZRLE_cache_unlock();
+            return xbzrle_page_with_multi_thread(f, block, offset, p,
+                                                 last_stage);
+        }
+        bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            /* Can't send this cached data async, since the cache page
+             * might get updated before it gets to the wire
+             */
+            send_async = false;
+        }
+    } else if (comp_param) {
+        /* The page is written out later, possibly after pages of other
+         * blocks, so it takes care of last_sent_block itself.
+         */
+        bytes_sent = compress_page_with_multi_thread(f, block, offset, p);
+        XBZRLE_cache_unlock();
+        return bytes_sent;
+    } else if (multifd_send) {
+        /* Nothing goes to the main channel, but account the page there
+         * so that the bandwidth estimate includes it.
+         */
+        multifd_queue_page(block, offset);
+        qemu_update_position(f, TARGET_PAGE_SIZE);
+        acct_info.norm_pages++;
+        XBZRLE_cache_unlock();
+        return TARGET_PAGE_SIZE;
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    XBZRLE_cache_unlock();
+
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
+    return bytes_sent;
+}
+
+/* Let the guest write to a page of a background snapshot again, once it
+ * has been saved.
+ */
+static int ram_save_unprotect(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    int ret;
+
+    if (!ram_background) {
+        return 0;
+    }
+    ret = ram_write_tracking_unprotect(block->host + offset, TARGET_PAGE_SIZE);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/* Called by the return path thread, or by the write tracking thread of a
+ * background snapshot: queue @len bytes at @start in RAMBlock @idstr, to
+ * be sent as soon as possible.
+ */
+int ram_save_queue_pages(const char *idstr, ram_addr_t start, size_t len)
+{
+    RAMSrcPageRequest *req;
+
+    trace_ram_save_queue_pages(idstr, start, len);
+    if (!len || ((start | len) & ~TARGET_PAGE_MASK)) {
+        error_report("Invalid page request for %s: " RAM_ADDR_FMT
+                     " + %zx", idstr, start, len);
+        return -EINVAL;
+    }
+
+    req = g_new0(RAMSrcPageRequest, 1);
+    pstrcpy(req->idstr, sizeof(req->idstr), idstr);
+    req->offset = start;
+    req->len = len;
+
+    qemu_mutex_lock(&page_request_mutex);
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    qemu_mutex_unlock(&page_request_mutex);
+    return 0;
+}
+
+static void ram_flush_page_requests(void)
+{
+    RAMSrcPageRequest *req;
+
+    qemu_mutex_lock(&page_request_mutex);
+    while ((req = QSIMPLEQ_FIRST(&page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&page_request_mutex);
+}
+
+/*
+ * ram_save_requested_page: Send the first requested page that is still
+ * dirty; the others were sent already, and are on their way.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no pending request, negative on error
+ */
+static int ram_save_requested_page(QEMUFile *f, bool last_stage)
+{
+    RAMSrcPageRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int bytes_sent = 0;
+
+    while (bytes_sent == 0) {
+        qemu_mutex_lock(&page_request_mutex);
+        req = QSIMPLEQ_FIRST(&page_requests);
+        if (!req) {
+            qemu_mutex_unlock(&page_request_mutex);
+            break;
+        }
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(req->idstr, block->idstr, sizeof(block->idstr))) {
+                break;
+            }
+        }
+        if (!block || req->offset >= block->length ||
+            req->len > block->length - req->offset) {
+            error_report("Page request outside of RAMBlock %s", req->idstr);
+            qemu_mutex_unlock(&page_request_mutex);
+            qemu_file_set_error(f, -EINVAL);
+            return -EINVAL;
+        }
+        offset = req->offset;
+        req->offset += TARGET_PAGE_SIZE;
+        req->len -= TARGET_PAGE_SIZE;
+        if (!req->len) {
+            QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+            g_free(req);
+        }
+        qemu_mutex_unlock(&page_request_mutex);
+
+        if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                               migration_bitmap)) {
+            migration_dirty_pages--;
+            bytes_sent = ram_save_page(f, block, offset, last_stage);
+        }
+        /* The writer waits even if the page was saved already */
+        if (ram_save_unprotect(f, block, offset) < 0) {
+            return -EIO;
+        }
+    }
+    return bytes_sent;
+}
+
+/*
+ * ram_find_and_save_block: Finds a page to send and sends it to f
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages
+ */
+
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
     int bytes_sent = 0;
     MemoryRegion *mr;
 
+    if (ram_postcopy || ram_background) {
+        bytes_sent = ram_save_requested_page(f, last_stage);
+        if (bytes_sent) {
+            return bytes_sent;
+        }
+    }
+
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
 
@@ -668,10 +2616,13 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
             }
         } else {
             bytes_sent = ram_save_page(f, block, offset, last_stage);
+            if (ram_save_unprotect(f, block, offset) < 0) {
+                bytes_sent = 0;
+                break;
+            }
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -730,11 +2681,27 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    ram_write_tracking_stop();
+    migrate_compress_threads_join();
+    migrate_xbzrle_threads_join();
+    multifd_save_cleanup();
+    mapped_ram_save_cleanup();
+    ram_flush_page_requests();
+    ram_free_page_hint_done();
+    ram_postcopy = false;
+    mig_throttle_set(0);
+
     if (migration_bitmap) {
-        memory_global_dirty_log_stop();
+        if (!ram_background) {
+            memory_global_dirty_log_stop();
+        }
         g_free(migration_bitmap);
         migration_bitmap = NULL;
     }
+    if (ram_background) {
+        qemu_balloon_inhibit(false);
+        ram_background = false;
+    }
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
@@ -751,6 +2718,7 @@ static void migration_end(void)
 
 static void ram_migration_cancel(void *opaque)
 {
+    multifd_save_shutdown();
     migration_end();
 }
 
@@ -761,16 +2729,32 @@ static void reset_ram_globals(void)
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    zero_run_block = NULL;
+    zero_run_pages = 0;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
 
+/* Read every page of @block, so that all of them are mapped, if only to
+ * the zero page.  Write tracking does not catch writes to unmapped pages.
+ */
+static void ram_block_populate_read(RAMBlock *block)
+{
+    ram_addr_t offset;
+
+    for (offset = 0; offset < block->length; offset += TARGET_PAGE_SIZE) {
+        uint8_t byte = *(volatile uint8_t *)(block->host + offset);
+
+        (void)byte;
+    }
+}
+
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
+    mig_throttle_set(0);
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
 
@@ -802,16 +2786,49 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
 
         acct_clear();
+
+        if (migrate_xbzrle_threads() > 0) {
+            migrate_xbzrle_threads_create();
+        }
+    }
+
+    if (migrate_use_compression()) {
+        migrate_compress_threads_create();
+    }
+
+    /* Not for snapshots, which do not go through a migration URI.  */
+    if (migrate_use_multifd() && migration_in_setup(migrate_get_current()) &&
+        multifd_save_setup() < 0) {
+        return -1;
+    }
+
+    /* Likewise, snapshots are not stored at fixed offsets.  */
+    ram_mapped = migrate_use_mapped_ram() &&
+                 migration_in_setup(migrate_get_current());
+    if (ram_mapped && mapped_ram_save_setup(f) < 0) {
+        mapped_ram_save_cleanup();
+        return -1;
+    }
+
+    ram_zero_runs = migrate_use_zero_page_runs() && !ram_mapped;
+    ram_background = migrate_use_background_snapshot() &&
+                     migration_in_setup(migrate_get_current());
+    if (ram_background) {
+        /* Inflating the balloon would drop pages before they are saved */
+        qemu_balloon_inhibit(true);
     }
 
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
+    ram_postcopy = false;
     reset_ram_globals();
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_bitmap_pages = ram_bitmap_pages;
+    free_page_hinted = false;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -825,16 +2842,34 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         migration_dirty_pages += block_pages;
     }
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    dirty_rate_abort();
+    if (!ram_background) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    }
     qemu_mutex_unlock_iothread();
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    if (ram_background) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            ram_block_populate_read(block);
+        }
+    }
+
+    /* A page that the destination skips stays unpopulated, and postcopy
+     * would then wait for it forever once the guest faults on it.
+     */
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE |
+                  (ram_mapped ? RAM_SAVE_FLAG_MAPPED_RAM : 0) |
+                  (ram_zero_runs && !migrate_postcopy_ram() ?
+                   RAM_SAVE_FLAG_ZERO_RUNS : 0));
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->length);
+        if (ram_mapped) {
+            mapped_ram_put_block_header(f, block);
+        }
     }
 
     qemu_mutex_unlock_ramlist();
@@ -861,6 +2896,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    ram_apply_free_page_hints();
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
@@ -874,7 +2910,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         total_sent += bytes_sent;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -891,6 +2926,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    total_sent += ram_save_zero_run_flush(f);
+    total_sent += flush_compressed_data(f);
+    total_sent += flush_xbzrle_data(f);
+    total_sent += multifd_send_sync(f);
+    mapped_ram_sync(f);
+
     qemu_mutex_unlock_ramlist();
 
     /*
@@ -916,10 +2957,13 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
+/* Called with the iothread lock, but for background snapshots */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
+    if (!ram_background) {
+        migration_bitmap_sync();
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -936,29 +2980,323 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += ram_save_zero_run_flush(f);
+    bytes_transferred += flush_compressed_data(f);
+    bytes_transferred += flush_xbzrle_data(f);
+    bytes_transferred += multifd_send_sync(f);
+    mapped_ram_sync(f);
+    if (ram_mapped) {
+        mapped_ram_save_bitmaps(f);
+    }
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+/* Discard messages are at most 1 + 255 + 16 * n bytes long */
+#define MAX_DISCARDS_PER_COMMAND 512
+
+/*
+ * ram_postcopy_send_discard_bitmap: Switch to postcopy, telling the
+ * destination to drop the pages that are dirty now.  They were modified
+ * after being sent, if they were sent at all, and are sent again during
+ * postcopy.  Needs iothread lock, and the guest must be stopped.
+ */
+int ram_postcopy_send_discard_bitmap(QEMUFile *f)
+{
+    uint64_t start[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length[MAX_DISCARDS_PER_COMMAND];
+    unsigned long base, size, run, end;
+    RAMBlock *block;
+    int n;
+
+    trace_ram_postcopy_send_discard_bitmap();
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        base = block->offset >> TARGET_PAGE_BITS;
+        size = base + (block->length >> TARGET_PAGE_BITS);
+        n = 0;
+
+        run = find_next_bit(migration_bitmap, size, base);
+        while (run < size) {
+            end = find_next_zero_bit(migration_bitmap, size, run);
+            start[n] = (uint64_t)(run - base) << TARGET_PAGE_BITS;
+            length[n] = (uint64_t)(end - run) << TARGET_PAGE_BITS;
+            if (++n == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                      start, length);
+                n = 0;
+            }
+            run = find_next_bit(migration_bitmap, size, end);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                  start, length);
+        }
+    }
+
+    /* Dirty pages are sent in full from now on, and the next one names
+     * its block.
+     */
+    ram_bulk_stage = false;
+    ram_postcopy = true;
+    last_sent_block = NULL;
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size < max_size && !ram_background) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+/* Worker threads for the load-threads parameter.
+ *
+ * The incoming migration thread only reads the stream; the workers copy,
+ * fill or XBZRLE-decode the pages into guest memory, and so also take
+ * the page faults on first access to it.  Each 2 MiB region of guest
+ * memory always goes to the same worker, which keeps the updates of a
+ * page in order and each worker on its own memory.  The workers are
+ * drained at the end of each iteration, like the decompression threads.
+ */
+#define RAM_LOAD_REGION_BITS    21
+#define RAM_LOAD_BATCH_PAGES    64
+
+enum {
+    RAM_LOAD_COPY,
+    RAM_LOAD_FILL,
+    RAM_LOAD_XBZRLE,
+};
+
+typedef struct RAMLoadPage {
+    uint8_t *host;
+    int type;
+    /* Fill byte for RAM_LOAD_FILL, encoded length for RAM_LOAD_XBZRLE */
+    int arg;
+} RAMLoadPage;
+
+typedef struct RAMLoadBatch {
+    int num;
+    RAMLoadPage page[RAM_LOAD_BATCH_PAGES];
+    /* TARGET_PAGE_SIZE bytes of data for each page */
+    uint8_t *data;
+} RAMLoadBatch;
+
+typedef struct RAMLoadParams {
+    QemuThread thread;
+    /* Protects work and quit */
+    QemuMutex mutex;
+    QemuCond cond;
+    RAMLoadBatch *work;
+    bool quit;
+    /* Protected by ram_load_lock; the thread is idle while done is true */
+    bool done;
+    /* The batch that the incoming migration thread fills */
+    RAMLoadBatch *fill;
+    RAMLoadBatch batch[2];
+} RAMLoadParams;
+
+static RAMLoadParams *ram_load_param;
+static int ram_load_count;
+static QemuMutex ram_load_lock;
+static QemuCond ram_load_cond;
+static int ram_load_error;
+
+static void *ram_load_thread(void *opaque)
+{
+    RAMLoadParams *p = opaque;
+    RAMLoadBatch *b;
+    RAMLoadPage *page;
+    uint8_t *data;
+    int i, ret;
+
+    qemu_mutex_lock(&p->mutex);
+    while (!p->quit) {
+        if (!p->work) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+        b = p->work;
+        qemu_mutex_unlock(&p->mutex);
+
+        ret = 0;
+        for (i = 0; i < b->num; i++) {
+            page = &b->page[i];
+            data = b->data + i * TARGET_PAGE_SIZE;
+            switch (page->type) {
+            case RAM_LOAD_COPY:
+                memcpy(page->host, data, TARGET_PAGE_SIZE);
+                break;
+            case RAM_LOAD_FILL:
+                ram_handle_compressed(page->host, page->arg, TARGET_PAGE_SIZE);
+                break;
+            case RAM_LOAD_XBZRLE:
+                if (xbzrle_decode_buffer(data, page->arg, page->host,
+                                         TARGET_PAGE_SIZE) == -1) {
+                    ret = -EINVAL;
+                }
+                break;
+            }
+        }
+        b->num = 0;
+
+        qemu_mutex_lock(&p->mutex);
+        p->work = NULL;
+        qemu_mutex_unlock(&p->mutex);
+
+        qemu_mutex_lock(&ram_load_lock);
+        if (ret < 0 && !ram_load_error) {
+            ram_load_error = ret;
+        }
+        p->done = true;
+        qemu_cond_broadcast(&ram_load_cond);
+        qemu_mutex_unlock(&ram_load_lock);
+
+        qemu_mutex_lock(&p->mutex);
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+/* Hand the batch being filled to the worker, and fill the other one.  */
+static void ram_load_send_batch(RAMLoadParams *p)
+{
+    RAMLoadBatch *b = p->fill;
+
+    qemu_mutex_lock(&ram_load_lock);
+    while (!p->done) {
+        qemu_cond_wait(&ram_load_cond, &ram_load_lock);
+    }
+    p->done = false;
+    qemu_mutex_unlock(&ram_load_lock);
+
+    p->fill = (b == &p->batch[0]) ? &p->batch[1] : &p->batch[0];
+
+    qemu_mutex_lock(&p->mutex);
+    p->work = b;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+}
+
+/* Queue an update of the page at @host; the data of the page, if any,
+ * must be read into the returned buffer.
+ */
+static uint8_t *ram_load_queue_page(uint8_t *host, int type, int arg)
+{
+    RAMLoadParams *p;
+    RAMLoadBatch *b;
+    RAMLoadPage *page;
+
+    p = &ram_load_param[((uintptr_t)host >> RAM_LOAD_REGION_BITS) %
+                        ram_load_count];
+    b = p->fill;
+    if (b->num == RAM_LOAD_BATCH_PAGES) {
+        ram_load_send_batch(p);
+        b = p->fill;
+    }
+
+    page = &b->page[b->num];
+    page->host = host;
+    page->type = type;
+    page->arg = arg;
+    return b->data + b->num++ * TARGET_PAGE_SIZE;
+}
+
+/* Hand the pending pages to the workers, and wait until all are idle.  */
+static int ram_load_sync(void)
+{
+    int ret;
+    int i;
+
+    if (!ram_load_param) {
+        return 0;
+    }
+
+    for (i = 0; i < ram_load_count; i++) {
+        if (ram_load_param[i].fill->num) {
+            ram_load_send_batch(&ram_load_param[i]);
+        }
+    }
+
+    qemu_mutex_lock(&ram_load_lock);
+    for (i = 0; i < ram_load_count; i++) {
+        while (!ram_load_param[i].done) {
+            qemu_cond_wait(&ram_load_cond, &ram_load_lock);
+        }
+    }
+    ret = ram_load_error;
+    qemu_mutex_unlock(&ram_load_lock);
+    return ret;
+}
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
-
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+static void migrate_load_threads_create(void)
+{
+    int i;
 
-    return 0;
+    ram_load_count = migrate_load_threads();
+    ram_load_param = g_new0(RAMLoadParams, ram_load_count);
+    ram_load_error = 0;
+    qemu_mutex_init(&ram_load_lock);
+    qemu_cond_init(&ram_load_cond);
+
+    for (i = 0; i < ram_load_count; i++) {
+        RAMLoadParams *p = &ram_load_param[i];
+
+        p->batch[0].data = g_malloc(RAM_LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        p->batch[1].data = g_malloc(RAM_LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        p->fill = &p->batch[0];
+        p->done = true;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "ram_load", ram_load_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+void migrate_load_threads_join(void)
 {
-    uint64_t remaining_size;
-
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    int i;
 
-    if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    if (!ram_load_param) {
+        return;
     }
-    return remaining_size;
+    ram_load_sync();
+    for (i = 0; i < ram_load_count; i++) {
+        RAMLoadParams *p = &ram_load_param[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+        g_free(p->batch[0].data);
+        g_free(p->batch[1].data);
+    }
+    qemu_mutex_destroy(&ram_load_lock);
+    qemu_cond_destroy(&ram_load_cond);
+    g_free(ram_load_param);
+    ram_load_param = NULL;
 }
 
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
@@ -983,6 +3321,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
         error_report("Failed to load XBZRLE page - len overflow!");
         return -1;
     }
+    if (ram_load_param) {
+        /* The worker decodes the page, see ram_load_thread */
+        qemu_get_buffer(f, ram_load_queue_page(host, RAM_LOAD_XBZRLE, xh_len),
+                        xh_len);
+        return 0;
+    }
+
     /* load data and decode */
     qemu_get_buffer(f, xbzrle_decoded_buf, xh_len);
 
@@ -996,9 +3341,374 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/* Decompression threads for the compress capability.  Pages within one
+ * iteration are distinct, so the threads only need to be waited for at
+ * the end of each iteration.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    /* Protects start and quit */
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* Protected by decomp_done_lock, see CompressParam */
+    bool done;
+    void *des;
+    uint8_t *compbuf;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static bool decomp_error;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    uLongf pagesize;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        pagesize = TARGET_PAGE_SIZE;
+        ret = uncompress(param->des, &pagesize, param->compbuf, param->len);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+            decomp_error = true;
+        }
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    decomp_error = false;
+    for (i = 0; i < decomp_thread_count; i++) {
+        decomp_param[i].compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(&decomp_param[i].thread, "decompress",
+                           do_data_decompress, &decomp_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_thread_join(&decomp_param[i].thread);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    decomp_param = NULL;
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len)
+{
+    DecompressParam *param;
+    int i;
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (;;) {
+        for (i = 0; i < decomp_thread_count; i++) {
+            if (decomp_param[i].done) {
+                break;
+            }
+        }
+        if (i < decomp_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    param = &decomp_param[i];
+    param->done = false;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->compbuf, len);
+    param->des = host;
+    param->len = len;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Wait for all pending pages; returns -1 if one failed to decompress.  */
+static int wait_for_decompress_done(void)
+{
+    int ret = 0;
+    int i;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    if (decomp_error) {
+        decomp_error = false;
+        ret = -1;
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+/* Receiving side of the multifd capability.  Channels are numbered in
+ * the order in which they are accepted; the id sent by the source is
+ * only checked.
+ */
+typedef struct MultiFDRecvParams {
+    QemuThread thread;
+    QEMUFile *file;
+} MultiFDRecvParams;
+
+static MultiFDRecvParams *multifd_recv;
+/* Protect everything below, and the allocation of multifd_recv */
+static QemuMutex multifd_recv_lock;
+static QemuCond multifd_recv_cond;
+static int multifd_recv_count;
+/* Number of channels stopped at the SYNC packet of this round */
+static int multifd_recv_synced;
+static uint64_t multifd_recv_round;
+static bool multifd_recv_error;
+
+static int multifd_recv_pages(QEMUFile *f, uint32_t num)
+{
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    RAMBlock *block;
+    uint8_t *host;
+    char id[256];
+    uint8_t len;
+    int i;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("Can't find block %s!", id);
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+        if ((offset[i] & ~TARGET_PAGE_MASK) || offset[i] >= block->length) {
+            error_report("Invalid offset " RAM_ADDR_FMT " in block %s",
+                         offset[i], id);
+            return -1;
+        }
+    }
+
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, host + offset[i], TARGET_PAGE_SIZE);
+    }
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    uint64_t round = 0;
+    uint32_t flags, num, id, count;
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        error_report("Invalid multifd channel header");
+        goto error;
+    }
+    id = qemu_get_be32(f);
+    count = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        error_report("multifd channel read error");
+        goto error;
+    }
+    if (count != migrate_multifd_channels()) {
+        error_report("Source uses %u multifd channels, but multifd-channels "
+                     "is %d here", count, migrate_multifd_channels());
+        goto error;
+    }
+    if (id >= count) {
+        error_report("Invalid multifd channel id %u", id);
+        goto error;
+    }
+
+    for (;;) {
+        flags = qemu_get_be32(f);
+        num = qemu_get_be32(f);
+        if (num > MULTIFD_PAGES_PER_PACKET) {
+            error_report("Invalid multifd packet with %u pages", num);
+            goto error;
+        }
+        if (num && multifd_recv_pages(f, num) < 0) {
+            goto error;
+        }
+        if (qemu_file_get_error(f)) {
+            error_report("multifd channel read error");
+            goto error;
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            round++;
+            qemu_mutex_lock(&multifd_recv_lock);
+            multifd_recv_synced++;
+            qemu_cond_broadcast(&multifd_recv_cond);
+            while (multifd_recv_round < round && !multifd_recv_error) {
+                qemu_cond_wait(&multifd_recv_cond, &multifd_recv_lock);
+            }
+            qemu_mutex_unlock(&multifd_recv_lock);
+        }
+        if (flags & MULTIFD_FLAG_QUIT) {
+            break;
+        }
+    }
+    return NULL;
+
+error:
+    multifd_recv_abort();
+    return NULL;
+}
+
+void multifd_recv_new_channel(QEMUFile *f)
+{
+    MultiFDRecvParams *p;
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    if (!multifd_recv) {
+        multifd_recv = g_new0(MultiFDRecvParams, migrate_multifd_channels());
+    }
+    p = &multifd_recv[multifd_recv_count++];
+    p->file = f;
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread,
+                       p, QEMU_THREAD_JOINABLE);
+    qemu_mutex_unlock(&multifd_recv_lock);
+}
+
+void multifd_recv_abort(void)
+{
+    qemu_mutex_lock(&multifd_recv_lock);
+    multifd_recv_error = true;
+    qemu_cond_broadcast(&multifd_recv_cond);
+    qemu_mutex_unlock(&multifd_recv_lock);
+}
+
+/* Called at a RAM_SAVE_FLAG_MULTIFD_SYNC marker: wait until every
+ * channel has written the pages of this round, then let them go on.
+ */
+static int multifd_recv_sync(void)
+{
+    int ret = 0;
+
+    if (!migrate_use_multifd()) {
+        error_report("multifd data in stream, but the multifd capability "
+                     "is disabled");
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    while (multifd_recv_synced < migrate_multifd_channels() &&
+           !multifd_recv_error) {
+        qemu_cond_wait(&multifd_recv_cond, &multifd_recv_lock);
+    }
+    if (multifd_recv_error) {
+        ret = -EIO;
+    } else {
+        multifd_recv_synced = 0;
+        multifd_recv_round++;
+        qemu_cond_broadcast(&multifd_recv_cond);
+    }
+    qemu_mutex_unlock(&multifd_recv_lock);
+
+    return ret;
+}
+
+/* Must be called after the thread accepting channels has finished.  */
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (multifd_recv_error) {
+            shutdown(qemu_get_fd(multifd_recv[i].file), SHUT_RDWR);
+        }
+        qemu_thread_join(&multifd_recv[i].thread);
+        qemu_fclose(multifd_recv[i].file);
+    }
+    g_free(multifd_recv);
+    multifd_recv = NULL;
+    multifd_recv_count = 0;
+    multifd_recv_synced = 0;
+    multifd_recv_round = 0;
+    multifd_recv_error = false;
+}
+
+/* Pages of the incoming migration that are known to be zero, because
+ * their block was dropped when the stream started and nothing has
+ * written them since.  Only the incoming migration thread uses it.
+ */
+static unsigned long *ram_load_fresh;
+
+void ram_load_cleanup(void)
+{
+    g_free(ram_load_fresh);
+    ram_load_fresh = NULL;
+}
+
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -1010,7 +3720,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
             return NULL;
         }
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
+        return block;
     }
 
     len = qemu_get_byte(f);
@@ -1019,13 +3729,29 @@ static inline void *host_from_stream_offset(QEMUFile *f,
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+            return block;
     }
 
     error_report("Can't find block %s!", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = ram_block_from_stream(f, flags);
+
+    if (!block) {
+        return NULL;
+    }
+    if (ram_load_fresh) {
+        clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                  ram_load_fresh);
+    }
+    return memory_region_get_ram_ptr(block->mr) + offset;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1037,12 +3763,69 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+static int ram_load_fill_page(void *host, uint8_t ch, bool postcopy_running)
+{
+    if (ram_load_param && !postcopy_running) {
+        ram_load_queue_page(host, RAM_LOAD_FILL, ch);
+    } else if (!postcopy_running) {
+        ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+    } else if (ch == 0) {
+        return postcopy_place_zero_page(host);
+    } else {
+        memset(postcopy_get_tmp_page(), ch, TARGET_PAGE_SIZE);
+        return postcopy_place_page(host, postcopy_get_tmp_page());
+    }
+    return 0;
+}
+
+/* Fill @pages pages at @offset in @block with @ch, for a COMPRESS record.
+ * Zero pages that are still fresh are left alone.
+ */
+static int ram_load_fill(RAMBlock *block, ram_addr_t offset, uint32_t pages,
+                         uint8_t ch, bool postcopy_running)
+{
+    unsigned long first, end, page;
+    uint8_t *host;
+    int ret;
+
+    if (!pages || offset >= block->length ||
+        pages > (block->length - offset) >> TARGET_PAGE_BITS) {
+        error_report("%u pages at " RAM_ADDR_FMT " are outside of "
+                     "RAMBlock %s", pages, offset, block->idstr);
+        return -EINVAL;
+    }
+
+    host = memory_region_get_ram_ptr(block->mr) + offset;
+    first = (block->offset + offset) >> TARGET_PAGE_BITS;
+    end = first + pages;
+
+    for (page = first; page < end; page++) {
+        if (ram_load_fresh && ch == 0) {
+            page = find_next_zero_bit(ram_load_fresh, end, page);
+            if (page >= end) {
+                break;
+            }
+        } else if (ram_load_fresh) {
+            clear_bit(page, ram_load_fresh);
+        }
+        ret = ram_load_fill_page(host + ((page - first) << TARGET_PAGE_BITS),
+                                 ch, postcopy_running);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    /* Pages must be placed atomically once the guest may run here */
+    bool postcopy_running = postcopy_state_get() >=
+                            POSTCOPY_INCOMING_LISTENING;
 
     seq_iter++;
 
@@ -1051,6 +3834,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         goto done;
     }
 
+    /* Only incoming migration joins the workers once it is over.  */
+    if (!ram_load_param && !postcopy_running && migrate_load_threads() > 0 &&
+        runstate_check(RUN_STATE_INMIGRATE)) {
+        migrate_load_threads_create();
+    }
+
     do {
         addr = qemu_get_be64(f);
 
@@ -1062,6 +3851,18 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             char id[256];
             ram_addr_t length;
             ram_addr_t total_ram_bytes = addr;
+            /* Multifd channels write pages behind our back, and mapped-ram
+             * loads whole blocks by itself.  Snapshots keep their RAM.
+             */
+            bool discard = (flags & RAM_SAVE_FLAG_ZERO_RUNS) &&
+                           !(flags & RAM_SAVE_FLAG_MAPPED_RAM) &&
+                           !migrate_use_multifd() &&
+                           runstate_check(RUN_STATE_INMIGRATE);
+
+            if (discard && !ram_load_fresh) {
+                ram_load_fresh = bitmap_new(last_ram_offset() >>
+                                            TARGET_PAGE_BITS);
+            }
 
             while (total_ram_bytes) {
                 RAMBlock *block;
@@ -1092,22 +3893,45 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     goto done;
                 }
 
+                if (flags & RAM_SAVE_FLAG_MAPPED_RAM) {
+                    ret = ram_load_mapped_block(f, block);
+                    if (ret < 0) {
+                        goto done;
+                    }
+                } else if (discard) {
+                    int r = qemu_ram_discard(block);
+
+                    trace_ram_load_discard_block(block->idstr, r);
+                    if (r == 0) {
+                        bitmap_set(ram_load_fresh,
+                                   block->offset >> TARGET_PAGE_BITS,
+                                   length >> TARGET_PAGE_BITS);
+                    }
+                }
+
                 total_ram_bytes -= length;
             }
         }
 
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
+            RAMBlock *block;
+            uint32_t pages = 1;
             uint8_t ch;
 
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
+            block = ram_block_from_stream(f, flags);
+            if (!block) {
                 ret = -EINVAL;
                 goto done;
             }
 
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (flags & RAM_SAVE_FLAG_RUN) {
+                pages = qemu_get_be32(f);
+            }
+            ret = ram_load_fill(block, addr, pages, ch, postcopy_running);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -1117,7 +3941,44 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 goto done;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (ram_load_param && !postcopy_running) {
+                qemu_get_buffer(f, ram_load_queue_page(host, RAM_LOAD_COPY, 0),
+                                TARGET_PAGE_SIZE);
+            } else if (!postcopy_running) {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            } else {
+                qemu_get_buffer(f, postcopy_get_tmp_page(), TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, postcopy_get_tmp_page());
+                if (ret < 0) {
+                    goto done;
+                }
+            }
+        } else if (postcopy_running &&
+                   (flags & (RAM_SAVE_FLAG_COMPRESS_PAGE |
+                             RAM_SAVE_FLAG_XBZRLE))) {
+            error_report("Unexpected RAM flags in postcopy: %x", flags);
+            ret = -EINVAL;
+            goto done;
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            int len;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                goto done;
+            }
+            if (!decomp_param) {
+                migrate_decompress_threads_create();
+            }
+            decompress_data_with_multi_threads(f, host, len);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -1129,6 +3990,24 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            /* A page filled or decompressed late could overwrite the
+             * newer copy that a channel writes in the next round.
+             */
+            if (wait_for_decompress_done() < 0) {
+                error_report("Failed to decompress page");
+                ret = -EINVAL;
+                goto done;
+            }
+            if (ram_load_sync() < 0) {
+                error_report("Failed to load XBZRLE page - decode error!");
+                ret = -EINVAL;
+                goto done;
+            }
+            ret = multifd_recv_sync();
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         }
@@ -1140,6 +4019,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        error_report("Failed to decompress page");
+        ret = -EINVAL;
+    }
+    if (ram_load_sync() < 0 && ret == 0) {
+        error_report("Failed to load XBZRLE page - decode error!");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1151,12 +4038,20 @@ static SaveVMHandlers savevm_ram_handlers = {
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
+    .load_state_unlocked = true,
     .cancel = ram_migration_cancel,
 };
 
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&page_request_mutex);
+    qemu_mutex_init(&free_page_hint_mutex);
+    free_page_hints = g_array_new(false, false, sizeof(RAMFreePageHint));
+    qemu_mutex_init(&multifd_recv_lock);
+    qemu_cond_init(&multifd_recv_cond);
+    mig_throttle_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                      mig_throttle_timer_tick, NULL);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
@@ -1369,47 +4264,67 @@ TargetInfo *qmp_query_target(Error **errp)
    VM to run inside qemu via async_run_on_cpu()*/
 static void mig_sleep_cpu(void *opq)
 {
+    int64_t sleep_ns = mig_throttle_sleep_ns(mig_throttle_get());
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(sleep_ns / 1000);
     qemu_mutex_lock_iothread();
 }
 
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
    much time in the VM. The migration thread will try to catchup.
    Workload will experience a performance drop.
+   Runs in the main loop, with the iothread lock held.
 */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int pct = mig_throttle_get();
 
-    qemu_mutex_lock_iothread();
+    if (!pct) {
+        return;
+    }
     CPU_FOREACH(cpu) {
         async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
     }
-    qemu_mutex_unlock_iothread();
+    timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+              MIG_THROTTLE_TIMESLICE_NS + mig_throttle_sleep_ns(pct));
 }
 
-static void check_guest_throttling(void)
+static void mig_throttle_set(int pct)
 {
-    static int64_t t0;
-    int64_t        t1;
+    int old_pct = atomic_xchg(&mig_throttle_pct, pct);
 
-    if (!mig_throttle_on) {
-        return;
+    if (pct && !old_pct) {
+        timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    } else if (!pct && old_pct) {
+        timer_del(mig_throttle_timer);
     }
+}
+
+/* Choose the throttle so that the guest dirties memory at about half the
+   rate it is sent at, assuming that the dirty rate is proportional to the
+   time the vCPUs are allowed to run.
+*/
+static void mig_throttle_update(int64_t bytes_dirtied, int64_t bytes_xfer)
+{
+    int pct = mig_throttle_get();
+    double run;
 
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (bytes_xfer <= 0) {
         return;
     }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
+    if (bytes_dirtied <= 0) {
+        pct = 0;
+    } else {
+        run = (100 - pct) * ((double)bytes_xfer / 2 / bytes_dirtied);
+        pct = run >= 100 ? 0 : MIN(100 - (int)run, MIG_THROTTLE_MAX_PCT);
     }
+    trace_migration_throttle(bytes_dirtied, bytes_xfer, pct);
+    mig_throttle_set(pct);
+}
+
+int auto_converge_throttle_percentage(void)
+{
+    return mig_throttle_get();
 }
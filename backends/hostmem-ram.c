@@ -0,0 +1,37 @@
+/*
+ * QEMU Host Memory Backend
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "sysemu/hostmem.h"
+
+static void ram_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
+{
+    char *name = object_get_canonical_path_component(OBJECT(backend));
+
+    memory_region_init_ram(&backend->mr, OBJECT(backend), name, backend->size);
+    g_free(name);
+}
+
+static void ram_backend_class_init(ObjectClass *oc, void *data)
+{
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(oc);
+
+    bc->alloc = ram_backend_memory_alloc;
+}
+
+static const TypeInfo ram_backend_info = {
+    .name = TYPE_MEMORY_BACKEND_RAM,
+    .parent = TYPE_MEMORY_BACKEND,
+    .class_init = ram_backend_class_init,
+};
+
+static void register_types(void)
+{
+    type_register_static(&ram_backend_info);
+}
+
+type_init(register_types);
@@ -0,0 +1,393 @@
+/*
+ * QEMU Host Memory Backend
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "sysemu/hostmem.h"
+#include "qapi/visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/config-file.h"
+#include "qom/object_interfaces.h"
+
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+/*
+ * A memory backend owns a RAM MemoryRegion that machine code maps into
+ * guest physical memory, for example one per guest NUMA node with
+ * "-numa node,memdev=<id>".  The subclasses only allocate the memory;
+ * merging, dumping, NUMA policy and preallocation are applied here once
+ * the object is complete.
+ */
+
+static const char *const host_mem_policy_names[HOST_MEM_POLICY_MAX] = {
+    [HOST_MEM_POLICY_DEFAULT] = "default",
+    [HOST_MEM_POLICY_PREFERRED] = "preferred",
+    [HOST_MEM_POLICY_BIND] = "bind",
+    [HOST_MEM_POLICY_INTERLEAVE] = "interleave",
+};
+
+static bool host_memory_backend_allocated(HostMemoryBackend *backend)
+{
+    return memory_region_size(&backend->mr) != 0;
+}
+
+static void
+host_memory_backend_get_size(Object *obj, Visitor *v, void *opaque,
+                             const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    uint64_t value = backend->size;
+
+    visit_type_size(v, &value, name, errp);
+}
+
+static void
+host_memory_backend_set_size(Object *obj, Visitor *v, void *opaque,
+                             const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    if (host_memory_backend_allocated(backend)) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    visit_type_size(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (!value) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "size",
+                  "a non-zero size");
+        return;
+    }
+    backend->size = value;
+}
+
+static char *host_memory_backend_get_host_nodes(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    GString *str = g_string_new("");
+    long first, last;
+
+    first = find_first_bit(backend->host_nodes, MAX_NODES);
+    while (first < MAX_NODES) {
+        last = find_next_zero_bit(backend->host_nodes, MAX_NODES, first) - 1;
+        if (str->len) {
+            g_string_append_c(str, ',');
+        }
+        if (first == last) {
+            g_string_append_printf(str, "%ld", first);
+        } else {
+            g_string_append_printf(str, "%ld-%ld", first, last);
+        }
+        first = find_next_bit(backend->host_nodes, MAX_NODES, last + 1);
+    }
+    return g_string_free(str, false);
+}
+
+/* Parse a list of host node ranges, like "0-3,6".  */
+static void host_memory_backend_set_host_nodes(Object *obj, const char *str,
+                                               Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    DECLARE_BITMAP(nodes, MAX_NODES + 1);
+    unsigned long long first, last;
+    const char *p = str;
+    char *end;
+
+    if (host_memory_backend_allocated(backend)) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    bitmap_zero(nodes, MAX_NODES + 1);
+    while (*p) {
+        if (parse_uint(p, &first, &end, 10) < 0) {
+            goto invalid;
+        }
+        last = first;
+        if (*end == '-' && parse_uint(end + 1, &last, &end, 10) < 0) {
+            goto invalid;
+        }
+        if (first > last || last >= MAX_NODES) {
+            goto invalid;
+        }
+        bitmap_set(nodes, first, last - first + 1);
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            goto invalid;
+        }
+        p = end;
+    }
+    bitmap_copy(backend->host_nodes, nodes, MAX_NODES + 1);
+    return;
+
+invalid:
+    error_set(errp, QERR_INVALID_PARAMETER_VALUE, "host-nodes",
+              "a list of host node ranges");
+}
+
+static char *host_memory_backend_get_policy(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return g_strdup(host_mem_policy_names[backend->policy]);
+}
+
+static void host_memory_backend_set_policy(Object *obj, const char *str,
+                                           Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    int i;
+
+    if (host_memory_backend_allocated(backend)) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    for (i = 0; i < HOST_MEM_POLICY_MAX; i++) {
+        if (!strcmp(str, host_mem_policy_names[i])) {
+            backend->policy = i;
+            return;
+        }
+    }
+    error_set(errp, QERR_INVALID_PARAMETER_VALUE, "policy",
+              "default, preferred, bind or interleave");
+}
+
+static bool host_memory_backend_get_merge(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->merge;
+}
+
+static void host_memory_backend_set_merge(Object *obj, bool value,
+                                          Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_allocated(backend) && value != backend->merge) {
+        void *ptr = memory_region_get_ram_ptr(&backend->mr);
+        uint64_t sz = memory_region_size(&backend->mr);
+
+        qemu_madvise(ptr, sz,
+                     value ? QEMU_MADV_MERGEABLE : QEMU_MADV_UNMERGEABLE);
+    }
+    backend->merge = value;
+}
+
+static bool host_memory_backend_get_dump(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->dump;
+}
+
+static void host_memory_backend_set_dump(Object *obj, bool value,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_allocated(backend) && value != backend->dump) {
+        void *ptr = memory_region_get_ram_ptr(&backend->mr);
+        uint64_t sz = memory_region_size(&backend->mr);
+
+        qemu_madvise(ptr, sz,
+                     value ? QEMU_MADV_DODUMP : QEMU_MADV_DONTDUMP);
+    }
+    backend->dump = value;
+}
+
+static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->prealloc;
+}
+
+static void host_memory_backend_set_prealloc(Object *obj, bool value,
+                                             Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_allocated(backend)) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    backend->prealloc = value;
+}
+
+static void host_memory_backend_init(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    backend->merge = qemu_opt_get_bool(qemu_get_machine_opts(),
+                                       "mem-merge", true);
+    backend->dump = qemu_opt_get_bool(qemu_get_machine_opts(),
+                                      "dump-guest-core", true);
+    backend->prealloc = mem_prealloc;
+
+    object_property_add(obj, "size", "int",
+                        host_memory_backend_get_size,
+                        host_memory_backend_set_size, NULL, NULL, NULL);
+    object_property_add_bool(obj, "merge",
+                             host_memory_backend_get_merge,
+                             host_memory_backend_set_merge, NULL);
+    object_property_add_bool(obj, "dump",
+                             host_memory_backend_get_dump,
+                             host_memory_backend_set_dump, NULL);
+    object_property_add_bool(obj, "prealloc",
+                             host_memory_backend_get_prealloc,
+                             host_memory_backend_set_prealloc, NULL);
+    object_property_add_str(obj, "host-nodes",
+                            host_memory_backend_get_host_nodes,
+                            host_memory_backend_set_host_nodes, NULL);
+    object_property_add_str(obj, "policy",
+                            host_memory_backend_get_policy,
+                            host_memory_backend_set_policy, NULL);
+}
+
+static void host_memory_backend_finalize(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_allocated(backend)) {
+        memory_region_destroy(&backend->mr);
+    }
+}
+
+MemoryRegion *
+host_memory_backend_get_memory(HostMemoryBackend *backend, Error **errp)
+{
+    if (!host_memory_backend_allocated(backend)) {
+        error_setg(errp, "memory backend '%s' is not ready",
+                   object_get_canonical_path_component(OBJECT(backend)));
+        return NULL;
+    }
+    return &backend->mr;
+}
+
+static void host_memory_backend_apply_policy(HostMemoryBackend *backend,
+                                             void *ptr, uint64_t sz,
+                                             Error **errp)
+{
+#if defined(CONFIG_LINUX) && defined(__NR_mbind)
+    static const int modes[HOST_MEM_POLICY_MAX] = {
+        [HOST_MEM_POLICY_DEFAULT] = MPOL_DEFAULT,
+        [HOST_MEM_POLICY_PREFERRED] = MPOL_PREFERRED,
+        [HOST_MEM_POLICY_BIND] = MPOL_BIND,
+        [HOST_MEM_POLICY_INTERLEAVE] = MPOL_INTERLEAVE,
+    };
+    unsigned long maxnode;
+
+    maxnode = find_last_bit(backend->host_nodes, MAX_NODES);
+    if (maxnode == MAX_NODES) {
+        if (backend->policy != HOST_MEM_POLICY_DEFAULT) {
+            error_setg(errp, "host-nodes must be set for policy %s",
+                       host_mem_policy_names[backend->policy]);
+        }
+        return;
+    }
+    if (backend->policy == HOST_MEM_POLICY_DEFAULT) {
+        error_setg(errp, "host-nodes requires a policy other than default");
+        return;
+    }
+
+    /* The kernel takes the number of bits to consider, plus one (it
+       ignores the last bit).  MPOL_MF_STRICT makes mbind fail if
+       pages were already allocated elsewhere, e.g. by -mem-prealloc.  */
+    if (syscall(__NR_mbind, ptr, sz, modes[backend->policy],
+                backend->host_nodes, maxnode + 2,
+                MPOL_MF_STRICT | MPOL_MF_MOVE)) {
+        error_setg_errno(errp, errno, "cannot bind memory to host NUMA nodes");
+    }
+#else
+    if (backend->policy != HOST_MEM_POLICY_DEFAULT ||
+        !bitmap_empty(backend->host_nodes, MAX_NODES)) {
+        error_setg(errp, "NUMA node binding is not supported by this host");
+    }
+#endif
+}
+
+static void host_memory_backend_complete(UserCreatable *uc, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(uc);
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_GET_CLASS(uc);
+    Error *local_err = NULL;
+    void *ptr;
+    uint64_t sz;
+
+    if (!backend->size) {
+        error_set(errp, QERR_MISSING_PARAMETER, "size");
+        return;
+    }
+
+    bc->alloc(backend, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    ptr = memory_region_get_ram_ptr(&backend->mr);
+    sz = memory_region_size(&backend->mr);
+
+    qemu_madvise(ptr, sz, backend->merge ? QEMU_MADV_MERGEABLE :
+                                           QEMU_MADV_UNMERGEABLE);
+    qemu_madvise(ptr, sz, backend->dump ? QEMU_MADV_DODUMP :
+                                          QEMU_MADV_DONTDUMP);
+
+    /* Bind before touching the pages, so that they are allocated on
+       the right nodes.  */
+    host_memory_backend_apply_policy(backend, ptr, sz, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (backend->prealloc &&
+        os_mem_prealloc(ptr, sz, memory_region_get_page_size(&backend->mr),
+                        mem_prealloc_threads) < 0) {
+        error_setg(errp, "cannot preallocate memory for backend '%s'",
+                   object_get_canonical_path_component(OBJECT(backend)));
+    }
+}
+
+static void host_memory_backend_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = host_memory_backend_complete;
+}
+
+static const TypeInfo host_memory_backend_info = {
+    .name = TYPE_MEMORY_BACKEND,
+    .parent = TYPE_OBJECT,
+    .abstract = true,
+    .class_size = sizeof(HostMemoryBackendClass),
+    .class_init = host_memory_backend_class_init,
+    .instance_size = sizeof(HostMemoryBackend),
+    .instance_init = host_memory_backend_init,
+    .instance_finalize = host_memory_backend_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void register_types(void)
+{
+    type_register_static(&host_memory_backend_info);
+}
+
+type_init(register_types);
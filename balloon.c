@@ -28,6 +28,7 @@
 #include "exec/cpu-common.h"
 #include "sysemu/kvm.h"
 #include "sysemu/balloon.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "qmp-commands.h"
 #include "qapi/qmp/qjson.h"
@@ -35,6 +36,18 @@
 static QEMUBalloonEvent *balloon_event_fn;
 static QEMUBalloonStatus *balloon_stat_fn;
 static void *balloon_opaque;
+static bool balloon_inhibited;
+
+/* While inhibited, the balloon keeps the memory of inflated pages */
+void qemu_balloon_inhibit(bool state)
+{
+    atomic_mb_set(&balloon_inhibited, state);
+}
+
+bool qemu_balloon_is_inhibited(void)
+{
+    return atomic_mb_read(&balloon_inhibited);
+}
 
 int qemu_add_balloon_handler(QEMUBalloonEvent *event_func,
                              QEMUBalloonStatus *stat_func, void *opaque)
@@ -2113,6 +2113,25 @@ static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
     return ret;
 }
 
+/* Aligned requests go straight to qcow2_co_writev, without the changes
+ * to bs->growable and bs->total_sectors that would get in the way of
+ * concurrent requests.  Unaligned ones must not run alongside others.
+ */
+static coroutine_fn int qcow2_co_save_vmstate(BlockDriverState *bs,
+                                              QEMUIOVector *qiov, int64_t pos)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset = qcow2_vm_state_offset(s) + pos;
+
+    if ((offset | qiov->size) & (BDRV_SECTOR_SIZE - 1)) {
+        return qcow2_save_vmstate(bs, qiov, pos);
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
+    return qcow2_co_writev(bs, offset >> BDRV_SECTOR_BITS,
+                           qiov->size >> BDRV_SECTOR_BITS, qiov);
+}
+
 static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                               int64_t pos, int size)
 {
@@ -2399,6 +2418,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_get_specific_info = qcow2_get_specific_info,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
+    .bdrv_co_save_vmstate = qcow2_co_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
@@ -166,7 +166,8 @@ static void dma_bdrv_cb(void *opaque, int ret)
 
     if (dbs->iov.size == 0) {
         trace_dma_map_wait(dbs);
-        cpu_register_map_client(dbs, continue_after_map_failure);
+        address_space_register_map_client(dbs->sg->as, dbs,
+                                           continue_after_map_failure);
         return;
     }
 
@@ -36,6 +36,7 @@
 #include "qemu/error-report.h"
 #include "exec/memory.h"
 #include "sysemu/dma.h"
+#include "sysemu/hostmem.h"
 #include "exec/address-spaces.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
@@ -53,6 +54,7 @@
 #include "qemu/cache-utils.h"
 
 #include "qemu/range.h"
+#include "qemu/rcu.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -107,19 +109,25 @@ typedef PhysPageEntry Node[P_L2_SIZE];
 typedef struct PhysPageMap {
     unsigned sections_nb;
     unsigned sections_nb_alloc;
+    unsigned sections_free;
     unsigned nodes_nb;
     unsigned nodes_nb_alloc;
     Node *nodes;
     MemoryRegionSection *sections;
+    /* MemoryRegions of the sections removed since the last commit */
+    GSList *released;
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
+    bool changed;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -127,6 +135,8 @@ typedef struct subpage_t {
     MemoryRegion iomem;
     AddressSpace *as;
     hwaddr base;
+    /* Visible to readers through as->dispatch, and hence read-only */
+    bool published;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
 
@@ -360,8 +370,10 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     MemoryRegion *mr;
     hwaddr len = *plen;
 
+    rcu_read_lock();
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -387,6 +399,7 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
 
     *plen = len;
     *xlat = addr;
+    rcu_read_unlock();
     return mr;
 }
 
@@ -395,7 +408,9 @@ address_space_translate_for_iotlb(AddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
 {
     MemoryRegionSection *section;
-    section = address_space_translate_internal(as->dispatch, addr, xlat, plen, false);
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    section = address_space_translate_internal(d, addr, xlat, plen, false);
 
     assert(!section->mr->iommu_ops);
     return section;
@@ -856,6 +871,18 @@ void phys_mem_set_alloc(void *(*alloc)(size_t))
 static uint16_t phys_section_add(PhysPageMap *map,
                                  MemoryRegionSection *section)
 {
+    unsigned i;
+
+    if (map->sections_free) {
+        for (i = PHYS_SECTION_WATCH + 1; map->sections[i].mr; i++) {
+            /* find the slot of a removed section */
+        }
+        map->sections_free--;
+        map->sections[i] = *section;
+        memory_region_ref(section->mr);
+        return i;
+    }
+
     /* The physical section number is ORed with a page-aligned
      * pointer to produce the iotlb entries.  Thus it should
      * never overflow into the page-aligned value.
@@ -883,16 +910,66 @@ static void phys_section_destroy(MemoryRegion *mr)
     }
 }
 
+/* Remove a section from the map.  The copy of the map used for lookups
+ * may still point to it, so its MemoryRegion is only released by
+ * phys_sections_release at the next commit.
+ */
+static void phys_section_remove(PhysPageMap *map, uint16_t section)
+{
+    MemoryRegion *mr = map->sections[section].mr;
+
+    assert(section > PHYS_SECTION_WATCH && mr);
+    map->sections[section].mr = NULL;
+    map->sections_free++;
+    map->released = g_slist_prepend(map->released, mr);
+}
+
+static void phys_sections_release(PhysPageMap *map)
+{
+    GSList *l;
+
+    for (l = map->released; l; l = l->next) {
+        phys_section_destroy(l->data);
+    }
+    g_slist_free(map->released);
+    map->released = NULL;
+}
+
 static void phys_sections_free(PhysPageMap *map)
 {
     while (map->sections_nb > 0) {
         MemoryRegionSection *section = &map->sections[--map->sections_nb];
-        phys_section_destroy(section->mr);
+        if (section->mr) {
+            phys_section_destroy(section->mr);
+        }
     }
+    phys_sections_release(map);
     g_free(map->sections);
     g_free(map->nodes);
 }
 
+/* A subpage that was published with as->dispatch cannot be modified in
+ * place; replace it with a private copy.  The old one is released with
+ * the removed sections.
+ */
+static subpage_t *subpage_get_writable(AddressSpaceDispatch *d,
+                                       MemoryRegionSection *existing)
+{
+    subpage_t *subpage = container_of(existing->mr, subpage_t, iomem);
+    subpage_t *copy;
+
+    if (!subpage->published) {
+        return subpage;
+    }
+
+    copy = subpage_init(d->as, subpage->base);
+    memcpy(copy->sub_section, subpage->sub_section,
+           sizeof(copy->sub_section));
+    d->map.released = g_slist_prepend(d->map.released, existing->mr);
+    existing->mr = &copy->iomem;
+    return copy;
+}
+
 static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *section)
 {
     subpage_t *subpage;
@@ -915,7 +992,7 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
                       phys_section_add(&d->map, &subsection));
     } else {
-        subpage = container_of(existing->mr, subpage_t, iomem);
+        subpage = subpage_get_writable(d, existing);
     }
     start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
     end = start + int128_get64(section->size) - 1;
@@ -924,6 +1001,33 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
 }
 
 
+static void unregister_subpage(AddressSpaceDispatch *d,
+                               MemoryRegionSection *section)
+{
+    subpage_t *subpage;
+    hwaddr base = section->offset_within_address_space
+        & TARGET_PAGE_MASK;
+    MemoryRegionSection *existing = phys_page_find(d->phys_map, base,
+                                                   d->map.nodes, d->map.sections);
+    hwaddr start, end;
+    int i;
+
+    assert(existing->mr->subpage);
+    subpage = subpage_get_writable(d, existing);
+    start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
+    end = start + int128_get64(section->size) - 1;
+    phys_section_remove(&d->map, subpage->sub_section[start]);
+    subpage_register(subpage, start, end, PHYS_SECTION_UNASSIGNED);
+
+    for (i = 0; i < TARGET_PAGE_SIZE; i++) {
+        if (subpage->sub_section[i] != PHYS_SECTION_UNASSIGNED) {
+            return;
+        }
+    }
+    phys_section_remove(&d->map, existing - d->map.sections);
+    phys_page_set(d, base >> TARGET_PAGE_BITS, 1, PHYS_SECTION_UNASSIGNED);
+}
+
 static void register_multipage(AddressSpaceDispatch *d,
                                MemoryRegionSection *section)
 {
@@ -936,19 +1040,43 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
-static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
+static void unregister_multipage(AddressSpaceDispatch *d,
+                                 MemoryRegionSection *section)
+{
+    hwaddr start_addr = section->offset_within_address_space;
+    MemoryRegionSection *existing = phys_page_find(d->phys_map, start_addr,
+                                                   d->map.nodes, d->map.sections);
+    uint64_t num_pages = int128_get64(int128_rshift(section->size,
+                                                    TARGET_PAGE_BITS));
+
+    assert(existing->mr == section->mr);
+    phys_section_remove(&d->map, existing - d->map.sections);
+    phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages,
+                  PHYS_SECTION_UNASSIGNED);
+}
+
+/* Split a section into the partial pages at its ends, which go through
+ * a subpage, and the run of whole pages in the middle; then map or unmap
+ * each part in the dispatch tree.
+ */
+static void mem_update(AddressSpaceDispatch *d, MemoryRegionSection *section,
+                       bool add)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
+    bool subpage;
 
+    d->changed = true;
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
 
         now.size = int128_min(int128_make64(left), now.size);
-        register_subpage(d, &now);
+        if (add) {
+            register_subpage(d, &now);
+        } else {
+            unregister_subpage(d, &now);
+        }
     } else {
         now.size = int128_zero();
     }
@@ -957,18 +1085,45 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
         remain.offset_within_address_space += int128_get64(now.size);
         remain.offset_within_region += int128_get64(now.size);
         now = remain;
+        subpage = true;
         if (int128_lt(remain.size, page_size)) {
-            register_subpage(d, &now);
+            /* the tail of the section */
         } else if (remain.offset_within_address_space & ~TARGET_PAGE_MASK) {
             now.size = page_size;
-            register_subpage(d, &now);
         } else {
             now.size = int128_and(now.size, int128_neg(page_size));
-            register_multipage(d, &now);
+            subpage = false;
+        }
+        if (subpage) {
+            if (add) {
+                register_subpage(d, &now);
+            } else {
+                unregister_subpage(d, &now);
+            }
+        } else {
+            if (add) {
+                register_multipage(d, &now);
+            } else {
+                unregister_multipage(d, &now);
+            }
         }
     }
 }
 
+static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    mem_update(as->next_dispatch, section, true);
+}
+
+static void mem_del(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    mem_update(as->next_dispatch, section, false);
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
@@ -1011,16 +1166,11 @@ static long gethugepagesize(const char *path)
     return fs.f_bsize;
 }
 
-static sigjmp_buf sigjump;
-
-static void sigbus_handler(int signal)
-{
-    siglongjmp(sigjump, 1);
-}
-
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            bool share,
+                            bool prealloc)
 {
     char *filename;
     char *sanitized_name;
@@ -1074,53 +1224,25 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    area = mmap(0, memory, PROT_READ | PROT_WRITE,
+                share ? MAP_SHARED : MAP_PRIVATE, fd, 0);
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         goto error;
     }
 
-    if (mem_prealloc) {
-        int ret, i;
-        struct sigaction act, oldact;
-        sigset_t set, oldset;
-
-        memset(&act, 0, sizeof(act));
-        act.sa_handler = &sigbus_handler;
-        act.sa_flags = 0;
-
-        ret = sigaction(SIGBUS, &act, &oldact);
-        if (ret) {
-            perror("file_ram_alloc: failed to install signal handler");
-            exit(1);
-        }
-
-        /* unblock SIGBUS */
-        sigemptyset(&set);
-        sigaddset(&set, SIGBUS);
-        pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-        if (sigsetjmp(sigjump, 1)) {
-            fprintf(stderr, "file_ram_alloc: failed to preallocate pages\n");
-            exit(1);
-        }
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < (memory/hpagesize); i++) {
-            memset(area + (hpagesize*i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("file_ram_alloc: failed to reinstall signal handler");
-            exit(1);
-        }
-
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (prealloc &&
+        os_mem_prealloc(area, memory, hpagesize, mem_prealloc_threads) < 0) {
+        fprintf(stderr, "file_ram_alloc: failed to preallocate pages\n");
+        exit(1);
     }
 
     block->fd = fd;
+    block->page_size = hpagesize;
+    if (share) {
+        block->flags |= RAM_SHARED;
+    }
     return area;
 
 error:
@@ -1132,7 +1254,9 @@ error:
 #else
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            bool share,
+                            bool prealloc)
 {
     fprintf(stderr, "-mem-path not supported on this host\n");
     exit(1);
@@ -1246,56 +1370,33 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
-                                   MemoryRegion *mr)
+static ram_addr_t ram_block_add(RAMBlock *new_block)
 {
-    RAMBlock *block, *new_block;
+    RAMBlock *block;
+    ram_addr_t size = new_block->length;
     ram_addr_t old_ram_size, new_ram_size;
 
     old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
-    size = TARGET_PAGE_ALIGN(size);
-    new_block = g_malloc0(sizeof(*new_block));
-    new_block->fd = -1;
-
     /* This assumes the iothread lock is taken here too.  */
     qemu_mutex_lock_ramlist();
-    new_block->mr = mr;
     new_block->offset = find_ram_offset(size);
-    if (host) {
-        new_block->host = host;
-        new_block->flags |= RAM_PREALLOC_MASK;
+    if (!new_block->page_size) {
+        new_block->page_size = getpagesize();
+    }
+    if (new_block->host) {
+        /* preallocated by the caller */
     } else if (xen_enabled()) {
-        if (mem_path) {
-            fprintf(stderr, "-mem-path not supported with Xen\n");
-            exit(1);
-        }
-        xen_ram_alloc(new_block->offset, size, mr);
+        xen_ram_alloc(new_block->offset, size, new_block->mr);
     } else {
-        if (mem_path) {
-            if (phys_mem_alloc != qemu_anon_ram_alloc) {
-                /*
-                 * file_ram_alloc() needs to allocate just like
-                 * phys_mem_alloc, but we haven't bothered to provide
-                 * a hook there.
-                 */
-                fprintf(stderr,
-                        "-mem-path not supported with this accelerator\n");
-                exit(1);
-            }
-            new_block->host = file_ram_alloc(new_block, size, mem_path);
-        }
+        new_block->host = phys_mem_alloc(size);
         if (!new_block->host) {
-            new_block->host = phys_mem_alloc(size);
-            if (!new_block->host) {
-                fprintf(stderr, "Cannot set up guest memory '%s': %s\n",
-                        new_block->mr->name, strerror(errno));
-                exit(1);
-            }
-            memory_try_enable_merging(new_block->host, size);
+            fprintf(stderr, "Cannot set up guest memory '%s': %s\n",
+                    new_block->mr->name, strerror(errno));
+            exit(1);
         }
+        memory_try_enable_merging(new_block->host, size);
     }
-    new_block->length = size;
 
     /* Keep the list sorted from biggest to smallest block.  */
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
@@ -1335,6 +1436,78 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     return new_block->offset;
 }
 
+#ifdef __linux__
+ram_addr_t qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
+                                    bool share, const char *mem_path,
+                                    Error **errp)
+{
+    RAMBlock *new_block;
+
+    if (xen_enabled()) {
+        error_setg(errp, "memory backed by a file is not supported with Xen");
+        return -1;
+    }
+    if (phys_mem_alloc != qemu_anon_ram_alloc) {
+        /* See qemu_ram_alloc_from_ptr.  */
+        error_setg(errp, "memory backed by a file is not supported with "
+                   "this accelerator");
+        return -1;
+    }
+
+    size = TARGET_PAGE_ALIGN(size);
+    new_block = g_malloc0(sizeof(*new_block));
+    new_block->fd = -1;
+    new_block->mr = mr;
+    new_block->length = size;
+    /* The memory backend preallocates once the memory is bound to its
+     * host nodes, see host_memory_backend_complete.
+     */
+    new_block->host = file_ram_alloc(new_block, size, mem_path, share, false);
+    if (!new_block->host) {
+        error_setg(errp, "cannot allocate %s from %s", mr->name, mem_path);
+        g_free(new_block);
+        return -1;
+    }
+    return ram_block_add(new_block);
+}
+#endif
+
+ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
+                                   MemoryRegion *mr)
+{
+    RAMBlock *new_block;
+
+    size = TARGET_PAGE_ALIGN(size);
+    new_block = g_malloc0(sizeof(*new_block));
+    new_block->fd = -1;
+    new_block->mr = mr;
+    new_block->length = size;
+    if (host) {
+        new_block->host = host;
+        new_block->flags |= RAM_PREALLOC_MASK;
+    } else if (mem_path) {
+        if (xen_enabled()) {
+            fprintf(stderr, "-mem-path not supported with Xen\n");
+            exit(1);
+        }
+        if (phys_mem_alloc != qemu_anon_ram_alloc) {
+            /*
+             * file_ram_alloc() needs to allocate just like
+             * phys_mem_alloc, but we haven't bothered to provide
+             * a hook there.
+             */
+            fprintf(stderr,
+                    "-mem-path not supported with this accelerator\n");
+            exit(1);
+        }
+        new_block->host = file_ram_alloc(new_block, size, mem_path, false,
+                                         mem_prealloc &&
+                                         !object_dynamic_cast(mr->owner,
+                                                        TYPE_MEMORY_BACKEND));
+    }
+    return ram_block_add(new_block);
+}
+
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr)
 {
     return qemu_ram_alloc_from_ptr(size, NULL, mr);
@@ -1409,12 +1582,8 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                 flags = MAP_FIXED;
                 munmap(vaddr, length);
                 if (block->fd >= 0) {
-#ifdef MAP_POPULATE
-                    flags |= mem_prealloc ? MAP_POPULATE | MAP_SHARED :
-                        MAP_PRIVATE;
-#else
-                    flags |= MAP_PRIVATE;
-#endif
+                    flags |= (block->flags & RAM_SHARED) ?
+                             MAP_SHARED : MAP_PRIVATE;
                     area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
                                 flags, block->fd, offset);
                 } else {
@@ -1442,8 +1611,56 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/* Replace the memory of @block with a private mapping of @fd at @offset,
+ * so that pages are read from the file when first accessed.  Returns
+ * -ENOTSUP if the block cannot be mapped that way.
+ */
+int qemu_ram_map_file(RAMBlock *block, int fd, off_t offset)
+{
+    uintptr_t align = getpagesize() - 1;
+    void *area;
+
+    if ((block->flags & RAM_PREALLOC_MASK) || xen_enabled() ||
+        block->fd >= 0 || phys_mem_alloc != qemu_anon_ram_alloc ||
+        (((uintptr_t)block->host | block->length | offset) & align)) {
+        return -ENOTSUP;
+    }
+
+    area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (area != block->host) {
+        return -errno;
+    }
+    memory_try_enable_merging(block->host, block->length);
+    qemu_ram_setup_dump(block->host, block->length);
+    return 0;
+}
 #endif /* !_WIN32 */
 
+/* Drop the contents of @block, so that it reads as zeroes and takes no
+ * memory until it is written to.  Returns -ENOTSUP if the block cannot
+ * be dropped that way.
+ */
+int qemu_ram_discard(RAMBlock *block)
+{
+#ifdef CONFIG_LINUX
+    uintptr_t align = getpagesize() - 1;
+
+    if ((block->flags & RAM_PREALLOC_MASK) || xen_enabled() ||
+        block->fd >= 0 || phys_mem_alloc != qemu_anon_ram_alloc ||
+        (((uintptr_t)block->host | block->length) & align)) {
+        return -ENOTSUP;
+    }
+    if (qemu_madvise(block->host, block->length, QEMU_MADV_DONTNEED) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
    With the exception of the softmmu code in this file, this should
    only be used for local memory (e.g. video ram) that the device owns,
@@ -1471,6 +1688,11 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
     return block->host + (addr - block->offset);
 }
 
+size_t qemu_ram_pagesize(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->page_size;
+}
+
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
  * but takes a size argument */
 static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
@@ -1775,7 +1997,9 @@ static uint16_t dummy_section(PhysPageMap *map, MemoryRegion *mr)
 
 MemoryRegion *iotlb_to_region(AddressSpace *as, hwaddr index)
 {
-    return as->dispatch->map.sections[index & ~TARGET_PAGE_MASK].mr;
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    return d->map.sections[index & ~TARGET_PAGE_MASK].mr;
 }
 
 static void io_mem_init(void)
@@ -1789,9 +2013,8 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+static AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
@@ -1806,7 +2029,55 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
-    as->next_dispatch = d;
+    return d;
+}
+
+/* The memory listener updates as->next_dispatch in place, and lookups
+ * go through as->dispatch, a compacted copy of it that is made when the
+ * transaction commits and published with RCU.  The copy does not hold
+ * references to the MemoryRegions of its sections; they are released
+ * only after the copies that can see them are freed.
+ */
+static AddressSpaceDispatch *
+address_space_dispatch_copy(AddressSpaceDispatch *d)
+{
+    AddressSpaceDispatch *copy = g_new0(AddressSpaceDispatch, 1);
+    MemoryRegion *mr;
+    unsigned i;
+
+    copy->phys_map = d->phys_map;
+    copy->map.nodes_nb = copy->map.nodes_nb_alloc = d->map.nodes_nb;
+    copy->map.nodes = g_memdup(d->map.nodes, d->map.nodes_nb * sizeof(Node));
+    copy->map.sections_nb = copy->map.sections_nb_alloc = d->map.sections_nb;
+    copy->map.sections = g_memdup(d->map.sections, d->map.sections_nb *
+                                  sizeof(MemoryRegionSection));
+    copy->as = d->as;
+    phys_page_compact_all(copy, copy->map.nodes_nb);
+
+    for (i = 0; i < d->map.sections_nb; i++) {
+        mr = d->map.sections[i].mr;
+        if (mr && mr->subpage) {
+            container_of(mr, subpage_t, iomem)->published = true;
+        }
+    }
+    return copy;
+}
+
+/* Free a copy made by address_space_dispatch_copy, after a grace period,
+ * together with the sections that were removed while it was in use.
+ */
+static void address_space_dispatch_free_copy(AddressSpaceDispatch *d)
+{
+    phys_sections_release(&d->map);
+    g_free(d->map.nodes);
+    g_free(d->map.sections);
+    g_free(d);
+}
+
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
 }
 
 static void mem_commit(MemoryListener *listener)
@@ -1815,13 +2086,19 @@ static void mem_commit(MemoryListener *listener)
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    if (cur && !next->changed) {
+        return;
+    }
 
-    as->dispatch = next;
+    next->changed = false;
+    atomic_rcu_set(&as->dispatch, address_space_dispatch_copy(next));
 
     if (cur) {
-        phys_sections_free(&cur->map);
-        g_free(cur);
+        cur->map.released = next->map.released;
+        next->map.released = NULL;
+        call_rcu(cur, address_space_dispatch_free_copy, rcu);
+    } else {
+        phys_sections_release(&next->map);
     }
 }
 
@@ -1858,14 +2135,33 @@ static MemoryListener core_memory_listener = {
     .priority = 1,
 };
 
+/* Default total size of the bounce buffers of an address space.  */
+#define DEFAULT_BOUNCE_BUFFER_SIZE (64 * 1024)
+
 void address_space_init_dispatch(AddressSpace *as)
 {
+    uint64_t bounce_size;
+
+    bounce_size = qemu_opt_get_size(qemu_get_machine_opts(),
+                                    "bounce-buffer-size",
+                                    DEFAULT_BOUNCE_BUFFER_SIZE);
+
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_clients);
+    as->bounce_buffer_size = 0;
+    /* Leave room for at least one page, or mapping could never succeed.  */
+    as->max_bounce_buffer_size = MAX(bounce_size, TARGET_PAGE_SIZE);
+    as->bounce_maps = 0;
+    as->bounce_map_failures = 0;
+    as->bounce_map_retries = 0;
+
     as->dispatch = NULL;
+    as->next_dispatch = address_space_dispatch_new(as);
     as->dispatch_listener = (MemoryListener) {
-        .begin = mem_begin,
         .commit = mem_commit,
         .region_add = mem_add,
-        .region_nop = mem_add,
+        .region_del = mem_del,
         .priority = 0,
     };
     memory_listener_register(&as->dispatch_listener, as);
@@ -1873,11 +2169,17 @@ void address_space_init_dispatch(AddressSpace *as)
 
 void address_space_destroy_dispatch(AddressSpace *as)
 {
-    AddressSpaceDispatch *d = as->dispatch;
-
     memory_listener_unregister(&as->dispatch_listener);
-    g_free(d);
-    as->dispatch = NULL;
+    if (as->dispatch) {
+        call_rcu(as->dispatch, address_space_dispatch_free_copy, rcu);
+        as->dispatch = NULL;
+    }
+    call_rcu(as->next_dispatch, address_space_dispatch_free, rcu);
+    as->next_dispatch = NULL;
+
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_clients));
+    qemu_mutex_destroy(&as->bounce_lock);
 }
 
 static void memory_map_init(void)
@@ -2002,6 +2304,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     MemoryRegion *mr;
     bool error = false;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, is_write);
@@ -2081,6 +2384,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         addr += l;
     }
 
+    rcu_read_unlock();
     return error;
 }
 
@@ -2115,6 +2419,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
     hwaddr addr1;
     MemoryRegion *mr;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, true);
@@ -2140,6 +2445,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -2165,51 +2471,110 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
 typedef struct MapClient {
     void *opaque;
     void (*callback)(void *opaque);
     QLIST_ENTRY(MapClient) link;
 } MapClient;
 
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+/* Call the clients waiting for a bounce buffer of @as to be freed.
+ * Called with as->bounce_lock held; the callbacks run without it.
+ */
+static void map_clients_notify_locked(AddressSpace *as)
+{
+    MapClient *client;
+
+    while (!QLIST_EMPTY(&as->map_clients)) {
+        client = QLIST_FIRST(&as->map_clients);
+        QLIST_REMOVE(client, link);
+        as->bounce_map_retries++;
+        qemu_mutex_unlock(&as->bounce_lock);
+        client->callback(client->opaque);
+        g_free(client);
+        qemu_mutex_lock(&as->bounce_lock);
+    }
+}
 
-void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
+void address_space_register_map_client(AddressSpace *as, void *opaque,
+                                       void (*callback)(void *opaque))
 {
     MapClient *client = g_malloc(sizeof(*client));
 
     client->opaque = opaque;
     client->callback = callback;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    return client;
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_INSERT_HEAD(&as->map_clients, client, link);
+    /* A buffer may have been freed since the map operation failed */
+    if (as->bounce_buffer_size + TARGET_PAGE_SIZE <=
+        as->max_bounce_buffer_size) {
+        map_clients_notify_locked(as);
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-static void cpu_unregister_map_client(void *_client)
+void cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
 {
-    MapClient *client = (MapClient *)_client;
+    address_space_register_map_client(&address_space_memory, opaque, callback);
+}
+
+static BounceBuffer *bounce_buffer_alloc(AddressSpace *as, hwaddr addr,
+                                         hwaddr len)
+{
+    BounceBuffer *bounce;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    len = MIN(len, as->max_bounce_buffer_size - as->bounce_buffer_size);
+    if (len == 0) {
+        as->bounce_map_failures++;
+        qemu_mutex_unlock(&as->bounce_lock);
+        trace_address_space_map_bounce_full(as, addr);
+        return NULL;
+    }
+    as->bounce_buffer_size += len;
+    as->bounce_maps++;
 
-    QLIST_REMOVE(client, link);
-    g_free(client);
+    bounce = g_new(BounceBuffer, 1);
+    bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, len);
+    bounce->addr = addr;
+    bounce->len = len;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
 }
 
-static void cpu_notify_map_clients(void)
+static BounceBuffer *bounce_buffer_find(AddressSpace *as, void *buffer)
 {
-    MapClient *client;
+    BounceBuffer *bounce;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
-        client->callback(client->opaque);
-        cpu_unregister_map_client(client);
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            break;
+        }
     }
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+static void bounce_buffer_free(AddressSpace *as, BounceBuffer *bounce)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_REMOVE(bounce, link);
+    as->bounce_buffer_size -= bounce->len;
+    map_clients_notify_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+
+    memory_region_unref(bounce->mr);
+    qemu_vfree(bounce->buffer);
+    g_free(bounce);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2217,12 +2582,14 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
     MemoryRegion *mr;
     hwaddr l, xlat;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &xlat, &l, is_write);
         if (!memory_access_is_direct(mr, is_write)) {
             l = memory_access_size(mr, l, addr);
             if (!memory_region_access_valid(mr, xlat, l, is_write)) {
+                rcu_read_unlock();
                 return false;
             }
         }
@@ -2230,6 +2597,7 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
         len -= l;
         addr += l;
     }
+    rcu_read_unlock();
     return true;
 }
 
@@ -2237,8 +2605,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2256,25 +2624,27 @@ void *address_space_map(AddressSpace *as,
     }
 
     l = len;
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
-        if (bounce.buffer) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        bounce = bounce_buffer_alloc(as, addr, MIN(l, TARGET_PAGE_SIZE));
+        if (!bounce) {
+            rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
+        rcu_read_unlock();
         if (!is_write) {
-            address_space_read(as, addr, bounce.buffer, l);
+            address_space_read(as, addr, bounce->buffer, bounce->len);
         }
 
-        *plen = l;
-        return bounce.buffer;
+        *plen = bounce->len;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2296,6 +2666,7 @@ void *address_space_map(AddressSpace *as,
     }
 
     memory_region_ref(mr);
+    rcu_read_unlock();
     *plen = done;
     return qemu_ram_ptr_length(raddr + base, plen);
 }
@@ -2307,12 +2678,23 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    BounceBuffer *bounce;
+    MemoryRegion *mr;
+    ram_addr_t addr1;
 
+    /* Most buffers point into guest RAM, and finding their block needs
+     * no lock.  The Xen map cache aborts on pointers it does not know,
+     * so there the bounce buffers are looked up first.
+     */
+    if (xen_enabled()) {
+        bounce = bounce_buffer_find(as, buffer);
+        mr = bounce ? NULL : qemu_ram_addr_from_host(buffer, &addr1);
+    } else {
         mr = qemu_ram_addr_from_host(buffer, &addr1);
-        assert(mr != NULL);
+        bounce = mr ? NULL : bounce_buffer_find(as, buffer);
+    }
+
+    if (mr) {
         if (is_write) {
             while (access_len) {
                 unsigned l;
@@ -2330,13 +2712,82 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+    assert(bounce != NULL);
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, bounce->buffer, access_len);
+    }
+    bounce_buffer_free(as, bounce);
+}
+
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write)
+{
+    hwaddr done = 0;
+    hwaddr l, xlat, base, plen;
+    MemoryRegion *mr, *this_mr;
+
+    cache->ptr = NULL;
+    cache->mr = NULL;
+    cache->xlat = 0;
+    cache->len = 0;
+
+    /* The Xen map cache can drop mappings at any time.  */
+    if (len == 0 || xen_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    l = len;
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    if (!memory_access_is_direct(mr, is_write)) {
+        rcu_read_unlock();
+        return;
+    }
+
+    base = xlat;
+    for (;;) {
+        done += l;
+        if (done == len) {
+            break;
+        }
+
+        l = len - done;
+        this_mr = address_space_translate(as, addr + done, &xlat, &l,
+                                          is_write);
+        if (this_mr != mr || xlat != base + done) {
+            rcu_read_unlock();
+            return;
+        }
+    }
+
+    memory_region_ref(mr);
+    rcu_read_unlock();
+
+    plen = len;
+    cache->ptr = qemu_ram_ptr_length(memory_region_get_ram_addr(mr) + base,
+                                     &plen);
+    assert(plen == len);
+    cache->mr = mr;
+    cache->xlat = base;
+    cache->len = len;
+}
+
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len)
+{
+    assert(cache->ptr && addr + access_len <= cache->len);
+    invalidate_and_set_dirty(memory_region_get_ram_addr(cache->mr) +
+                             cache->xlat + addr, access_len);
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    cpu_notify_map_clients();
+    cache->ptr = NULL;
+    cache->mr = NULL;
+    cache->len = 0;
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -2362,6 +2813,7 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, false);
     if (l < 4 || !memory_access_is_direct(mr, false)) {
         /* I/O case */
@@ -2392,6 +2844,7 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2420,6 +2873,7 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 8;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 8 || !memory_access_is_direct(mr, false)) {
@@ -2451,6 +2905,7 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2487,6 +2942,7 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 2;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 2 || !memory_access_is_direct(mr, false)) {
@@ -2518,6 +2974,7 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2546,6 +3003,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
@@ -2566,6 +3024,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
             }
         }
     }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -2578,6 +3037,7 @@ static inline void stl_phys_internal(AddressSpace *as,
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
@@ -2608,6 +3068,7 @@ static inline void stl_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    rcu_read_unlock();
 }
 
 void stl_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2642,6 +3103,7 @@ static inline void stw_phys_internal(AddressSpace *as,
     hwaddr l = 2;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, true);
     if (l < 2 || !memory_access_is_direct(mr, true)) {
 #if defined(TARGET_WORDS_BIGENDIAN)
@@ -2671,6 +3133,7 @@ static inline void stw_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    rcu_read_unlock();
 }
 
 void stw_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2761,12 +3224,15 @@ bool cpu_physical_memory_is_io(hwaddr phys_addr)
 {
     MemoryRegion*mr;
     hwaddr l = 1;
+    bool res;
 
+    rcu_read_lock();
     mr = address_space_translate(&address_space_memory,
                                  phys_addr, &phys_addr, &l, false);
 
-    return !(memory_region_is_ram(mr) ||
-             memory_region_is_romd(mr));
+    res = !(memory_region_is_ram(mr) || memory_region_is_romd(mr));
+    rcu_read_unlock();
+    return res;
 }
 
 void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
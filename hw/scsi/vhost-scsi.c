@@ -231,6 +231,8 @@ static void vhost_scsi_realize(DeviceState *dev, Error **errp)
     if (ret < 0) {
         error_setg(errp, "vhost-scsi: vhost initialization failed: %s",
                    strerror(-ret));
+        g_free(s->dev.vqs);
+        virtio_scsi_common_unrealize(dev, NULL);
         return;
     }
     s->dev.backend_features = 0;
@@ -648,6 +648,7 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         scsi_bus_legacy_handle_cmdline(&s->bus, &err);
         if (err != NULL) {
             error_propagate(errp, err);
+            virtio_scsi_common_unrealize(dev, NULL);
             return;
         }
     }
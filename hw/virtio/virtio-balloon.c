@@ -24,6 +24,7 @@
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
+#include "migration/migration.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -34,6 +35,9 @@
 static void balloon_page(void *addr, int deflate)
 {
 #if defined(__linux__)
+    if (qemu_balloon_is_inhibited()) {
+        return;
+    }
     if (!kvm_enabled() || kvm_has_sync_mmu())
         qemu_madvise(addr, TARGET_PAGE_SIZE,
                 deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
@@ -70,6 +74,19 @@ static bool balloon_stats_supported(const VirtIOBalloon *s)
     return vdev->guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ);
 }
 
+/* Offered to the guest, see virtio_balloon_set_config_size */
+static bool balloon_free_page_hint_enabled(const VirtIOBalloon *s)
+{
+    return s->config_size > offsetof(struct virtio_balloon_config,
+                                     free_page_hint_cmd_id);
+}
+
+static bool balloon_free_page_hint_supported(const VirtIOBalloon *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    return vdev->guest_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
 static bool balloon_stats_enabled(const VirtIOBalloon *s)
 {
     return s->stats_poll_interval > 0;
@@ -274,15 +291,107 @@ out:
     }
 }
 
+/*
+ * Free page hints: during the bulk stage of a migration, the guest
+ * reports the pages on its free lists, which need not be sent.  The
+ * guest holds on to them until the report is done.
+ *
+ * Each report has a command id.  The guest sends it at the start of the
+ * report and the stop id at the end, with the free pages in between.
+ * Pages that come for a report that was stopped here, because of a
+ * bitmap sync, are dropped.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement elem;
+
+    while (virtqueue_pop(vq, &elem)) {
+        uint32_t id;
+        int i;
+
+        if (iov_to_buf(elem.out_sg, elem.out_num, 0, &id, sizeof(id))
+            == sizeof(id)) {
+            id = ldl_p(&id);
+            if (s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED &&
+                id == s->free_page_hint_cmd_id) {
+                s->free_page_hint_status = FREE_PAGE_HINT_S_START;
+            } else if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+                /* Only the running report ends, not a stale one */
+                s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+            }
+        }
+
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+            for (i = 0; i < elem.in_num; i++) {
+                ram_free_page_hint(elem.in_sg[i].iov_base,
+                                   elem.in_sg[i].iov_len);
+            }
+        }
+        virtqueue_push(vq, &elem, 0);
+    }
+    virtio_notify(vdev, vq);
+}
+
+static void virtio_balloon_free_page_hint_notify(Notifier *notifier,
+                                                 void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    FreePageHintEvent *event = data;
+
+    if (!balloon_free_page_hint_supported(s)) {
+        return;
+    }
+
+    switch (*event) {
+    case FREE_PAGE_HINT_START:
+        if (s->free_page_hint_cmd_id < VIRTIO_BALLOON_CMD_ID_MIN ||
+            s->free_page_hint_cmd_id == UINT32_MAX) {
+            s->free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_MIN;
+        } else {
+            s->free_page_hint_cmd_id++;
+        }
+        s->free_page_hint_status = FREE_PAGE_HINT_S_REQUESTED;
+        break;
+    case FREE_PAGE_HINT_STOP:
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_STOP) {
+            return;
+        }
+        s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+        break;
+    case FREE_PAGE_HINT_DONE:
+        s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+        break;
+    }
+    virtio_notify_config(vdev);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
     struct virtio_balloon_config config;
 
+    memset(&config, 0, sizeof(config));
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
 
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    switch (dev->free_page_hint_status) {
+    case FREE_PAGE_HINT_S_REQUESTED:
+    case FREE_PAGE_HINT_S_START:
+        config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
+        break;
+    case FREE_PAGE_HINT_S_DONE:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    default:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    }
+
+    memcpy(config_data, &config, dev->config_size);
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -291,7 +400,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
     struct virtio_balloon_config config;
     uint32_t oldactual = dev->actual;
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, dev->config_size);
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qemu_balloon_changed(ram_size -
@@ -335,6 +444,11 @@ static void virtio_balloon_save(QEMUFile *f, void *opaque)
 
     qemu_put_be32(f, s->num_pages);
     qemu_put_be32(f, s->actual);
+
+    if (balloon_free_page_hint_enabled(s)) {
+        qemu_put_be32(f, s->free_page_hint_status);
+        qemu_put_be32(f, s->free_page_hint_cmd_id);
+    }
 }
 
 static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
@@ -353,17 +467,34 @@ static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+
+    if (balloon_free_page_hint_enabled(s)) {
+        s->free_page_hint_status = qemu_get_be32(f);
+        s->free_page_hint_cmd_id = qemu_get_be32(f);
+        if (s->free_page_hint_status > FREE_PAGE_HINT_S_DONE) {
+            return -EINVAL;
+        }
+    }
     return 0;
 }
 
+void virtio_balloon_set_config_size(VirtIOBalloon *s, uint32_t host_features)
+{
+    if (host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->config_size = sizeof(struct virtio_balloon_config);
+    } else {
+        s->config_size = offsetof(struct virtio_balloon_config,
+                                  free_page_hint_cmd_id);
+    }
+}
+
 static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
     int ret;
 
-    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON, s->config_size);
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -377,6 +508,13 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (balloon_free_page_hint_enabled(s)) {
+        s->free_page_vq = virtio_add_queue(vdev, 128,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_hint_notifier.notify =
+            virtio_balloon_free_page_hint_notify;
+        ram_add_free_page_hint_notifier(&s->free_page_hint_notifier);
+    }
 
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -395,12 +533,30 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (balloon_free_page_hint_enabled(s)) {
+        ram_remove_free_page_hint_notifier(&s->free_page_hint_notifier);
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
 }
 
+static void virtio_balloon_device_reset(VirtIODevice *vdev)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
+    s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+}
+
+static void virtio_balloon_instance_init(Object *obj)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(obj);
+
+    /* Can be overridden with virtio_balloon_set_config_size */
+    virtio_balloon_set_config_size(s, 0);
+}
+
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -417,12 +573,14 @@ static void virtio_balloon_class_init(ObjectClass *klass, void *data)
     vdc->get_config = virtio_balloon_get_config;
     vdc->set_config = virtio_balloon_set_config;
     vdc->get_features = virtio_balloon_get_features;
+    vdc->reset = virtio_balloon_device_reset;
 }
 
 static const TypeInfo virtio_balloon_info = {
     .name = TYPE_VIRTIO_BALLOON,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBalloon),
+    .instance_init = virtio_balloon_instance_init,
     .class_init = virtio_balloon_class_init,
 };
 
@@ -175,6 +175,7 @@ static void virtio_rng_device_realize(DeviceState *dev, Error **errp)
     vrng->rng = vrng->conf.rng;
     if (vrng->rng == NULL) {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "rng", "a valid object");
+        virtio_cleanup(vdev);
         return;
     }
 
@@ -62,6 +62,14 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+
+    /* Direct mappings of the three areas, refreshed on every memory
+     * topology change.  When an area is not backed by RAM, its ptr is
+     * NULL and the accessors below go through address_space_memory.
+     */
+    MemoryRegionCache desc_cache;
+    MemoryRegionCache avail_cache;
+    MemoryRegionCache used_cache;
 } VRing;
 
 struct VirtQueue
@@ -89,6 +97,36 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+static void virtqueue_unmap(VirtQueue *vq)
+{
+    address_space_cache_destroy(&vq->vring.desc_cache);
+    address_space_cache_destroy(&vq->vring.avail_cache);
+    address_space_cache_destroy(&vq->vring.used_cache);
+}
+
+static void virtqueue_map(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    virtqueue_unmap(vq);
+    if (!vq->pa || !num) {
+        return;
+    }
+
+    address_space_cache_init(&vq->vring.desc_cache, &address_space_memory,
+                             vq->vring.desc, num * sizeof(VRingDesc), false);
+    /* The avail ring is followed by used_event, the used ring by
+     * avail_event.
+     */
+    address_space_cache_init(&vq->vring.avail_cache, &address_space_memory,
+                             vq->vring.avail,
+                             offsetof(VRingAvail, ring[num + 1]), false);
+    address_space_cache_init(&vq->vring.used_cache, &address_space_memory,
+                             vq->vring.used,
+                             offsetof(VRingUsed, ring[num]) +
+                             sizeof(uint16_t), true);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -99,55 +137,106 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    virtqueue_map(vq);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static inline uint16_t vring_lduw(MemoryRegionCache *cache, hwaddr base,
+                                  hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(&address_space_memory, pa);
+    if (likely(cache && cache->ptr)) {
+        return lduw_p((uint8_t *)cache->ptr + offset);
+    }
+    return lduw_phys(&address_space_memory, base + offset);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint32_t vring_ldl(MemoryRegionCache *cache, hwaddr base,
+                                 hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(&address_space_memory, pa);
+    if (likely(cache && cache->ptr)) {
+        return ldl_p((uint8_t *)cache->ptr + offset);
+    }
+    return ldl_phys(&address_space_memory, base + offset);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline uint64_t vring_ldq(MemoryRegionCache *cache, hwaddr base,
+                                 hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(&address_space_memory, pa);
+    if (likely(cache && cache->ptr)) {
+        return ldq_p((uint8_t *)cache->ptr + offset);
+    }
+    return ldq_phys(&address_space_memory, base + offset);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline void vring_stw(MemoryRegionCache *cache, hwaddr base,
+                             hwaddr offset, uint16_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(&address_space_memory, pa);
+    if (likely(cache->ptr)) {
+        stw_p((uint8_t *)cache->ptr + offset, val);
+        address_space_cache_invalidate(cache, offset, sizeof(val));
+    } else {
+        stw_phys(&address_space_memory, base + offset, val);
+    }
+}
+
+static inline void vring_stl(MemoryRegionCache *cache, hwaddr base,
+                             hwaddr offset, uint32_t val)
+{
+    if (likely(cache->ptr)) {
+        stl_p((uint8_t *)cache->ptr + offset, val);
+        address_space_cache_invalidate(cache, offset, sizeof(val));
+    } else {
+        stl_phys(&address_space_memory, base + offset, val);
+    }
+}
+
+/* The descriptor accessors take the cached mapping of the descriptor
+ * table, or NULL for indirect tables, which are accessed through
+ * address_space_memory.
+ */
+static inline uint64_t vring_desc_addr(MemoryRegionCache *cache,
+                                       hwaddr desc_pa, int i)
+{
+    return vring_ldq(cache, desc_pa,
+                     sizeof(VRingDesc) * i + offsetof(VRingDesc, addr));
+}
+
+static inline uint32_t vring_desc_len(MemoryRegionCache *cache,
+                                      hwaddr desc_pa, int i)
+{
+    return vring_ldl(cache, desc_pa,
+                     sizeof(VRingDesc) * i + offsetof(VRingDesc, len));
+}
+
+static inline uint16_t vring_desc_flags(MemoryRegionCache *cache,
+                                        hwaddr desc_pa, int i)
+{
+    return vring_lduw(cache, desc_pa,
+                      sizeof(VRingDesc) * i + offsetof(VRingDesc, flags));
+}
+
+static inline uint16_t vring_desc_next(MemoryRegionCache *cache,
+                                       hwaddr desc_pa, int i)
+{
+    return vring_lduw(cache, desc_pa,
+                      sizeof(VRingDesc) * i + offsetof(VRingDesc, next));
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(&vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(&vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(&vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -157,56 +246,53 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(&address_space_memory, pa, val);
+    vring_stl(&vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(&address_space_memory, pa, val);
+    vring_stl(&vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_lduw(&vq->vring.used_cache, vq->vring.used,
+                      offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(&address_space_memory, pa, val);
+    vring_stw(&vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(&address_space_memory,
-             pa, lduw_phys(&address_space_memory, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_stw(&vq->vring.used_cache, vq->vring.used, offset,
+              vring_lduw(&vq->vring.used_cache, vq->vring.used, offset) |
+              mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(&address_space_memory,
-             pa, lduw_phys(&address_space_memory, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_stw(&vq->vring.used_cache, vq->vring.used, offset,
+              vring_lduw(&vq->vring.used_cache, vq->vring.used, offset) &
+              ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(&address_space_memory, pa, val);
+    vring_stw(&vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -323,17 +409,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(MemoryRegionCache *desc_cache,
+                                    hwaddr desc_pa, unsigned int i,
+                                    unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(desc_cache, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(desc_cache, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -357,16 +444,18 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
+        MemoryRegionCache *desc_cache;
         hwaddr desc_pa;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
+        desc_cache = &vq->vring.desc_cache;
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(desc_cache, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(desc_cache, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -379,8 +468,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            max = vring_desc_len(desc_cache, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(desc_cache, desc_pa, i);
+            desc_cache = NULL;
             num_bufs = i = 0;
         }
 
@@ -391,15 +481,17 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (vring_desc_flags(desc_cache, desc_pa, i) &
+                VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(desc_cache, desc_pa, i);
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += vring_desc_len(desc_cache, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(desc_cache, desc_pa, i, max))
+                 != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -449,6 +541,7 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
+    MemoryRegionCache *desc_cache = &vq->vring.desc_cache;
     hwaddr desc_pa = vq->vring.desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
@@ -464,15 +557,16 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(desc_cache, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(desc_cache, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(desc_cache, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(desc_cache, desc_pa, i);
+        desc_cache = NULL;
         i = 0;
     }
 
@@ -480,30 +574,32 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (vring_desc_flags(desc_cache, desc_pa, i) & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] =
+                vring_desc_addr(desc_cache, desc_pa, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] =
+                vring_desc_addr(desc_cache, desc_pa, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(desc_cache, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(desc_cache, desc_pa, i, max)) != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -564,6 +660,7 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
@@ -982,6 +1079,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1008,6 +1111,19 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+/* The rings may have moved or stopped being RAM; map them again.  */
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtqueue_map(&vdev->vq[i]);
+        }
+    }
+}
+
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
@@ -1034,6 +1150,13 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+
+    /* Run after the dispatch maps have been updated.  */
+    vdev->listener = (MemoryListener) {
+        .commit = virtio_memory_listener_commit,
+        .priority = 10,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
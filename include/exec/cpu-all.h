@@ -352,10 +352,14 @@ void page_dump(FILE *f);
 typedef int (*walk_memory_regions_fn)(void *, abi_ulong,
                                       abi_ulong, unsigned long);
 int walk_memory_regions(void *, walk_memory_regions_fn);
+int walk_memory_regions_range(abi_ulong, abi_ulong, void *,
+                              walk_memory_regions_fn);
 
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_range_empty_top(target_ulong min, target_ulong max,
+                                       target_ulong len, target_ulong align);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
@@ -421,18 +425,31 @@ extern ram_addr_t ram_size;
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
 
+/* RAM is mmap-ed with MAP_SHARED */
+#define RAM_SHARED     (1 << 1)
+
 typedef struct RAMBlock {
     struct MemoryRegion *mr;
     uint8_t *host;
     ram_addr_t offset;
     ram_addr_t length;
     uint32_t flags;
+    /* Page size of the host memory, larger than the host page size
+     * for hugetlbfs.
+     */
+    size_t page_size;
     char idstr[256];
     /* Reads can take either the iothread or the ramlist lock.
      * Writes must take both locks.
      */
     QTAILQ_ENTRY(RAMBlock) next;
     int fd;
+    /* Saving with the mapped-ram capability: where the pages of the
+     * block are in the file, and which of them were written there.
+     */
+    unsigned long *file_bmap;
+    int64_t bitmap_offset;
+    int64_t pages_offset;
 } RAMBlock;
 
 typedef struct RAMList {
@@ -447,7 +464,6 @@ typedef struct RAMList {
 extern RAMList ram_list;
 
 extern const char *mem_path;
-extern int mem_prealloc;
 
 /* Flags stored in the low bits of the TLB virtual address.  These are
    defined so that fast path ram access is all zeros.  */
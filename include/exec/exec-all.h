@@ -169,6 +169,10 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+#ifdef CONFIG_TCG_PLUGIN
+    /* instrumentation requested by plugins, see tcg-plugin.c */
+    struct qemu_plugin_tb *plugin;
+#endif
 };
 
 #include "exec/spinlock.h"
@@ -186,6 +190,8 @@ struct TBContext {
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    uint64_t tb_gen_count;
+    int64_t tb_gen_time;        /* in ns, only if tb_stats_enabled */
 
     int tb_invalidated_flag;
 };
@@ -214,6 +220,9 @@ void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
+extern bool tb_stats_enabled;
+void dump_tb_stats(FILE *f);
+
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -31,6 +31,8 @@
 #include "qemu/queue.h"
 #include "qemu/int128.h"
 #include "qemu/notify.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
 
 #define MAX_PHYS_ADDR_SPACE_BITS 62
 #define MAX_PHYS_ADDR            (((hwaddr)1 << MAX_PHYS_ADDR_SPACE_BITS) - 1)
@@ -155,6 +157,8 @@ struct MemoryRegion {
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    QTAILQ_HEAD(aliases, MemoryRegion) aliases;
+    QTAILQ_ENTRY(MemoryRegion) aliases_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
     const char *name;
     uint8_t dirty_log_mask;
@@ -208,6 +212,19 @@ struct AddressSpace {
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
 
+    /* Bounce buffers used by address_space_map() for memory that cannot
+     * be accessed directly, and the clients waiting for one to be freed,
+     * protected by bounce_lock.
+     */
+    QemuMutex bounce_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_clients;
+    hwaddr bounce_buffer_size;
+    hwaddr max_bounce_buffer_size;
+    uint64_t bounce_maps;
+    uint64_t bounce_map_failures;
+    uint64_t bounce_map_retries;
+
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -311,6 +328,28 @@ void memory_region_init_ram(MemoryRegion *mr,
                             const char *name,
                             uint64_t size);
 
+#ifdef __linux__
+/**
+ * memory_region_init_ram_from_file:  Initialize RAM memory region with a
+ *                                    mmap-ed backend.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @owner: the object that tracks the region's reference count
+ * @name: the name of the region.
+ * @size: size of the region.
+ * @share: %true if memory must be mmaped with the MAP_SHARED flag
+ * @path: the path in which to allocate the RAM.
+ * @errp: pointer to Error*, to store an error if it happens.
+ */
+void memory_region_init_ram_from_file(MemoryRegion *mr,
+                                      struct Object *owner,
+                                      const char *name,
+                                      uint64_t size,
+                                      bool share,
+                                      const char *path,
+                                      Error **errp);
+#endif
+
 /**
  * memory_region_init_ram_ptr:  Initialize RAM memory region from a
  *                              user-provided pointer.  Accesses into the
@@ -523,6 +562,16 @@ bool memory_region_is_rom(MemoryRegion *mr);
  */
 void *memory_region_get_ram_ptr(MemoryRegion *mr);
 
+/**
+ * memory_region_get_page_size: Get the host page size of a RAM memory region.
+ *
+ * Returns the size of the host pages backing the region, which is larger
+ * than getpagesize() for memory allocated from hugetlbfs.
+ *
+ * @mr: the memory region being queried.
+ */
+uint64_t memory_region_get_page_size(MemoryRegion *mr);
+
 /**
  * memory_region_set_log: Turn dirty logging on or off for a region.
  *
@@ -1026,8 +1075,12 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Memory that cannot be accessed directly is copied through a bounce
+ * buffer.  Each address space has a pool of bounce buffers whose total
+ * size is set with -machine bounce-buffer-size.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1051,6 +1104,72 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: wait for a bounce buffer
+ *
+ * Call @callback once, after address_space_map() failed for lack of bounce
+ * buffers in @as, when a buffer of @as has been freed and retrying is
+ * likely to succeed.  The callback may run before this function returns.
+ *
+ * @as: #AddressSpace that address_space_map() failed on
+ * @opaque: argument of @callback
+ * @callback: function to call
+ */
+void address_space_register_map_client(AddressSpace *as, void *opaque,
+                                       void (*callback)(void *opaque));
+
+/**
+ * MemoryRegionCache: a long-lived direct mapping of guest RAM
+ *
+ * @ptr: host pointer to the start of the cached range, or %NULL if the
+ *       range is not backed by contiguous RAM and cannot be cached
+ * @xlat: offset of the range within @mr
+ * @len: length of the cached range
+ * @mr: the RAM region backing the range, holding a reference
+ */
+typedef struct MemoryRegionCache {
+    void *ptr;
+    hwaddr xlat;
+    hwaddr len;
+    MemoryRegion *mr;
+} MemoryRegionCache;
+
+/* address_space_cache_init: map a range of an address space for repeated
+ * direct accesses
+ *
+ * Unlike address_space_map(), the mapping is never bounced: if the range
+ * is not backed by contiguous RAM, @cache->ptr is left %NULL and the caller
+ * must fall back to address_space_rw() or the ld/st_phys accessors.  The
+ * mapping stays valid until the next memory topology change; users should
+ * refresh it from a #MemoryListener commit callback.
+ *
+ * @cache: the #MemoryRegionCache to initialize
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range
+ * @is_write: whether the range will be written to
+ */
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_invalidate: mark part of a cached range as written
+ *
+ * Must be called after writing to @cache->ptr directly, so that dirty
+ * memory tracking and translated code see the write.
+ *
+ * @cache: the #MemoryRegionCache that was written to
+ * @addr: offset of the write within the cached range
+ * @access_len: length of the write
+ */
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len);
+
+/* address_space_cache_destroy: release a #MemoryRegionCache
+ *
+ * @cache: the #MemoryRegionCache to release; it may be reinitialized with
+ *         address_space_cache_init() afterwards
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
 
 #endif
 
@@ -0,0 +1,73 @@
+/*
+ * TCG instrumentation plugins
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_PLUGIN_H
+#define TCG_PLUGIN_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct CPUState;
+struct TranslationBlock;
+
+#ifdef CONFIG_TCG_PLUGIN
+
+/* Set once a plugin registered the corresponding kind of callback.  They
+ * only change before the first translation, so that the code generated
+ * for a TB does not depend on when it was translated.
+ */
+extern bool tcg_plugin_tb_enabled;
+extern bool tcg_plugin_mem_enabled;
+
+/* argv is copied, and the copy lives as long as the plugin.  */
+int tcg_plugin_load(const char *path, int argc, char **argv);
+void tcg_plugin_exit(void);
+
+/* Translation hooks, see tcg-plugin.c.  */
+void tcg_plugin_tb_start(struct TranslationBlock *tb);
+bool tcg_plugin_tb_translated(struct CPUState *cpu,
+                              struct TranslationBlock *tb);
+void tcg_plugin_tb_free(struct TranslationBlock *tb);
+void tcg_plugin_gen_tb_start(void);
+void tcg_plugin_gen_insn_start(uint64_t pc);
+
+#else
+
+#define tcg_plugin_tb_enabled false
+#define tcg_plugin_mem_enabled false
+
+static inline void tcg_plugin_exit(void)
+{
+}
+
+static inline void tcg_plugin_tb_start(struct TranslationBlock *tb)
+{
+}
+
+static inline bool tcg_plugin_tb_translated(struct CPUState *cpu,
+                                            struct TranslationBlock *tb)
+{
+    return false;
+}
+
+static inline void tcg_plugin_tb_free(struct TranslationBlock *tb)
+{
+}
+
+static inline void tcg_plugin_gen_tb_start(void)
+{
+}
+
+static inline void tcg_plugin_gen_insn_start(uint64_t pc)
+{
+}
+
+#endif /* CONFIG_TCG_PLUGIN */
+
+#endif
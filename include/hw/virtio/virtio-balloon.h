@@ -17,6 +17,7 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "qemu/notify.h"
 
 #define TYPE_VIRTIO_BALLOON "virtio-balloon-device"
 #define VIRTIO_BALLOON(obj) \
@@ -30,6 +31,7 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3 /* VQ to report free pages */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -40,8 +42,15 @@ struct virtio_balloon_config
     uint32_t num_pages;
     /* Number of pages we've actually got in balloon. */
     uint32_t actual;
+    /* Free page report command id, readonly by guest */
+    uint32_t free_page_hint_cmd_id;
 };
 
+/* Free page report command ids other than these start a new report */
+#define VIRTIO_BALLOON_CMD_ID_STOP    0
+#define VIRTIO_BALLOON_CMD_ID_DONE    1
+#define VIRTIO_BALLOON_CMD_ID_MIN     2
+
 /* Memory Statistics */
 #define VIRTIO_BALLOON_S_SWAP_IN  0   /* Amount of memory swapped in */
 #define VIRTIO_BALLOON_S_SWAP_OUT 1   /* Amount of memory swapped out */
@@ -56,9 +65,16 @@ typedef struct VirtIOBalloonStat {
     uint64_t val;
 } QEMU_PACKED VirtIOBalloonStat;
 
+enum {
+    FREE_PAGE_HINT_S_STOP,      /* no report, or a stopped one */
+    FREE_PAGE_HINT_S_REQUESTED, /* waiting for the guest to start it */
+    FREE_PAGE_HINT_S_START,     /* the guest is reporting */
+    FREE_PAGE_HINT_S_DONE,      /* the guest can take back its pages */
+};
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -67,6 +83,17 @@ typedef struct VirtIOBalloon {
     QEMUTimer *stats_timer;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
+    size_t config_size;
+    uint32_t free_page_hint_status;
+    uint32_t free_page_hint_cmd_id;
+    Notifier free_page_hint_notifier;
 } VirtIOBalloon;
 
+#define DEFINE_VIRTIO_BALLOON_FEATURES(_state, _field) \
+        DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
+        DEFINE_PROP_BIT("free-page-hint", _state, _field, \
+                        VIRTIO_BALLOON_F_FREE_PAGE_HINT, false)
+
+void virtio_balloon_set_config_size(VirtIOBalloon *s, uint32_t host_features);
+
 #endif
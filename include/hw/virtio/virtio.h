@@ -15,6 +15,7 @@
 #define _QEMU_VIRTIO_H
 
 #include "hw/hw.h"
+#include "exec/memory.h"
 #include "net/net.h"
 #include "hw/qdev.h"
 #include "sysemu/sysemu.h"
@@ -121,6 +122,7 @@ struct VirtIODevice
     bool vm_running;
     VMChangeStateEntry *vmstate;
     char *bus_name;
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -33,6 +33,16 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x06
+
+/* Messages sent on the return path from the destination to the source.
+ * Each is a be16 type and a be16 length, followed by that many bytes.
+ */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,
+    MIG_RP_MSG_SHUT,         /* be32 error; the destination is done */
+    MIG_RP_MSG_REQ_PAGES,    /* be64 start, be32 len, byte idlen, idstr */
+};
 
 struct MigrationParams {
     bool blk;
@@ -59,9 +69,18 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    char *multifd_host_port;
+
+    /* Switch to postcopy at the end of the current iteration */
+    bool start_postcopy;
+    /* Messages from the destination, read by rp_thread */
+    QEMUFile *return_path;
+    QemuThread rp_thread;
+    bool rp_error;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -82,6 +101,10 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+QEMUFile *tcp_open_outgoing_channel(MigrationState *s, Error **errp);
+
+void tcp_incoming_channels_join(void);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -90,6 +113,21 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, bool map_ram,
+                                   Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
+
+/* Open the file of the last file: migration again, with O_DIRECT.
+ * Returns -1 and sets errno on failure.
+ */
+int file_open_direct(bool write);
+
+/* Whether the RAM of the incoming file migration should be mapped from
+ * the file, if it was saved with the mapped-ram capability.
+ */
+bool file_incoming_map_ram(void);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -100,6 +138,11 @@ void migrate_fd_connect(MigrationState *s);
 
 int migrate_fd_close(MigrationState *s);
 
+int migrate_incoming_open_return_path(QEMUFile *f);
+void migrate_incoming_close_return_path(int ret);
+void migrate_send_rp_req_pages(const char *idstr, ram_addr_t start,
+                               size_t len);
+
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
@@ -111,6 +154,20 @@ uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
+void ram_load_cleanup(void);
+int ram_save_queue_pages(const char *idstr, ram_addr_t start, size_t len);
+int ram_postcopy_send_discard_bitmap(QEMUFile *f);
+
+/* Events of the free page hint notifiers; the data is a pointer to one */
+typedef enum {
+    FREE_PAGE_HINT_START,       /* ask the guest for its free pages */
+    FREE_PAGE_HINT_STOP,        /* the pages reported from now on are stale */
+    FREE_PAGE_HINT_DONE,        /* the guest can use the reported pages */
+} FreePageHintEvent;
+
+void ram_add_free_page_hint_notifier(Notifier *notify);
+void ram_remove_free_page_hint_notifier(Notifier *notify);
+void ram_free_page_hint(void *host, size_t len);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -126,6 +183,8 @@ uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
 
+int auto_converge_throttle_percentage(void);
+
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
 /**
@@ -146,13 +205,38 @@ bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* For tests: switch to the next slower encoder; returns false, and goes
+ * back to the fastest one, once all of them have been used.
+ */
+bool test_xbzrle_encode_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+int migrate_xbzrle_threads(void);
+int migrate_load_threads(void);
+void migrate_load_threads_join(void);
+
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+void migrate_decompress_threads_join(void);
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+void multifd_recv_new_channel(QEMUFile *f);
+void multifd_recv_abort(void);
+void multifd_load_cleanup(void);
+
+bool migrate_use_mapped_ram(void);
+bool migrate_use_direct_io(void);
+bool migrate_use_zero_page_runs(void);
+bool migrate_use_background_snapshot(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,9 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Number of pages that can share a set of the cache */
+#define PAGE_CACHE_WAYS 8
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -47,18 +50,32 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and count it as a hit
+ * that protects the page against replacement
+ *
+ * Returns pointer to the data cached or NULL if not cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_peek_data: Get the data cached for an addr, without counting it
+ * as a hit
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *cache_peek_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the set of the page is full, the least referenced page of the set
+ * is evicted
  *
  * Returns -1 on error
  *
@@ -69,8 +86,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache, keeping the cached pages. In case of
+ * size reduction the least referenced pages will be freed
  *
  * Returns -1 on error new cache size on success
  *
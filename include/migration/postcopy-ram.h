@@ -0,0 +1,102 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+/* State of an incoming postcopy migration */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,
+    /* The source may switch to postcopy, RAM may be discarded */
+    POSTCOPY_INCOMING_ADVISE,
+    /* Page faults are handled, pages are placed atomically */
+    POSTCOPY_INCOMING_LISTENING,
+    /* The whole stream has been received */
+    POSTCOPY_INCOMING_END
+} PostcopyState;
+
+PostcopyState postcopy_state_get(void);
+void postcopy_state_set(PostcopyState state);
+
+/**
+ * postcopy_ram_supported: Check that the host can run an incoming postcopy
+ * migration, reporting the reason if it cannot.
+ */
+bool postcopy_ram_supported(void);
+
+/**
+ * postcopy_ram_incoming_init: Start catching the faults on guest RAM,
+ * and requesting the missing pages from the source.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int postcopy_ram_incoming_init(void);
+
+/**
+ * postcopy_ram_incoming_cleanup: Stop catching faults on guest RAM.
+ */
+void postcopy_ram_incoming_cleanup(void);
+
+/**
+ * postcopy_ram_discard_range: Drop @length bytes at @start in RAMBlock
+ * @idstr, so that they are requested from the source when accessed.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length);
+
+/**
+ * postcopy_place_page: Atomically fill the missing page at @host with a
+ * copy of @from, and wake up the threads waiting for it.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int postcopy_place_page(void *host, void *from);
+
+/**
+ * postcopy_place_zero_page: Same as postcopy_place_page for a page of
+ * zeroes.
+ */
+int postcopy_place_zero_page(void *host);
+
+/**
+ * postcopy_get_tmp_page: Returns a page-sized buffer in which incoming
+ * pages can be assembled before postcopy_place_page.
+ */
+void *postcopy_get_tmp_page(void);
+
+/**
+ * ram_write_tracking_supported: Check that the host can write-protect
+ * guest RAM for a background snapshot, reporting the reason if it cannot.
+ */
+bool ram_write_tracking_supported(void);
+
+/**
+ * ram_write_tracking_start: Write-protect all of guest RAM, and queue the
+ * pages that the guest writes to with ram_save_queue_pages.  The pages
+ * must have been populated, or writes to them are not caught.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ram_write_tracking_start(void);
+
+/**
+ * ram_write_tracking_unprotect: Let writes to @len bytes at @host go on,
+ * once they have been saved.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int ram_write_tracking_unprotect(void *host, size_t len);
+
+/**
+ * ram_write_tracking_stop: Stop write-protecting guest RAM.
+ */
+void ram_write_tracking_stop(void);
+
+#endif
@@ -56,6 +56,10 @@ typedef struct SaveVMHandlers {
     uint64_t (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size);
 
     LoadStateHandler *load_state;
+    /* Set if load_state can run outside the iothread lock, in the
+     * thread that loads an incoming migration.
+     */
+    bool load_state_unlocked;
 } SaveVMHandlers;
 
 int register_savevm(DeviceState *dev,
@@ -167,6 +167,30 @@
 } while (0)
 #endif
 
+/* atomic_rcu_read: read an RCU-protected pointer into a local variable.
+ * The read is ordered before any dereference of the pointer, so the
+ * content of the structure it points to is seen as it was published.
+ * Use it within rcu_read_lock()/rcu_read_unlock().
+ */
+#ifndef atomic_rcu_read
+#define atomic_rcu_read(ptr)    ({                  \
+    typeof(*ptr) _val = atomic_read(ptr);           \
+    smp_read_barrier_depends();                     \
+    _val;                                           \
+})
+#endif
+
+/* atomic_rcu_set: publish a pointer to a structure that readers access
+ * with atomic_rcu_read.  The structure must be fully initialized before
+ * the call.
+ */
+#ifndef atomic_rcu_set
+#define atomic_rcu_set(ptr, i)  do {                \
+    smp_wmb();                                      \
+    atomic_set(ptr, i);                             \
+} while (0)
+#endif
+
 #ifndef atomic_xchg
 #if defined(__clang__)
 #define atomic_xchg(ptr, i)    __sync_swap(ptr, i)
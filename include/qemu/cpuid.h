@@ -0,0 +1,24 @@
+/*
+ * Host CPU feature detection
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H 1
+
+#include <stdbool.h>
+
+/*
+ * The wide vector instructions need support from both the processor and
+ * the OS, which has to save the registers: YMM for AVX2, and the opmask
+ * and the upper ZMM registers as well for AVX-512.  Both are false when
+ * QEMU is built without the corresponding optimizations.
+ */
+bool host_has_avx2(void);
+bool host_has_avx512f(void);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Interval trees
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * An augmented red-black tree of closed intervals [start, last], sorted
+ * by start.  Each node caches the largest "last" of its subtree, so that
+ * all the intervals overlapping a given range can be found in
+ * O(log n + k).  Overlapping intervals are allowed; ties on "start" are
+ * inserted after the existing nodes.
+ *
+ * The tree is intrusive: embed an IntervalTreeNode in the structure that
+ * it describes and use container_of to get back to it.  Nodes are never
+ * allocated or freed by the tree itself, and the caller must fill in
+ * "start" and "last" before insertion and not modify them until removal.
+ */
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+typedef struct IntervalTreeRoot IntervalTreeRoot;
+
+struct IntervalTreeNode {
+    IntervalTreeNode *parent;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    bool red;
+
+    uint64_t start;             /* first value in the interval */
+    uint64_t last;              /* last value in the interval (inclusive) */
+    uint64_t subtree_last;      /* private: max "last" in the subtree */
+};
+
+struct IntervalTreeRoot {
+    IntervalTreeNode *node;
+};
+
+#define INTERVAL_TREE_ROOT_INITIALIZER { NULL }
+
+static inline bool interval_tree_empty(const IntervalTreeRoot *root)
+{
+    return root->node == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @node: the node to insert; start and last must be initialized.
+ * @root: the tree.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: a node that is currently part of @root.
+ * @root: the tree.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree.
+ * @start: the first value of the range to look up.
+ * @last: the last value (inclusive) of the range to look up.
+ *
+ * Return the node with the smallest start among those that overlap
+ * [@start, @last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: a node returned by interval_tree_iter_first or
+ *        interval_tree_iter_next for the same range.
+ * @start: the first value of the range to look up.
+ * @last: the last value (inclusive) of the range to look up.
+ *
+ * Return the next node, in order of start, that overlaps [@start, @last],
+ * or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+/*
+ * Plain in-order traversal, regardless of overlap.
+ */
+IntervalTreeNode *interval_tree_first(IntervalTreeRoot *root);
+IntervalTreeNode *interval_tree_last(IntervalTreeRoot *root);
+IntervalTreeNode *interval_tree_next(IntervalTreeNode *node);
+IntervalTreeNode *interval_tree_prev(IntervalTreeNode *node);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * TCG instrumentation plugin API
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#ifndef QEMU_PLUGIN_API_H
+#define QEMU_PLUGIN_API_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * This is the only QEMU header that plugins may include, and it does not
+ * depend on any other QEMU header.  A plugin is a shared object that
+ * exports:
+ *
+ *   int qemu_plugin_version;     set to QEMU_PLUGIN_VERSION
+ *   int qemu_plugin_install(qemu_plugin_id_t id, int argc, char **argv);
+ *
+ * qemu_plugin_install is called once, before any guest code is
+ * translated, with the options given on the command line.  It registers
+ * the callbacks it needs and returns 0, or a negative value to make QEMU
+ * exit with an error.
+ *
+ * Instrumentation is set up at translation time: the callback registered
+ * with qemu_plugin_register_vcpu_tb_trans_cb sees every translation block
+ * and its instructions, and chooses what is called, or which counters are
+ * incremented, every time the block or one of its instructions executes.
+ * Inline operations are emitted directly in the generated code and are
+ * much cheaper than callbacks; they are not atomic with respect to other
+ * vCPU threads.
+ *
+ * The API is versioned: a plugin built for a different version is refused.
+ */
+
+#define QEMU_PLUGIN_VERSION 1
+
+typedef uint64_t qemu_plugin_id_t;
+
+struct qemu_plugin_tb;
+struct qemu_plugin_insn;
+
+enum qemu_plugin_op {
+    QEMU_PLUGIN_INLINE_ADD_U64,
+};
+
+enum qemu_plugin_mem_rw {
+    QEMU_PLUGIN_MEM_R = 1,
+    QEMU_PLUGIN_MEM_W = 2,
+    QEMU_PLUGIN_MEM_RW = QEMU_PLUGIN_MEM_R | QEMU_PLUGIN_MEM_W,
+};
+
+/*
+ * Memory access descriptor passed to memory callbacks:
+ * bits 0..1: log2 of the access size in bytes
+ * bit 2:     sign-extended load
+ * bit 3:     big-endian access
+ * bit 4:     store
+ * bits 8..15: MMU index used for the access
+ */
+typedef uint32_t qemu_plugin_meminfo_t;
+
+#define QEMU_PLUGIN_MEMINFO_SIZE_SHIFT_MASK  0x3
+#define QEMU_PLUGIN_MEMINFO_SIGN             0x4
+#define QEMU_PLUGIN_MEMINFO_BE               0x8
+#define QEMU_PLUGIN_MEMINFO_STORE            0x10
+#define QEMU_PLUGIN_MEMINFO_MMU_IDX_SHIFT    8
+
+static inline unsigned int qemu_plugin_mem_size_shift(qemu_plugin_meminfo_t i)
+{
+    return i & QEMU_PLUGIN_MEMINFO_SIZE_SHIFT_MASK;
+}
+
+static inline bool qemu_plugin_mem_is_sign_extended(qemu_plugin_meminfo_t i)
+{
+    return !!(i & QEMU_PLUGIN_MEMINFO_SIGN);
+}
+
+static inline bool qemu_plugin_mem_is_big_endian(qemu_plugin_meminfo_t i)
+{
+    return !!(i & QEMU_PLUGIN_MEMINFO_BE);
+}
+
+static inline bool qemu_plugin_mem_is_store(qemu_plugin_meminfo_t i)
+{
+    return !!(i & QEMU_PLUGIN_MEMINFO_STORE);
+}
+
+static inline unsigned int qemu_plugin_mem_mmu_idx(qemu_plugin_meminfo_t i)
+{
+    return (i >> QEMU_PLUGIN_MEMINFO_MMU_IDX_SHIFT) & 0xff;
+}
+
+typedef void (*qemu_plugin_udata_cb_t)(qemu_plugin_id_t id, void *userdata);
+
+typedef void (*qemu_plugin_vcpu_tb_trans_cb_t)(qemu_plugin_id_t id,
+                                               unsigned int vcpu_index,
+                                               struct qemu_plugin_tb *tb);
+
+typedef void (*qemu_plugin_vcpu_udata_cb_t)(unsigned int vcpu_index,
+                                            void *userdata);
+
+typedef void (*qemu_plugin_vcpu_mem_cb_t)(unsigned int vcpu_index,
+                                          qemu_plugin_meminfo_t info,
+                                          uint64_t vaddr, void *userdata);
+
+/* Entry points exported by the plugin.  */
+extern int qemu_plugin_version;
+int qemu_plugin_install(qemu_plugin_id_t id, int argc, char **argv);
+
+/* Registration, only valid from qemu_plugin_install.  */
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb);
+void qemu_plugin_register_vcpu_mem_cb(qemu_plugin_id_t id,
+                                      qemu_plugin_vcpu_mem_cb_t cb,
+                                      enum qemu_plugin_mem_rw rw,
+                                      void *userdata);
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb,
+                                    void *userdata);
+
+/* Translation block queries, only valid from the tb_trans callback.  */
+uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb);
+size_t qemu_plugin_tb_size(const struct qemu_plugin_tb *tb);
+size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb);
+struct qemu_plugin_insn *qemu_plugin_tb_get_insn(
+    const struct qemu_plugin_tb *tb, size_t idx);
+uint64_t qemu_plugin_insn_vaddr(const struct qemu_plugin_insn *insn);
+
+/* Execution instrumentation, only valid from the tb_trans callback.  */
+void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                          qemu_plugin_vcpu_udata_cb_t cb,
+                                          void *userdata);
+void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                              enum qemu_plugin_op op,
+                                              void *ptr, uint64_t imm);
+void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
+                                            qemu_plugin_vcpu_udata_cb_t cb,
+                                            void *userdata);
+void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
+                                                enum qemu_plugin_op op,
+                                                void *ptr, uint64_t imm);
+
+#endif
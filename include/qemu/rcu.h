@@ -0,0 +1,128 @@
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+/*
+ * Read-copy-update, modeled after the "memory barrier" flavor of liburcu
+ *
+ * Readers bracket their accesses to RCU-protected data with
+ * rcu_read_lock() and rcu_read_unlock(); these never block and can nest.
+ * Writers publish a new version of the data with atomic_rcu_set(), and
+ * reclaim the old version only after a grace period, i.e. once every
+ * reader that could have seen it has left its critical section.  This is
+ * done either synchronously with synchronize_rcu(), or asynchronously
+ * with call_rcu().
+ *
+ * Threads must call rcu_register_thread() before using rcu_read_lock().
+ * The main thread is registered automatically.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "qemu/compiler.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/tls.h"
+
+/* The low bit of rcu_gp_ctr is always set, so that a reader in a critical
+ * section never has a zero counter.
+ */
+#define RCU_GP_LOCKED           (1UL << 0)
+#define RCU_GP_CTR              (1UL << 1)
+
+/* Global grace period counter, read by rcu_read_lock().  */
+extern unsigned long rcu_gp_ctr;
+
+/* Set by a reader that leaves its critical section while a writer waits. */
+extern QemuEvent rcu_gp_event;
+
+struct rcu_reader_data {
+    /* Data used by both reader and synchronize_rcu() */
+    unsigned long ctr;
+    bool waiting;
+
+    /* Data used by reader only */
+    unsigned depth;
+
+    /* Data used for registry, protected by rcu_gp_lock */
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+DECLARE_TLS(struct rcu_reader_data, rcu_reader);
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &tls_var(rcu_reader);
+    unsigned long ctr;
+
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    ctr = atomic_read(&rcu_gp_ctr);
+    /* Full barrier: the counter must be visible before any read of
+     * RCU-protected data.
+     */
+    atomic_xchg(&p_rcu_reader->ctr, ctr);
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &tls_var(rcu_reader);
+
+    assert(p_rcu_reader->depth != 0);
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    /* Full barrier: reads of RCU-protected data must complete before the
+     * writer can see the zero counter.
+     */
+    atomic_xchg(&p_rcu_reader->ctr, 0);
+    if (unlikely(atomic_read(&p_rcu_reader->waiting))) {
+        atomic_set(&p_rcu_reader->waiting, false);
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+/* Wait until every reader that was in a critical section when the
+ * function was called has left it.  Must not be called inside a
+ * critical section.
+ */
+void synchronize_rcu(void);
+
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/* Run @func(@head) after a grace period.  The callbacks run in a separate
+ * thread, with the iothread mutex held.
+ */
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+/* Type-checked wrapper around call_rcu1: @field is the struct rcu_head
+ * member of *@head, which must be its first member so that @func can
+ * take a pointer to the enclosing structure.
+ */
+#define call_rcu(head, func, field)                                      \
+    call_rcu1(({                                                         \
+         char __attribute__((unused))                                    \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)],      \
+            func_type_invalid = (func) - (void (*)(typeof(head)))(func); \
+         &(head)->field;                                                 \
+      }),                                                                \
+      (RCUCBFunc *)(func))
+
+#endif
@@ -25,5 +25,7 @@ int qemu_add_balloon_handler(QEMUBalloonEvent *event_func,
 void qemu_remove_balloon_handler(void *opaque);
 
 void qemu_balloon_changed(int64_t actual);
+void qemu_balloon_inhibit(bool state);
+bool qemu_balloon_is_inhibited(void);
 
 #endif
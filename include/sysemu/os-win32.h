@@ -54,6 +54,9 @@
 #ifndef EWOULDBLOCK
 # define EWOULDBLOCK  WSAEWOULDBLOCK
 #endif
+#ifndef SHUT_RDWR
+# define SHUT_RDWR    SD_BOTH
+#endif
 
 #if defined(_WIN64)
 /* On w64, setjmp is implemented by _setjmp which needs a second parameter.
@@ -9,6 +9,7 @@
 #include "qapi-types.h"
 #include "qemu/notify.h"
 #include "qemu/main-loop.h"
+#include "qom/object.h"
 
 /* vl.c */
 
@@ -83,9 +84,24 @@ void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 void qemu_savevm_state_complete(QEMUFile *f);
+void qemu_savevm_state_postcopy_devices(QEMUFile *f);
+void qemu_savevm_state_postcopy_complete(QEMUFile *f);
+void qemu_savevm_state_background_complete(QEMUFile *f, GByteArray *devices);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
+void qemu_savevm_device_cost(int64_t *time_ns, uint64_t *bytes);
+void qemu_savevm_publish_section_stats(bool load);
+MigrationSectionStatsList *qemu_savevm_section_stats(bool load);
+void qemu_savevm_send_open_return_path(QEMUFile *f);
+void qemu_savevm_send_postcopy_advise(QEMUFile *f);
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *idstr,
+                                           uint16_t len, uint64_t *start,
+                                           uint64_t *length);
+void qemu_savevm_send_postcopy_listen(QEMUFile *f);
+void qemu_savevm_send_postcopy_run(QEMUFile *f);
+int qemu_savevm_send_packaged(QEMUFile *f, GByteArray *buf);
 int qemu_loadvm_state(QEMUFile *f);
+int qemu_loadvm_state_unlocked(QEMUFile *f);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
@@ -144,6 +160,12 @@ extern QEMUClockType rtc_clock;
 extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
+void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
+                                          const char *name,
+                                          uint64_t ram_size);
+
+extern int mem_prealloc;
+extern int mem_prealloc_threads;
 
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
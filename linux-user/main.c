@@ -33,6 +33,7 @@
 #include "tcg.h"
 #include "qemu/timer.h"
 #include "qemu/envlist.h"
+#include "exec/tcg-plugin.h"
 #include "elf.h"
 
 char *exec_path;
@@ -43,6 +44,7 @@ const char *argv0;
 int gdbstub_port;
 envlist_t *envlist;
 static const char *cpu_model;
+static const char *jit_stats_filename;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -76,6 +78,23 @@ const char *qemu_uname_release;
    by remapping the process stack directly at the right place */
 unsigned long guest_stack_size = 8 * 1024 * 1024UL;
 
+/* Called when the guest process exits.  */
+void dump_jit_stats(void)
+{
+    FILE *f;
+
+    if (!jit_stats_filename) {
+        return;
+    }
+    f = fopen(jit_stats_filename, "w");
+    if (!f) {
+        perror(jit_stats_filename);
+        return;
+    }
+    dump_tb_stats(f);
+    fclose(f);
+}
+
 void gemu_log(const char *fmt, ...)
 {
     va_list ap;
@@ -3615,6 +3634,25 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_jit_stats(const char *arg)
+{
+    jit_stats_filename = arg;
+    tb_stats_enabled = true;
+}
+
+#ifdef CONFIG_TCG_PLUGIN
+static void handle_arg_plugin(const char *arg)
+{
+    char **args = g_strsplit(arg, ",", 0);
+
+    if (!args[0] || tcg_plugin_load(args[0], g_strv_length(args) - 1,
+                                    args + 1) < 0) {
+        exit(1);
+    }
+    g_strfreev(args);
+}
+#endif
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_NAME " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3667,6 +3705,12 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"jitstats",   "QEMU_JIT_STATS",   true,  handle_arg_jit_stats,
+     "file",       "write translation statistics to 'file' at exit"},
+#ifdef CONFIG_TCG_PLUGIN
+    {"plugin",     "QEMU_PLUGIN",      true,  handle_arg_plugin,
+     "file[,arg...]", "load a TCG instrumentation plugin"},
+#endif
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
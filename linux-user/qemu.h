@@ -140,6 +140,7 @@ extern char *exec_path;
 void init_task_state(TaskState *ts);
 void task_settid(TaskState *);
 void stop_all_tasks(void);
+void dump_jit_stats(void);
 extern const char *qemu_uname_release;
 extern unsigned long mmap_min_addr;
 
@@ -111,6 +111,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "uname.h"
 
 #include "qemu.h"
+#include "exec/tcg-plugin.h"
 
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
     CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)
@@ -4947,6 +4948,42 @@ int host_to_target_waitstatus(int status)
     return status;
 }
 
+struct self_maps_line {
+    int fd;
+    abi_ulong start, end;
+    uint64_t offset;
+    char flag_p;
+    int dev_maj, dev_min, inode;
+    const char *path;
+};
+
+/* Print the part of a host mapping that overlaps a guest region.  The
+   parts of the reserved area that the guest has not mapped have no
+   region and are skipped; a host mapping with mixed guest protections
+   is split.  The protection is the guest's view: pages holding
+   translated code are write-protected on the host.  */
+static int self_maps_region(void *priv, abi_ulong start, abi_ulong end,
+                            unsigned long flags)
+{
+    struct self_maps_line *m = priv;
+
+    if (!(flags & PAGE_VALID)) {
+        return 0;
+    }
+    start = MAX(start, m->start);
+    end = MIN(end, m->end);
+    dprintf(m->fd, TARGET_ABI_FMT_lx "-" TARGET_ABI_FMT_lx
+            " %c%c%c%c %08" PRIx64 " %02x:%02x %d %s%s\n",
+            start, end,
+            (flags & PAGE_READ) ? 'r' : '-',
+            (flags & PAGE_WRITE_ORG) ? 'w' : '-',
+            (flags & PAGE_EXEC) ? 'x' : '-',
+            m->flag_p, m->offset + (start - m->start),
+            m->dev_maj, m->dev_min, m->inode,
+            m->path[0] ? "         " : "", m->path);
+    return 0;
+}
+
 static int open_self_maps(void *cpu_env, int fd)
 {
 #if defined(TARGET_ARM) || defined(TARGET_M68K) || defined(TARGET_UNICORE32)
@@ -4979,11 +5016,14 @@ static int open_self_maps(void *cpu_env, int fd)
             continue;
         }
         if (h2g_valid(min) && h2g_valid(max)) {
-            dprintf(fd, TARGET_ABI_FMT_lx "-" TARGET_ABI_FMT_lx
-                    " %c%c%c%c %08" PRIx64 " %02x:%02x %d %s%s\n",
-                    h2g(min), h2g(max), flag_r, flag_w,
-                    flag_x, flag_p, offset, dev_maj, dev_min, inode,
-                    path[0] ? "         " : "", path);
+            struct self_maps_line m = {
+                .fd = fd, .start = h2g(min), .end = h2g(max),
+                .offset = offset, .flag_p = flag_p, .dev_maj = dev_maj,
+                .dev_min = dev_min, .inode = inode, .path = path,
+            };
+
+            walk_memory_regions_range(m.start, m.end - 1, &m,
+                                      self_maps_region);
         }
     }
 
@@ -5242,6 +5282,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tcg_plugin_exit();
+        dump_jit_stats();
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -7050,6 +7092,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tcg_plugin_exit();
+        dump_jit_stats();
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
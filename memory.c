@@ -18,6 +18,8 @@
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
 #include "qom/object.h"
+#include "qemu/timer.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 #include <assert.h>
 
@@ -30,14 +32,14 @@ static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool global_dirty_log = false;
 
-/* flat_view_mutex is taken around reading as->current_map; the critical
- * section is extremely short, so I'm using a single mutex for every AS.
- * We could also RCU for the read-side.
- *
- * The BQL is taken around transaction commits, hence both locks are taken
- * while writing to as->current_map (with the BQL taken outside).
+/* Statistics for "info mtree": number of transactions that changed the
+ * memory map, how many address spaces were rendered again from scratch
+ * or only partially, and the total time spent updating the topology.
  */
-static QemuMutex flat_view_mutex;
+static uint64_t topology_update_count;
+static uint64_t topology_update_full;
+static uint64_t topology_update_partial;
+static int64_t topology_update_ns;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -45,11 +47,6 @@ static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
-static void memory_init(void)
-{
-    qemu_mutex_init(&flat_view_mutex);
-}
-
 typedef struct AddrRange AddrRange;
 
 /*
@@ -102,6 +99,67 @@ static AddrRange addrrange_intersection(AddrRange r1, AddrRange r2)
     return addrrange_make(start, int128_sub(end, start));
 }
 
+/* Part of a memory region tree that changed in the current transaction,
+ * in the coordinates of the root of the tree.
+ */
+typedef struct MemoryRegionUpdate {
+    MemoryRegion *root;
+    AddrRange range;
+} MemoryRegionUpdate;
+
+static GArray *memory_region_updates;
+
+/* Above this many disjoint changed ranges in an address space, render the
+ * whole address space again instead of patching its flat view.
+ */
+#define MAX_PARTIAL_UPDATES 32
+
+static void memory_region_add_update(MemoryRegion *root, AddrRange range)
+{
+    MemoryRegionUpdate update = { .root = root, .range = range };
+
+    if (!memory_region_updates) {
+        memory_region_updates = g_array_new(false, false,
+                                            sizeof(MemoryRegionUpdate));
+    }
+    g_array_append_val(memory_region_updates, update);
+    memory_region_update_pending = true;
+}
+
+/* Record that @range (relative to the start of @mr) changed, and find
+ * every root through which it is visible: walk up the containers and
+ * follow the aliases that point into @mr.
+ */
+static void memory_region_schedule_update(MemoryRegion *mr, AddrRange range)
+{
+    MemoryRegion *alias;
+    AddrRange extent = addrrange_make(int128_zero(), mr->size);
+    Int128 delta;
+
+    if (!addrrange_intersects(range, extent)) {
+        return;
+    }
+    range = addrrange_intersection(range, extent);
+
+    QTAILQ_FOREACH(alias, &mr->aliases, aliases_link) {
+        delta = int128_neg(int128_make64(alias->alias_offset));
+        memory_region_schedule_update(alias, addrrange_shift(range, delta));
+    }
+
+    if (mr->parent) {
+        delta = int128_make64(mr->addr);
+        memory_region_schedule_update(mr->parent,
+                                      addrrange_shift(range, delta));
+    } else {
+        memory_region_add_update(mr, range);
+    }
+}
+
+static void memory_region_schedule_update_all(MemoryRegion *mr)
+{
+    memory_region_schedule_update(mr, addrrange_make(int128_zero(), mr->size));
+}
+
 enum ListenerDirection { Forward, Reverse };
 
 static bool memory_listener_match(MemoryListener *listener,
@@ -238,8 +296,13 @@ struct FlatRange {
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
  * order.
+ *
+ * as->current_map is published with RCU: readers take a reference within
+ * rcu_read_lock(), and the reference held by the address space is only
+ * dropped after a grace period.
  */
 struct FlatView {
+    struct rcu_head rcu;
     unsigned ref;
     FlatRange *ranges;
     unsigned nr;
@@ -599,6 +662,108 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Render again the parts of @mr covered by the @nr sorted, disjoint ranges
+ * in @clip.  Everything outside them is copied from @old_view, so that only
+ * the changed subtrees of @mr are visited.
+ */
+static FlatView *generate_memory_topology_partial(MemoryRegion *mr,
+                                                  const FlatView *old_view,
+                                                  const AddrRange *clip,
+                                                  unsigned nr)
+{
+    FlatView *view;
+    FlatRange *fr, piece;
+    Int128 start, end, stop;
+    unsigned i;
+
+    view = g_new(FlatView, 1);
+    flatview_init(view);
+
+    i = 0;
+    FOR_EACH_FLAT_RANGE(fr, old_view) {
+        start = fr->addr.start;
+        end = addrrange_end(fr->addr);
+        while (int128_lt(start, end)) {
+            while (i < nr && int128_le(addrrange_end(clip[i]), start)) {
+                ++i;
+            }
+            stop = end;
+            if (i < nr) {
+                if (int128_le(clip[i].start, start)) {
+                    start = int128_min(addrrange_end(clip[i]), end);
+                    continue;
+                }
+                stop = int128_min(end, clip[i].start);
+            }
+            piece = *fr;
+            piece.offset_in_region +=
+                int128_get64(int128_sub(start, fr->addr.start));
+            piece.addr = addrrange_make(start, int128_sub(stop, start));
+            flatview_insert(view, view->nr, &piece);
+            start = stop;
+        }
+    }
+
+    if (mr) {
+        for (i = 0; i < nr; i++) {
+            render_memory_region(view, mr, int128_zero(), clip[i], false);
+        }
+    }
+    flatview_simplify(view);
+
+    return view;
+}
+
+static gint addrrange_compare(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
+    }
+    return int128_eq(r1->start, r2->start) ? 0 : 1;
+}
+
+/* Collect the ranges of @as that changed in this transaction, sorted and
+ * merged.  Returns NULL if the address space was not touched.
+ */
+static GArray *address_space_get_updates(AddressSpace *as)
+{
+    GArray *ranges = NULL;
+    MemoryRegionUpdate *update;
+    AddrRange *cur, *next;
+    unsigned i, j;
+
+    for (i = 0; i < memory_region_updates->len; i++) {
+        update = &g_array_index(memory_region_updates, MemoryRegionUpdate, i);
+        if (update->root != as->root) {
+            continue;
+        }
+        if (!ranges) {
+            ranges = g_array_new(false, false, sizeof(AddrRange));
+        }
+        g_array_append_val(ranges, update->range);
+    }
+    if (!ranges) {
+        return NULL;
+    }
+
+    g_array_sort(ranges, addrrange_compare);
+    for (i = 0, j = 1; j < ranges->len; j++) {
+        cur = &g_array_index(ranges, AddrRange, i);
+        next = &g_array_index(ranges, AddrRange, j);
+        if (int128_ge(addrrange_end(*cur), next->start)) {
+            cur->size = int128_sub(int128_max(addrrange_end(*cur),
+                                              addrrange_end(*next)),
+                                   cur->start);
+        } else {
+            g_array_index(ranges, AddrRange, ++i) = *next;
+        }
+    }
+    g_array_set_size(ranges, i + 1);
+    return ranges;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -652,10 +817,10 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
 {
     FlatView *view;
 
-    qemu_mutex_lock(&flat_view_mutex);
-    view = as->current_map;
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
     flatview_ref(view);
-    qemu_mutex_unlock(&flat_view_mutex);
+    rcu_read_unlock();
     return view;
 }
 
@@ -758,16 +923,37 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *old_view;
+    FlatView *new_view;
+    GArray *ranges = NULL;
+
+    if (as->root) {
+        ranges = address_space_get_updates(as);
+        if (!ranges) {
+            return;
+        }
+    }
+
+    old_view = address_space_get_flatview(as);
+    if (ranges && ranges->len <= MAX_PARTIAL_UPDATES) {
+        new_view = generate_memory_topology_partial(as->root, old_view,
+                                                    (AddrRange *)ranges->data,
+                                                    ranges->len);
+        topology_update_partial++;
+    } else {
+        new_view = generate_memory_topology(as->root);
+        topology_update_full++;
+    }
+    if (ranges) {
+        g_array_free(ranges, true);
+    }
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
-    qemu_mutex_lock(&flat_view_mutex);
-    flatview_unref(as->current_map);
-    as->current_map = new_view;
-    qemu_mutex_unlock(&flat_view_mutex);
+    /* Writes are protected by the BQL.  */
+    atomic_rcu_set(&as->current_map, new_view);
+    call_rcu(old_view, flatview_unref, rcu);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -793,6 +979,8 @@ void memory_region_transaction_commit(void)
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth && memory_region_update_pending) {
+        int64_t start = get_clock(), elapsed;
+
         memory_region_update_pending = false;
         MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
@@ -801,6 +989,12 @@ void memory_region_transaction_commit(void)
         }
 
         MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+        g_array_set_size(memory_region_updates, 0);
+
+        elapsed = get_clock() - start;
+        topology_update_count++;
+        topology_update_ns += elapsed;
+        trace_memory_region_transaction_commit(elapsed);
     }
 }
 
@@ -815,6 +1009,7 @@ static void memory_region_destructor_ram(MemoryRegion *mr)
 
 static void memory_region_destructor_alias(MemoryRegion *mr)
 {
+    QTAILQ_REMOVE(&mr->alias->aliases, mr, aliases_link);
     memory_region_unref(mr->alias);
 }
 
@@ -855,6 +1050,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->may_overlap = false;
     mr->alias = NULL;
     QTAILQ_INIT(&mr->subregions);
+    QTAILQ_INIT(&mr->aliases);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
     QTAILQ_INIT(&mr->coalesced);
     mr->name = g_strdup(name);
@@ -1019,6 +1215,23 @@ void memory_region_init_ram(MemoryRegion *mr,
     mr->ram_addr = qemu_ram_alloc(size, mr);
 }
 
+#ifdef __linux__
+void memory_region_init_ram_from_file(MemoryRegion *mr,
+                                      struct Object *owner,
+                                      const char *name,
+                                      uint64_t size,
+                                      bool share,
+                                      const char *path,
+                                      Error **errp)
+{
+    memory_region_init(mr, owner, name, size);
+    mr->ram = true;
+    mr->terminates = true;
+    mr->destructor = memory_region_destructor_ram;
+    mr->ram_addr = qemu_ram_alloc_from_file(size, mr, share, path, errp);
+}
+#endif
+
 void memory_region_init_ram_ptr(MemoryRegion *mr,
                                 Object *owner,
                                 const char *name,
@@ -1044,6 +1257,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     mr->destructor = memory_region_destructor_alias;
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1167,7 +1381,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_schedule_update_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1219,7 +1435,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_schedule_update_all(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1229,7 +1447,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_schedule_update_all(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1252,6 +1472,17 @@ void *memory_region_get_ram_ptr(MemoryRegion *mr)
     return qemu_get_ram_ptr(mr->ram_addr & TARGET_PAGE_MASK);
 }
 
+uint64_t memory_region_get_page_size(MemoryRegion *mr)
+{
+    if (mr->alias) {
+        return memory_region_get_page_size(mr->alias);
+    }
+
+    assert(mr->terminates);
+
+    return qemu_ram_pagesize(mr->ram_addr & TARGET_PAGE_MASK);
+}
+
 static void memory_region_update_coalesced_range_as(MemoryRegion *mr, AddressSpace *as)
 {
     FlatView *view;
@@ -1373,7 +1604,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_schedule_update_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1406,7 +1639,9 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_schedule_update_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1451,7 +1686,10 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_schedule_update(mr, addrrange_make(int128_make64(offset),
+                                                         subregion->size));
+    }
     memory_region_transaction_commit();
 }
 
@@ -1482,8 +1720,12 @@ void memory_region_del_subregion(MemoryRegion *mr,
     assert(subregion->parent == mr);
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    if (mr->enabled && subregion->enabled) {
+        AddrRange range = addrrange_make(int128_make64(subregion->addr),
+                                         subregion->size);
+        memory_region_schedule_update(mr, range);
+    }
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1494,7 +1736,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_schedule_update_all(mr);
     memory_region_transaction_commit();
 }
 
@@ -1531,7 +1773,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_schedule_update_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1703,10 +1947,6 @@ void memory_listener_unregister(MemoryListener *listener)
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 {
-    if (QTAILQ_EMPTY(&address_spaces)) {
-        memory_init();
-    }
-
     memory_region_transaction_begin();
     as->root = root;
     as->current_map = g_new(FlatView, 1);
@@ -1716,7 +1956,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
-    memory_region_update_pending |= root->enabled;
+    if (root->enabled) {
+        memory_region_add_update(root, addrrange_make(int128_zero(),
+                                                      int128_2_64()));
+    }
     memory_region_transaction_commit();
 }
 
@@ -1735,7 +1978,7 @@ void address_space_destroy(AddressSpace *as)
         assert(listener->address_space_filter != as);
     }
 
-    flatview_unref(as->current_map);
+    call_rcu(as->current_map, flatview_unref, rcu);
     g_free(as->name);
     g_free(as->ioeventfds);
 }
@@ -1884,4 +2127,20 @@ void mtree_info(fprintf_function mon_printf, void *f)
     QTAILQ_FOREACH_SAFE(ml, &ml_head, queue, ml2) {
         g_free(ml);
     }
+
+    mon_printf(f, "topology updates: %" PRIu64 " (%" PRIu64 " full and %"
+               PRIu64 " partial address space renders), %" PRId64 " us\n",
+               topology_update_count, topology_update_full,
+               topology_update_partial, topology_update_ns / SCALE_US);
+
+    mon_printf(f, "bounce buffers\n");
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        qemu_mutex_lock(&as->bounce_lock);
+        mon_printf(f, "  %s: %" PRIu64 "/%" PRIu64 " bytes in use, %" PRIu64
+                   " maps, %" PRIu64 " failed, %" PRIu64 " retries\n",
+                   as->name, (uint64_t)as->bounce_buffer_size,
+                   (uint64_t)as->max_bounce_buffer_size, as->bounce_maps,
+                   as->bounce_map_failures, as->bounce_map_retries);
+        qemu_mutex_unlock(&as->bounce_lock);
+    }
 }
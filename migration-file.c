@@ -0,0 +1,101 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * The RAM of a file: migration may use the mapped-ram layout, in which
+ * every page has a fixed offset in the file; see arch_init.c.  Such a
+ * file can be restored with file-map: instead of file:, which maps the
+ * RAM from the file and lets the guest fault it in.  The file must then
+ * not be modified while the guest runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Path of the last file: migration, for file_open_direct */
+static char *file_path;
+/* Whether the incoming migration was started with file-map: */
+static bool file_map_ram;
+
+static void file_set_path(const char *path)
+{
+    g_free(file_path);
+    file_path = g_strdup(path);
+}
+
+int file_open_direct(bool write)
+{
+#ifdef O_DIRECT
+    if (file_path) {
+        return qemu_open(file_path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+    }
+#endif
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool file_incoming_map_ram(void)
+{
+    return file_map_ram;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    DPRINTF("Attempting to start an outgoing migration to %s\n", path);
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return;
+    }
+    file_set_path(path);
+    s->file = qemu_fdopen(fd, "wb");
+
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, bool map_ram,
+                                   Error **errp)
+{
+    int fd;
+    QEMUFile *f;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return;
+    }
+    file_set_path(path);
+    file_map_ram = map_ram;
+    f = qemu_fdopen(fd, "rb");
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
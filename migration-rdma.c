@@ -1493,10 +1493,10 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
 
     while (1) {
         /*
-         * Coroutine doesn't start until process_incoming_migration()
-         * so don't yield unless we know we're running inside of a coroutine.
+         * The incoming migration thread blocks in ibv_get_cq_event, so
+         * only yield when running inside of a coroutine.
          */
-        if (rdma->migration_started_on_destination) {
+        if (rdma->migration_started_on_destination && qemu_in_coroutine()) {
             yield_until_fd_readable(rdma->comp_channel->fd);
         }
 
@@ -1920,9 +1920,7 @@ retry:
              * memset() + madvise() the entire chunk without RDMA.
              */
 
-            if (can_use_buffer_find_nonzero_offset((void *)sge.addr, length)
-                   && buffer_find_nonzero_offset((void *)sge.addr,
-                                                    length) == length) {
+            if (buffer_is_zero((void *)sge.addr, length)) {
                 RDMACompress comp = {
                                         .offset = current_addr,
                                         .value = 0,
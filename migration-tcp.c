@@ -50,9 +50,96 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    if (migrate_use_multifd()) {
+        s->multifd_host_port = g_strdup(host_port);
+    }
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Open one more connection to the destination for the multifd
+ * capability.  This blocks, so it is called from the migration thread.
+ */
+QEMUFile *tcp_open_outgoing_channel(MigrationState *s, Error **errp)
+{
+    QEMUFile *f;
+    int fd;
+
+    if (!s->multifd_host_port) {
+        error_setg(errp, "multifd migration requires a tcp: URI");
+        return NULL;
+    }
+
+    fd = inet_connect(s->multifd_host_port, errp);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    f = qemu_fopen_socket(fd, "wb");
+    if (f == NULL) {
+        error_setg(errp, "could not qemu_fopen socket");
+        closesocket(fd);
+    }
+    return f;
+}
+
+/* With the multifd capability, the listening socket stays open after
+ * the main connection is accepted; the other channels are accepted by a
+ * separate thread because the main loop may be blocked waiting for them.
+ */
+static QemuThread accept_thread;
+static bool accept_thread_running;
+static int accept_fd = -1;
+
+static void *tcp_accept_incoming_channels(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    QEMUFile *f;
+    int i, c, err;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        do {
+            addrlen = sizeof(addr);
+            c = qemu_accept(accept_fd, (struct sockaddr *)&addr, &addrlen);
+            err = socket_error();
+        } while (c < 0 && err == EINTR);
+
+        if (c < 0) {
+            error_report("could not accept multifd connection (%s)",
+                         strerror(err));
+            multifd_recv_abort();
+            break;
+        }
+
+        DPRINTF("accepted multifd channel\n");
+        qemu_set_block(c);
+        f = qemu_fopen_socket(c, "rb");
+        if (f == NULL) {
+            error_report("could not qemu_fopen socket");
+            closesocket(c);
+            multifd_recv_abort();
+            break;
+        }
+        multifd_recv_new_channel(f);
+    }
+
+    return NULL;
+}
+
+void tcp_incoming_channels_join(void)
+{
+    if (!accept_thread_running) {
+        return;
+    }
+
+    /* Wake up the thread if some channel never connected.  */
+    shutdown(accept_fd, SHUT_RDWR);
+    qemu_thread_join(&accept_thread);
+    closesocket(accept_fd);
+    accept_fd = -1;
+    accept_thread_running = false;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -66,16 +153,27 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
+        closesocket(s);
         error_report("could not accept migration connection (%s)",
                      strerror(err));
         return;
     }
 
+    if (migrate_use_multifd()) {
+        qemu_set_block(s);
+        accept_fd = s;
+        accept_thread_running = true;
+        qemu_thread_create(&accept_thread, "multifd_accept",
+                           tcp_accept_incoming_channels, NULL,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        closesocket(s);
+    }
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
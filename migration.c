@@ -22,7 +22,9 @@
 #include "block/block.h"
 #include "qemu/sockets.h"
 #include "migration/block.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/thread.h"
+#include "qemu/error-report.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -34,6 +36,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -46,6 +49,22 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression parameters, see migrate-set-parameters */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
+/* Default and maximum number of multifd channels */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define MAX_MIGRATE_MULTIFD_CHANNELS 255
+
+/* Maximum number of XBZRLE encoding threads; 0 encodes inline */
+#define MAX_MIGRATE_XBZRLE_THREAD_COUNT 255
+
+/* Maximum number of RAM loading threads; 0 loads inline */
+#define MAX_MIGRATE_LOAD_THREAD_COUNT 255
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -60,6 +79,14 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+            DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+            DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+            DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+            DEFAULT_MIGRATE_MULTIFD_CHANNELS,
     };
 
     return &current_migration;
@@ -82,25 +109,137 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, false, errp);
+    else if (strstart(uri, "file-map:", &p))
+        file_start_incoming_migration(p, true, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
 }
 
-static void process_incoming_migration_co(void *opaque)
+/* Return path of an incoming migration; the fault thread, the postcopy
+ * listen thread and the main loop all send on it.
+ */
+static QemuMutex incoming_rp_mutex;
+static int incoming_rp_fd = -1;
+
+int migrate_incoming_open_return_path(QEMUFile *f)
+{
+#if !defined(WIN32)
+    struct stat st;
+    int fd = qemu_get_fd(f);
+
+    if (incoming_rp_fd != -1) {
+        error_report("Return path already open");
+        return -EINVAL;
+    }
+    if (fd == -1 || fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        error_report("Return path requires a socket migration stream");
+        return -EINVAL;
+    }
+    fd = dup(fd);
+    if (fd < 0) {
+        error_report("Failed to open the return path: %s", strerror(errno));
+        return -errno;
+    }
+
+    qemu_mutex_init(&incoming_rp_mutex);
+    incoming_rp_fd = fd;
+    return 0;
+#else
+    error_report("Return path is not supported on this host");
+    return -ENOTSUP;
+#endif
+}
+
+static void migrate_send_rp_message(enum mig_rp_message_type type,
+                                    uint16_t len, const void *data)
+{
+    uint16_t header[2];
+
+    trace_migrate_send_rp_message(type, len);
+    header[0] = cpu_to_be16(type);
+    header[1] = cpu_to_be16(len);
+
+    qemu_mutex_lock(&incoming_rp_mutex);
+    /* Errors show up on the source, which fails the migration.  */
+    if (incoming_rp_fd != -1 &&
+        send_all(incoming_rp_fd, header, sizeof(header)) == sizeof(header)) {
+        send_all(incoming_rp_fd, data, len);
+    }
+    qemu_mutex_unlock(&incoming_rp_mutex);
+}
+
+/* Ask the source for @len bytes at @start in RAMBlock @idstr.  */
+void migrate_send_rp_req_pages(const char *idstr, ram_addr_t start,
+                               size_t len)
+{
+    uint8_t buf[13 + 256];
+    size_t idlen = strlen(idstr);
+
+    stq_be_p(buf, start);
+    stl_be_p(buf + 8, len);
+    buf[12] = idlen;
+    memcpy(buf + 13, idstr, idlen);
+    migrate_send_rp_message(MIG_RP_MSG_REQ_PAGES, 13 + idlen, buf);
+}
+
+/* Tell the source that the load is over, with result @ret.  */
+void migrate_incoming_close_return_path(int ret)
+{
+    uint32_t val = cpu_to_be32(ret < 0);
+
+    if (incoming_rp_fd == -1) {
+        return;
+    }
+
+    migrate_send_rp_message(MIG_RP_MSG_SHUT, sizeof(val), &val);
+    qemu_mutex_lock(&incoming_rp_mutex);
+    closesocket(incoming_rp_fd);
+    incoming_rp_fd = -1;
+    qemu_mutex_unlock(&incoming_rp_mutex);
+}
+
+/* Loads the incoming migration without the iothread lock, which it only
+ * takes for the device state and to start the guest.
+ */
+static void *process_incoming_migration_thread(void *opaque)
 {
     QEMUFile *f = opaque;
     Error *local_err = NULL;
     int ret;
 
-    ret = qemu_loadvm_state(f);
+    ret = qemu_loadvm_state_unlocked(f);
+    if (postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        /* The postcopy listen thread reads the rest of the stream, and the
+         * guest has been started already.
+         */
+        if (ret < 0) {
+            fprintf(stderr, "load of migration failed\n");
+            exit(EXIT_FAILURE);
+        }
+        return NULL;
+    }
+    migrate_incoming_close_return_path(ret);
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    ram_load_cleanup();
+    migrate_decompress_threads_join();
+    migrate_load_threads_join();
+    if (ret < 0) {
+        multifd_recv_abort();
+    }
+    tcp_incoming_channels_join();
+    multifd_load_cleanup();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
     }
+
+    qemu_mutex_lock_iothread();
+    qemu_savevm_publish_section_stats(true);
     qemu_announce_self();
 
     bdrv_clear_incoming_migration_all();
@@ -117,16 +256,21 @@ static void process_incoming_migration_co(void *opaque)
     } else {
         runstate_set(RUN_STATE_PAUSED);
     }
+    qemu_mutex_unlock_iothread();
+    return NULL;
 }
 
 void process_incoming_migration(QEMUFile *f)
 {
-    Coroutine *co = qemu_coroutine_create(process_incoming_migration_co);
+    QemuThread thread;
     int fd = qemu_get_fd(f);
 
     assert(fd != -1);
-    qemu_set_nonblock(fd);
-    qemu_coroutine_enter(co, f);
+    /* Reads block the incoming migration thread.  */
+    qemu_set_block(fd);
+    qemu_thread_create(&thread, "migration/incoming",
+                       process_incoming_migration_thread, f,
+                       QEMU_THREAD_DETACHED);
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -165,6 +309,28 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level =
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    params->xbzrle_threads =
+        s->parameters[MIGRATION_PARAMETER_XBZRLE_THREADS];
+    params->load_threads =
+        s->parameters[MIGRATION_PARAMETER_LOAD_THREADS];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -195,8 +361,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            info->status = g_strdup("postcopy-active");
+        } else {
+            info->status = g_strdup("active");
+        }
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -226,6 +397,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->total = blk_mig_bytes_total();
         }
 
+        if (auto_converge_throttle_percentage()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = auto_converge_throttle_percentage();
+        }
+
         get_xbzrle_cache_stats(info);
         break;
     case MIG_STATE_COMPLETED:
@@ -251,6 +427,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+
+        info->device_save_stats = qemu_savevm_section_stats(false);
+        info->has_device_save_stats = info->device_save_stats != NULL;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -262,6 +441,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     }
 
+    info->device_load_stats = qemu_savevm_section_stats(true);
+    info->has_device_load_stats = info->device_load_stats != NULL;
+
     return info;
 }
 
@@ -271,7 +453,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -281,6 +464,90 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_xbzrle_threads,
+                                int64_t xbzrle_threads,
+                                bool has_load_threads,
+                                int64_t load_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "an integer in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_multifd_channels &&
+        (multifd_channels < 1 ||
+         multifd_channels > MAX_MIGRATE_MULTIFD_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd-channels",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_xbzrle_threads &&
+        (xbzrle_threads < 0 ||
+         xbzrle_threads > MAX_MIGRATE_XBZRLE_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "xbzrle-threads",
+                  "an integer in the range of 0 to 255");
+        return;
+    }
+    if (has_load_threads &&
+        (load_threads < 0 || load_threads > MAX_MIGRATE_LOAD_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "load-threads",
+                  "an integer in the range of 0 to 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+            compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+            decompress_threads;
+    }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+            multifd_channels;
+    }
+    if (has_xbzrle_threads) {
+        s->parameters[MIGRATION_PARAMETER_XBZRLE_THREADS] = xbzrle_threads;
+    }
+    if (has_load_threads) {
+        s->parameters[MIGRATION_PARAMETER_LOAD_THREADS] = load_threads;
+    }
+}
+
 /* shared migration helpers */
 
 static void migrate_set_state(MigrationState *s, int old_state, int new_state)
@@ -308,6 +575,7 @@ static void migrate_fd_cleanup(void *opaque)
     }
 
     assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -373,15 +641,19 @@ static MigrationState *migrate_init(const MigrationParams *params)
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
+    g_free(s->multifd_host_port);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
@@ -417,7 +689,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -436,6 +709,66 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_postcopy_ram()) {
+        if (params.blk || params.shared) {
+            error_setg(errp, "Block migration is not supported with postcopy");
+            return;
+        }
+        if (migrate_use_compression() || migrate_use_multifd()) {
+            error_setg(errp, "Postcopy cannot be combined with the compress "
+                       "or multifd capabilities");
+            return;
+        }
+    }
+
+    if (migrate_use_mapped_ram()) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "The mapped-ram capability requires a file: URI");
+            return;
+        }
+        if (params.blk || params.shared) {
+            error_setg(errp, "Block migration is not supported with "
+                       "mapped-ram");
+            return;
+        }
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_use_multifd() || migrate_postcopy_ram()) {
+            error_setg(errp, "The mapped-ram capability cannot be combined "
+                       "with xbzrle, compress, multifd or postcopy-ram");
+            return;
+        }
+    } else if (migrate_use_direct_io()) {
+        error_setg(errp, "The direct-io capability requires mapped-ram");
+        return;
+    }
+
+    if (migrate_use_zero_page_runs() && strstart(uri, "rdma:", NULL)) {
+        error_setg(errp, "The zero-page-runs capability is not supported "
+                   "with RDMA");
+        return;
+    }
+
+    if (migrate_use_background_snapshot()) {
+        if (params.blk || params.shared) {
+            error_setg(errp, "Block migration is not supported with "
+                       "background-snapshot");
+            return;
+        }
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression() || migrate_use_multifd() ||
+            migrate_use_mapped_ram() || strstart(uri, "rdma:", NULL)) {
+            error_setg(errp, "The background-snapshot capability cannot be "
+                       "combined with postcopy-ram, xbzrle, compress, "
+                       "multifd, mapped-ram or RDMA");
+            return;
+        }
+        if (!ram_write_tracking_supported()) {
+            error_setg(errp, "Background snapshots are not supported on "
+                       "this host");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -451,6 +784,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -470,6 +805,23 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable the postcopy-ram capability before starting "
+                   "the migration");
+        return;
+    }
+    if (s->state != MIG_STATE_SETUP && s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "No migration in precopy is running");
+        return;
+    }
+
+    atomic_mb_set(&s->start_postcopy, true);
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -547,6 +899,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -565,6 +926,114 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_use_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRECT_IO];
+}
+
+bool migrate_use_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_use_zero_page_runs(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_PAGE_RUNS];
+}
+
+int migrate_xbzrle_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_XBZRLE_THREADS];
+}
+
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_LOAD_THREADS];
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -576,6 +1045,203 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+/* Reads the messages of the destination, and queues the pages it asks
+ * for while in postcopy.
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->return_path;
+    uint8_t buf[13 + 256];
+    char idstr[256];
+    uint16_t type, len;
+    uint8_t idlen;
+
+    trace_source_return_path_thread_entry();
+    for (;;) {
+        type = qemu_get_be16(rp);
+        len = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp)) {
+            goto err;
+        }
+        if (len > sizeof(buf)) {
+            error_report("Return path message too long: %d", len);
+            goto err;
+        }
+        if (qemu_get_buffer(rp, buf, len) != len) {
+            goto err;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_SHUT:
+            if (len != 4) {
+                goto err;
+            }
+            trace_source_return_path_thread_shut(ldl_be_p(buf));
+            if (ldl_be_p(buf)) {
+                error_report("Load of migration failed on the destination");
+                goto err;
+            }
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            idlen = len >= 13 ? buf[12] : 0;
+            if (len < 13 || len != 13 + idlen) {
+                error_report("Invalid page request of length %d", len);
+                goto err;
+            }
+            memcpy(idstr, buf + 13, idlen);
+            idstr[idlen] = 0;
+            if (ram_save_queue_pages(idstr, ldq_be_p(buf),
+                                     (uint32_t)ldl_be_p(buf + 8)) < 0) {
+                goto err;
+            }
+            break;
+
+        default:
+            error_report("Unknown return path message %d", type);
+            goto err;
+        }
+    }
+
+err:
+    atomic_mb_set(&s->rp_error, true);
+out:
+    trace_source_return_path_thread_end();
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *s)
+{
+#if !defined(WIN32)
+    struct stat st;
+    int fd = qemu_get_fd(s->file);
+
+    if (fd == -1 || fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        error_report("Postcopy requires a tcp: or unix: migration URI");
+        return -1;
+    }
+    fd = dup(fd);
+    if (fd < 0) {
+        error_report("Failed to open the return path: %s", strerror(errno));
+        return -1;
+    }
+
+    s->return_path = qemu_fopen_socket(fd, "rb");
+    qemu_thread_create(&s->rp_thread, "return path",
+                       source_return_path_thread, s, QEMU_THREAD_JOINABLE);
+    return 0;
+#else
+    error_report("Postcopy is not supported on this host");
+    return -1;
+#endif
+}
+
+/* Waits for the destination to finish, unless the migration failed.  */
+static void await_return_path_close_on_source(MigrationState *s)
+{
+    if (!s->return_path) {
+        return;
+    }
+
+    if (s->state != MIG_STATE_COMPLETED) {
+        shutdown(qemu_get_fd(s->return_path), SHUT_RDWR);
+    }
+    qemu_thread_join(&s->rp_thread);
+    qemu_fclose(s->return_path);
+    s->return_path = NULL;
+
+    if (atomic_mb_read(&s->rp_error)) {
+        migrate_set_state(s, MIG_STATE_COMPLETED, MIG_STATE_ERROR);
+    }
+}
+
+/* Stops the guest, and sends what the destination needs to start it: the
+ * discarded pages and the device state.  From then on the source VM must
+ * not run again, even if the migration fails.
+ */
+static int postcopy_start(MigrationState *s, bool *old_vm_running)
+{
+    int64_t time_at_stop;
+    GByteArray *buf;
+    QEMUFile *fb;
+    int ret;
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        goto out;
+    }
+
+    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    if (s->state != MIG_STATE_POSTCOPY_ACTIVE) {
+        /* Cancelled: the guest can still be restarted here.  */
+        ret = -1;
+        goto out;
+    }
+    *old_vm_running = false;
+
+    ret = ram_postcopy_send_discard_bitmap(s->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    buf = g_byte_array_new();
+    fb = qemu_bufopen("wb", buf);
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_postcopy_devices(fb);
+    qemu_savevm_publish_section_stats(false);
+    qemu_savevm_send_postcopy_run(fb);
+    qemu_put_byte(fb, QEMU_VM_EOF);
+    qemu_fclose(fb);
+
+    /* Page requests from the destination must not wait for the rate
+     * limit.
+     */
+    qemu_file_set_rate_limit(s->file, INT64_MAX);
+    ret = qemu_savevm_send_packaged(s->file, buf);
+    g_byte_array_free(buf, TRUE);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+    qemu_mutex_unlock_iothread();
+    return 0;
+
+fail:
+    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
+/*
+ * Part of the downtime, in milliseconds, that goes to the device state
+ * rather than to the RAM left in qemu_savevm_state_pending.  It is
+ * taken from the last completion phase, if there was one, and includes
+ * sending the device state at @bandwidth bytes per millisecond.
+ */
+static double migration_device_downtime(double bandwidth)
+{
+    int64_t time_ns;
+    uint64_t bytes;
+    double downtime;
+
+    qemu_savevm_device_cost(&time_ns, &bytes);
+    downtime = time_ns / 1000000.0;
+    if (bandwidth > 0) {
+        downtime += bytes / bandwidth;
+    }
+    return downtime;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -585,13 +1251,25 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool postcopy = migrate_postcopy_ram();
+    int current_active_state = MIG_STATE_ACTIVE;
+
+    if (postcopy && open_return_path_on_source(s) < 0) {
+        migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+        postcopy = false;
+    }
 
     qemu_savevm_state_begin(s->file, &s->params);
+    if (postcopy) {
+        qemu_savevm_send_open_return_path(s->file);
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
 
-    while (s->state == MIG_STATE_ACTIVE) {
+    while (s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -599,7 +1277,25 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
+                if (postcopy && current_active_state == MIG_STATE_ACTIVE &&
+                    atomic_mb_read(&s->start_postcopy)) {
+                    if (postcopy_start(s, &old_vm_running) < 0) {
+                        break;
+                    }
+                    current_active_state = MIG_STATE_POSTCOPY_ACTIVE;
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
+            } else if (current_active_state == MIG_STATE_POSTCOPY_ACTIVE) {
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_postcopy_complete(s->file);
+                qemu_mutex_unlock_iothread();
+
+                if (!qemu_file_get_error(s->file)) {
+                    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                      MIG_STATE_COMPLETED);
+                    break;
+                }
             } else {
                 int ret;
 
@@ -612,6 +1308,7 @@ static void *migration_thread(void *opaque)
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
+                    qemu_savevm_publish_section_stats(false);
                 }
                 qemu_mutex_unlock_iothread();
 
@@ -627,8 +1324,8 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        if (qemu_file_get_error(s->file) || atomic_mb_read(&s->rp_error)) {
+            migrate_set_state(s, current_active_state, MIG_STATE_ERROR);
             break;
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -636,17 +1333,26 @@ static void *migration_thread(void *opaque)
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            double max_downtime_ms = migrate_max_downtime() / 1000000.0;
+            double device_downtime = migration_device_downtime(bandwidth);
+
+            /* Leave the device state its share of the downtime, but do
+             * not let a slow device starve the RAM of all of it.
+             */
+            max_size = bandwidth * MAX(max_downtime_ms - device_downtime,
+                                       max_downtime_ms / 2);
 
             s->mbps = time_spent ? (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0 : -1;
 
             trace_migrate_transferred(transferred_bytes, time_spent,
                                       bandwidth, max_size);
+            trace_migrate_device_downtime(device_downtime);
             /* if we haven't sent anything, we don't want to recalculate
                10000 is a small enough number for our purposes */
             if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                s->expected_downtime = s->dirty_bytes_rate / bandwidth +
+                                       device_downtime;
             }
 
             qemu_file_reset_rate_limit(s->file);
@@ -659,12 +1365,17 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    await_return_path_close_on_source(s);
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (current_active_state == MIG_STATE_ACTIVE) {
+            /* In postcopy, postcopy_start measured the downtime */
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
@@ -681,6 +1392,117 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Background snapshot: the device state and the RAM are taken while the
+ * guest is stopped for a moment at the start, and the RAM is written out
+ * afterwards while the guest runs.  Guest writes to pages that are not
+ * saved yet wait until they are, so that the stream has the RAM as it
+ * was; they may also wait for the rate limit.
+ */
+static void *background_snapshot_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t initial_bytes = 0;
+    int64_t start_time;
+    GByteArray *devices = g_byte_array_new();
+    QEMUFile *fb;
+    bool old_vm_running;
+    int ret;
+
+    qemu_savevm_state_begin(s->file, &s->params);
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret >= 0 && !qemu_file_get_error(s->file)) {
+        fb = qemu_bufopen("wb", devices);
+        qemu_savevm_state_postcopy_devices(fb);
+        qemu_fclose(fb);
+        qemu_savevm_publish_section_stats(false);
+        ret = ram_write_tracking_start();
+    }
+
+    /* A stopped guest stays stopped, so that its block devices can be
+     * snapshotted at the same point before it is resumed.
+     */
+    if (old_vm_running) {
+        vm_start();
+    } else {
+        runstate_set(RUN_STATE_PAUSED);
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+    qemu_mutex_unlock_iothread();
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    if (ret < 0 || qemu_file_get_error(s->file)) {
+        migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+    } else {
+        migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
+    }
+
+    while (s->state == MIG_STATE_ACTIVE) {
+        int64_t current_time;
+
+        if (!qemu_file_rate_limit(s->file)) {
+            if (qemu_savevm_state_pending(s->file, 0)) {
+                qemu_savevm_state_iterate(s->file);
+            } else {
+                qemu_savevm_state_background_complete(s->file, devices);
+                if (!qemu_file_get_error(s->file)) {
+                    migrate_set_state(s, MIG_STATE_ACTIVE,
+                                      MIG_STATE_COMPLETED);
+                    break;
+                }
+            }
+        }
+
+        if (qemu_file_get_error(s->file)) {
+            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+            break;
+        }
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
+            uint64_t time_spent = current_time - initial_time;
+
+            s->mbps = time_spent ? (((double) transferred_bytes * 8.0) /
+                    ((double) time_spent / 1000.0)) / 1000.0 / 1000.0 : -1;
+
+            qemu_file_reset_rate_limit(s->file);
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(s->file);
+        }
+        if (qemu_file_rate_limit(s->file)) {
+            /* usleep expects microseconds */
+            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+        }
+    }
+
+    /* Writers that wait for their page may hold the iothread lock */
+    ram_write_tracking_stop();
+
+    qemu_mutex_lock_iothread();
+    if (s->state == MIG_STATE_COMPLETED) {
+        int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        uint64_t transferred_bytes = qemu_ftell(s->file);
+        s->total_time = end_time - s->total_time;
+        if (s->total_time) {
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                       ((double) s->total_time)) / 1000;
+        }
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    g_byte_array_free(devices, TRUE);
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     s->state = MIG_STATE_SETUP;
@@ -696,6 +1518,8 @@ void migrate_fd_connect(MigrationState *s)
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
-    qemu_thread_create(&s->thread, "migration", migration_thread, s,
+    qemu_thread_create(&s->thread, "migration",
+                       migrate_use_background_snapshot() ?
+                       background_snapshot_thread : migration_thread, s,
                        QEMU_THREAD_JOINABLE);
 }
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,17 +33,33 @@
     do { } while (0)
 #endif
 
+/* Saturation value of the per-page reference counter */
+#define CACHE_MAX_HITS 3
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    unsigned int it_hits;
 };
 
+/*
+ * The items are grouped in num_sets sets of num_ways items each, and a
+ * page can only live in the set selected by its address.  Replacement
+ * within a set uses a CLOCK with reference counters: every hit bumps the
+ * counter of the item, and the hand of the set decrements the counters
+ * until it finds one at zero.  Pages that keep being dirtied therefore
+ * survive several sweeps, while pages that were only sent once are the
+ * first ones to go.
+ */
 struct PageCache {
     CacheItem *page_cache;
+    unsigned int *clock_hand;
     unsigned int page_size;
+    unsigned int num_ways;
+    int64_t num_sets;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
@@ -75,8 +91,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u pages\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -86,11 +105,20 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         g_free(cache);
         return NULL;
     }
+    cache->clock_hand = g_try_malloc0(cache->num_sets *
+                                      sizeof(*cache->clock_hand));
+    if (!cache->clock_hand) {
+        DPRINTF("Failed to allocate cache->clock_hand\n");
+        g_free(cache->page_cache);
+        g_free(cache);
+        return NULL;
+    }
 
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_hits = 0;
     }
 
     return cache;
@@ -109,45 +137,82 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->clock_hand);
+    cache->clock_hand = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
 
-    return (cache->page_cache[pos].it_addr == addr);
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+uint8_t *cache_peek_data(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return it ? it->it_data : NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return NULL;
+    }
+    if (it->it_hits < CACHE_MAX_HITS) {
+        it->it_hits++;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/* Pick the item of set @idx that makes room for a new page */
+static CacheItem *cache_get_victim(PageCache *cache, size_t idx)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *set = &cache->page_cache[idx * cache->num_ways];
+    unsigned int *hand = &cache->clock_hand[idx];
+    unsigned int way;
+    CacheItem *it;
+
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_addr == -1) {
+            return &set[way];
+        }
+    }
+
+    /* Terminates after at most CACHE_MAX_HITS + 1 turns of the clock */
+    for (;;) {
+        it = &set[*hand];
+        *hand = (*hand + 1) % cache->num_ways;
+        if (!it->it_hits) {
+            return it;
+        }
+        it->it_hits--;
+    }
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
@@ -160,6 +225,15 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (it) {
+        /* the page was dirtied again since it was cached */
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
+    } else {
+        it = cache_get_victim(cache, cache_get_set(cache, addr));
+        it->it_hits = 0;
+    }
 
     /* allocate page */
     if (!it->it_data) {
@@ -179,12 +253,22 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     return 0;
 }
 
+/* Is @a worth more than @b?  Referenced pages first, then recent ones */
+static bool cache_item_better(const CacheItem *a, const CacheItem *b)
+{
+    if (a->it_hits != b->it_hits) {
+        return a->it_hits > b->it_hits;
+    }
+    return a->it_age > b->it_age;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
+    unsigned int way;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *new_it, *set;
 
     g_assert(cache);
 
@@ -204,30 +288,46 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /*
+     * Move all data from the old cache.  When a set of the new cache
+     * overflows, keep its most valuable pages, regardless of the order
+     * in which they are moved.
+     */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+        if (old_it->it_addr == -1) {
+            continue;
+        }
+        set = &new_cache->page_cache[cache_get_set(new_cache, old_it->it_addr) *
+                                     new_cache->num_ways];
+        new_it = &set[0];
+        for (way = 0; way < new_cache->num_ways; way++) {
+            if (set[way].it_addr == -1) {
+                new_it = &set[way];
+                break;
+            }
+            if (cache_item_better(new_it, &set[way])) {
+                new_it = &set[way];
             }
         }
+        if (new_it->it_addr != -1 && !cache_item_better(old_it, new_it)) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        if (new_it->it_addr == -1) {
+            new_cache->num_items++;
+        }
+        g_free(new_it->it_data);
+        *new_it = *old_it;
     }
 
     g_free(cache->page_cache);
+    g_free(cache->clock_hand);
     cache->page_cache = new_cache->page_cache;
+    cache->clock_hand = new_cache->clock_hand;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
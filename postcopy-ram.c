@@ -0,0 +1,493 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * After the switch to postcopy the guest runs on the destination before
+ * all of its memory has arrived.  Guest RAM is registered with
+ * userfaultfd, so that accesses to missing pages block the faulting
+ * thread; a fault thread asks the source for these pages over the
+ * return path, and the incoming pages are placed atomically with
+ * UFFDIO_COPY, which wakes up the waiting threads.
+ *
+ * Background snapshots use userfaultfd on the source as well, to
+ * write-protect guest RAM until it has been saved.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/cpu-all.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "hw/xen/xen.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+static PostcopyState incoming_postcopy_state;
+
+PostcopyState postcopy_state_get(void)
+{
+    return atomic_mb_read(&incoming_postcopy_state);
+}
+
+void postcopy_state_set(PostcopyState state)
+{
+    atomic_mb_set(&incoming_postcopy_state, state);
+}
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/userfaultfd.h>
+
+static int userfault_fd = -1;
+static EventNotifier userfault_quit;
+static QemuThread fault_thread;
+static void *postcopy_tmp_page;
+
+static int postcopy_open_userfaultfd(uint64_t features)
+{
+    struct uffdio_api api = { .api = UFFD_API, .features = features };
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        error_report("userfaultfd not available: %s", strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, UFFDIO_API, &api)) {
+        error_report("UFFDIO_API failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool postcopy_ram_supported(void)
+{
+    int fd;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("Postcopy requires the host and target page sizes "
+                     "to match");
+        return false;
+    }
+
+    fd = postcopy_open_userfaultfd(0);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static RAMBlock *postcopy_find_block_by_host(uint64_t addr)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (addr >= (uintptr_t)block->host &&
+            addr - (uintptr_t)block->host < block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* Wait for the next page fault on @fd.  Returns false once @quit is set,
+ * or on error.
+ */
+static bool userfault_wait(int fd, EventNotifier *quit, struct uffd_msg *msg)
+{
+    struct pollfd pfd[2];
+    ssize_t ret;
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(quit);
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("userfaultfd poll failed: %s", strerror(errno));
+            return false;
+        }
+        if (pfd[1].revents) {
+            return false;
+        }
+
+        ret = read(fd, msg, sizeof(*msg));
+        if (ret != sizeof(*msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("userfaultfd read failed: %s", strerror(errno));
+            return false;
+        }
+        if (msg->event == UFFD_EVENT_PAGEFAULT) {
+            return true;
+        }
+    }
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    RAMBlock *block;
+    uint64_t addr, offset;
+
+    while (userfault_wait(userfault_fd, &userfault_quit, &msg)) {
+        addr = msg.arg.pagefault.address;
+        block = postcopy_find_block_by_host(addr);
+        if (!block) {
+            error_report("Page fault on unknown address 0x%" PRIx64, addr);
+            break;
+        }
+        offset = (addr - (uintptr_t)block->host) & TARGET_PAGE_MASK;
+        trace_postcopy_ram_fault_thread_request(addr, block->idstr, offset);
+        migrate_send_rp_req_pages(block->idstr, offset, TARGET_PAGE_SIZE);
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_init(void)
+{
+    struct uffdio_register reg;
+    uint64_t needed = ((uint64_t)1 << _UFFDIO_COPY) |
+                      ((uint64_t)1 << _UFFDIO_ZEROPAGE);
+    RAMBlock *block;
+
+    userfault_fd = postcopy_open_userfaultfd(0);
+    if (userfault_fd < 0) {
+        return -1;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("Postcopy does not support file-backed RAM (%s)",
+                         block->idstr);
+            goto fail;
+        }
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(userfault_fd, UFFDIO_REGISTER, &reg)) {
+            error_report("Failed to register %s with userfaultfd: %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+        if ((reg.ioctls & needed) != needed) {
+            error_report("Missing userfaultfd features for %s",
+                         block->idstr);
+            goto fail;
+        }
+    }
+
+    postcopy_tmp_page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    event_notifier_init(&userfault_quit, false);
+    qemu_thread_create(&fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    /* Closing the file descriptor unregisters all ranges.  */
+    close(userfault_fd);
+    userfault_fd = -1;
+    return -1;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+    if (userfault_fd < 0) {
+        return;
+    }
+
+    event_notifier_set(&userfault_quit);
+    qemu_thread_join(&fault_thread);
+    event_notifier_cleanup(&userfault_quit);
+
+    close(userfault_fd);
+    userfault_fd = -1;
+    qemu_vfree(postcopy_tmp_page);
+    postcopy_tmp_page = NULL;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(idstr, block->idstr, sizeof(block->idstr))) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("Can't find block %s!", idstr);
+        return -1;
+    }
+    if (((start | length) & ~TARGET_PAGE_MASK) || start > block->length ||
+        length > block->length - start) {
+        error_report("Invalid discard range in %s", idstr);
+        return -1;
+    }
+
+    trace_postcopy_ram_discard_range(idstr, start, length);
+    if (madvise(block->host + start, length, MADV_DONTNEED)) {
+        error_report("Failed to discard RAM in %s: %s", idstr,
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    struct uffdio_copy copy;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)from;
+    copy.len = TARGET_PAGE_SIZE;
+    copy.mode = 0;
+    if (ioctl(userfault_fd, UFFDIO_COPY, &copy) && errno != EEXIST) {
+        error_report("UFFDIO_COPY failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero;
+
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = TARGET_PAGE_SIZE;
+    zero.mode = 0;
+    if (ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero) && errno != EEXIST) {
+        error_report("UFFDIO_ZEROPAGE failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void *postcopy_get_tmp_page(void)
+{
+    return postcopy_tmp_page;
+}
+
+/* Write tracking for background snapshots.  Writes to a protected page
+ * block the writing thread, and the write fault thread queues the page
+ * with ram_save_queue_pages.  The migration thread lifts the protection
+ * once it has saved the page, which lets the writer go on.
+ */
+static int wp_fd = -1;
+static EventNotifier wp_quit;
+static QemuThread wp_thread;
+
+bool ram_write_tracking_supported(void)
+{
+    int fd;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("Background snapshots require the host and target "
+                     "page sizes to match");
+        return false;
+    }
+    if (xen_enabled()) {
+        error_report("Background snapshots are not supported with Xen");
+        return false;
+    }
+
+    fd = postcopy_open_userfaultfd(UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static void *ram_write_tracking_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    RAMBlock *block;
+    uint64_t addr, offset;
+
+    while (userfault_wait(wp_fd, &wp_quit, &msg)) {
+        if (!(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+        addr = msg.arg.pagefault.address;
+        block = postcopy_find_block_by_host(addr);
+        if (!block) {
+            error_report("Write fault on unknown address 0x%" PRIx64, addr);
+            break;
+        }
+        offset = (addr - (uintptr_t)block->host) & TARGET_PAGE_MASK;
+        trace_ram_write_tracking_fault(addr, block->idstr, offset);
+        ram_save_queue_pages(block->idstr, offset, TARGET_PAGE_SIZE);
+    }
+
+    return NULL;
+}
+
+int ram_write_tracking_start(void)
+{
+    struct uffdio_register reg;
+    struct uffdio_writeprotect wp;
+    RAMBlock *block;
+
+    wp_fd = postcopy_open_userfaultfd(UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+    if (wp_fd < 0) {
+        return -1;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("Background snapshots do not support file-backed "
+                         "RAM (%s)", block->idstr);
+            goto fail;
+        }
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_WP;
+        if (ioctl(wp_fd, UFFDIO_REGISTER, &reg)) {
+            error_report("Failed to register %s with userfaultfd: %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+        if (!(reg.ioctls & ((uint64_t)1 << _UFFDIO_WRITEPROTECT))) {
+            error_report("Missing userfaultfd features for %s",
+                         block->idstr);
+            goto fail;
+        }
+        wp.range = reg.range;
+        wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+        if (ioctl(wp_fd, UFFDIO_WRITEPROTECT, &wp)) {
+            error_report("Failed to write-protect %s: %s", block->idstr,
+                         strerror(errno));
+            goto fail;
+        }
+    }
+
+    event_notifier_init(&wp_quit, false);
+    qemu_thread_create(&wp_thread, "snapshot/wp", ram_write_tracking_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    /* Closing the file descriptor drops the protection.  */
+    close(wp_fd);
+    wp_fd = -1;
+    return -1;
+}
+
+int ram_write_tracking_unprotect(void *host, size_t len)
+{
+    struct uffdio_writeprotect wp;
+
+    wp.range.start = (uintptr_t)host;
+    wp.range.len = len;
+    wp.mode = 0;
+    if (ioctl(wp_fd, UFFDIO_WRITEPROTECT, &wp)) {
+        error_report("Failed to unprotect RAM: %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+void ram_write_tracking_stop(void)
+{
+    if (wp_fd < 0) {
+        return;
+    }
+
+    event_notifier_set(&wp_quit);
+    qemu_thread_join(&wp_thread);
+    event_notifier_cleanup(&wp_quit);
+
+    close(wp_fd);
+    wp_fd = -1;
+}
+
+#else
+
+bool postcopy_ram_supported(void)
+{
+    error_report("Postcopy is not supported on this host");
+    return false;
+}
+
+int postcopy_ram_incoming_init(void)
+{
+    error_report("Postcopy is not supported on this host");
+    return -1;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    abort();
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    abort();
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    abort();
+}
+
+void *postcopy_get_tmp_page(void)
+{
+    abort();
+}
+
+bool ram_write_tracking_supported(void)
+{
+    error_report("Background snapshots are not supported on this host");
+    return false;
+}
+
+int ram_write_tracking_start(void)
+{
+    error_report("Background snapshots are not supported on this host");
+    return -1;
+}
+
+int ram_write_tracking_unprotect(void *host, size_t len)
+{
+    abort();
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+#endif
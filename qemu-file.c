@@ -377,6 +377,69 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
     return s->file;
 }
 
+typedef struct QEMUFileBuffer {
+    GByteArray *buf;
+    QEMUFile *file;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
+                          int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    g_byte_array_append(s->buf, buf, size);
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->buf->len) {
+        return 0;
+    }
+    size = MIN(size, s->buf->len - pos);
+    memcpy(buf, s->buf->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+    .close =      buf_close
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+    .close =      buf_close
+};
+
+/* Open a file in memory; writes append to @buf, reads start at its
+ * beginning.  @buf is not freed when the file is closed.
+ */
+QEMUFile *qemu_bufopen(const char *mode, GByteArray *buf)
+{
+    QEMUFileBuffer *s;
+
+    if (qemu_file_mode_is_not_valid(mode)) {
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileBuffer));
+    s->buf = buf;
+    if (mode[0] == 'w') {
+        s->file = qemu_fopen_ops(s, &buf_write_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &buf_read_ops);
+    }
+    return s->file;
+}
+
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
 {
     QEMUFileStdio *s;
@@ -807,6 +870,83 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Like qemu_ftell, but does not flush the buffer: the data still in it
+ * is counted as written, or as not yet read.  Cheap enough to call
+ * around every section of the stream.
+ */
+int64_t qemu_ftell_fast(QEMUFile *f)
+{
+    int64_t ret = f->pos;
+    int i;
+
+    if (!qemu_file_is_writable(f)) {
+        return ret - f->buf_size + f->buf_index;
+    }
+    if (f->ops->writev_buffer) {
+        for (i = 0; i < f->iovcnt; i++) {
+            ret += f->iov[i].iov_len;
+        }
+    } else {
+        ret += f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Offset of the next byte of the stream in the underlying file, or a
+ * negative errno value if the file is not seekable.  Unlike qemu_ftell,
+ * this does not count the data written or read behind the back of the
+ * stream with qemu_update_position.
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int fd = qemu_get_fd(f);
+    off_t offset;
+
+    if (fd < 0) {
+        return -EINVAL;
+    }
+    qemu_fflush(f);
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == (off_t)-1) {
+        return -errno;
+    }
+    if (!qemu_file_is_writable(f)) {
+        /* Data that was read ahead has not been consumed yet */
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+/*
+ * Continue the stream at @offset in the underlying file, leaving a hole
+ * that the caller fills or reads with pwrite/pread.  The stream position
+ * is not changed, so that rate limiting and the bandwidth estimate are
+ * not affected.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int fd = qemu_get_fd(f);
+
+    if (fd < 0) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+    qemu_fflush(f);
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        int ret = -errno;
+
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    return 0;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
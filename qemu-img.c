@@ -800,22 +800,26 @@ static int img_commit(int argc, char **argv)
  */
 static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 {
-    bool is_zero;
     int i;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, 512);
+    /* A run of zero sectors is found with a single scan */
+    i = buffer_find_nonzero_offset(buf, (size_t)n * 512) / 512;
+    if (i) {
+        *pnum = i;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
-        if (is_zero != buffer_is_zero(buf, 512)) {
+        if (buffer_is_zero(buf, 512)) {
             break;
         }
     }
     *pnum = i;
-    return !is_zero;
+    return 1;
 }
 
 /*
@@ -35,7 +35,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                bounce-buffer-size=size of the DMA bounce buffers of an address space\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +59,11 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item bounce-buffer-size=@var{size}
+Limits the total size of the buffers that each address space uses to copy
+DMA to and from memory that cannot be mapped directly, such as MMIO or ROM
+devices.  DMA that does not fit waits until a buffer is freed.  The default
+is 64K.
 @end table
 ETEXI
 
@@ -95,12 +101,17 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa @var{opts}
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
-are split equally.
+are split equally.  @option{memdev} assigns the memory of a
+@code{memory-backend-ram} or @code{memory-backend-file} object created with
+@option{-object} to the node; either all nodes or none must use it, and the
+sizes of the backends must add up to the RAM size.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -240,6 +251,18 @@ STEXI
 Preallocate memory when using -mem-path.
 ETEXI
 
+DEF("mem-prealloc-threads", HAS_ARG, QEMU_OPTION_mem_prealloc_threads,
+    "-mem-prealloc-threads n\n"
+    "                use n threads to preallocate guest memory\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -mem-prealloc-threads @var{n}
+@findex -mem-prealloc-threads
+Use @var{n} threads to preallocate memory with -mem-prealloc, each of
+them touching a separate part of guest RAM.  The default is one thread
+per host CPU, up to 16.
+ETEXI
+
 DEF("k", HAS_ARG, QEMU_OPTION_k,
     "-k language     use keyboard layout (for example 'fr' for French)\n",
     QEMU_ARCH_ALL)
@@ -3163,6 +3186,23 @@ the @var{simple} tracing backend.
 @end table
 ETEXI
 
+DEF("plugin", HAS_ARG, QEMU_OPTION_plugin,
+    "-plugin [file=]<file>[,<argname>=<argvalue>...]\n"
+    "                load a TCG instrumentation plugin\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -plugin [file=]@var{file}[,@var{argname}=@var{argvalue}...]
+@findex -plugin
+
+Load the TCG instrumentation plugin @var{file}, a shared object built
+against @file{include/qemu/qemu-plugin.h}.  Any other option is passed to
+the plugin as a @var{argname}=@var{argvalue} string.  The option may be
+repeated to load several plugins.
+
+This option is only available if QEMU has been configured with
+@option{--enable-tcg-plugin}.
+ETEXI
+
 HXCOMM Internal use
 DEF("qtest", HAS_ARG, QEMU_OPTION_qtest, "", QEMU_ARCH_ALL)
 DEF("qtest-log", HAS_ARG, QEMU_OPTION_qtest_log, "", QEMU_ARCH_ALL)
@@ -3208,6 +3248,22 @@ Create an new object of type @var{typename} setting properties
 in the order they are specified.  Note that the 'id'
 property must be set.  These objects are placed in the
 '/objects' path.
+
+@table @option
+@item -object memory-backend-ram,id=@var{id},size=@var{size}[,host-nodes=@var{nodes},policy=@var{policy},merge=on|off,dump=on|off,prealloc=on|off]
+Create anonymous memory that can be assigned to a guest NUMA node with
+@option{-numa node,memdev=@var{id}}.  @option{host-nodes} (for example
+@code{0-1,3}) and @option{policy} (@code{default}, @code{preferred},
+@code{bind} or @code{interleave}) restrict the memory to host NUMA nodes.
+@option{merge}, @option{dump} and @option{prealloc} default to the values
+of @option{-machine mem-merge}, @option{-machine dump-guest-core} and
+@option{-mem-prealloc}.
+
+@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir}[,share=on|off,...]
+Like @code{memory-backend-ram}, but the memory is a file created in
+@var{dir}, typically a hugetlbfs mount.  With @option{share=on} the file is
+mapped shared, so that other processes can access guest memory.
+@end table
 ETEXI
 
 DEF("msg", HAS_ARG, QEMU_OPTION_msg,
@@ -661,6 +661,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to postcopy.  The postcopy-ram capability
+must be enabled on both sides.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -705,6 +727,73 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its memory.  Dirty
+logging is enabled for the given number of seconds, then turned off again.
+Not available while a migration is in progress.
+
+Arguments:
+
+- "calc-time": duration of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last guest dirty rate measurement.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": realtime clock in milliseconds at which the measurement
+  started (json-int, optional)
+- "calc-time": duration of the measurement in milliseconds
+  (json-int, optional)
+- "dirty-pages-rate": pages dirtied per second (json-int, optional)
+- "blocks": json-array with the dirty rate of each RAM block, each one a
+  json-object with the following information:
+         - "id": name of the RAM block (json-string)
+         - "dirty-pages": pages dirtied during the measurement (json-int)
+         - "dirty-pages-rate": pages dirtied per second (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "start-time": 5227403,
+        "calc-time": 1000,
+        "dirty-pages-rate": 2372,
+        "blocks": [ { "id": "pc.ram", "dirty-pages": 2364,
+                      "dirty-pages-rate": 2364 },
+                    { "id": "vga.vram", "dirty-pages": 8,
+                      "dirty-pages-rate": 8 } ]
+     }
+   }
+
 EQMP
 
     {
@@ -2987,6 +3076,18 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "cpu-throttle-percentage": percentage of time guest cpus are being
+  throttled by auto-converge, only present while it is throttling
+  (json-int)
+- "device-save-stats": only present if "status" is "completed", a json-array
+  with the cost of each section of the stream in the completion phase,
+  while the guest was stopped.  Each element is a json-object with:
+         - "idstr": name of the section (json-string)
+         - "instance-id": instance number of the section (json-int)
+         - "time": time spent saving the section in microseconds (json-int)
+         - "bytes": size of the section in bytes (json-int)
+- "device-load-stats": only present after an incoming migration, the same
+  for each section loaded, with "time" spent loading it (json-array)
 
 Examples:
 
@@ -3152,6 +3253,73 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": compression level, 0-9 (json-int, optional)
+- "compress-threads": number of compression threads (json-int, optional)
+- "decompress-threads": number of decompression threads (json-int, optional)
+- "multifd-channels": number of multifd channels (json-int, optional)
+- "xbzrle-threads": number of xbzrle encoding threads (json-int, optional)
+- "load-threads": number of RAM loading threads (json-int, optional)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "multifd-channels:i?,xbzrle-threads:i?,load-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "multifd-channels" : multifd channel count value (json-int)
+         - "xbzrle-threads" : xbzrle encoding thread count value (json-int)
+         - "load-threads" : RAM loading thread count value (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "load-threads": 0,
+         "xbzrle-threads": 0,
+         "multifd-channels": 2,
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -41,6 +41,8 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "qemu/error-report.h"
+#include "migration/postcopy-ram.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -115,26 +117,134 @@ void qemu_announce_self(void)
 /***********************************************************/
 /* savevm/loadvm support */
 
-static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
-                                   int64_t pos)
+/* The VM state goes to the block device in chunks of VMSTATE_CHUNK_SIZE
+ * bytes, and up to VMSTATE_WRITES_IN_FLIGHT chunks are written at the
+ * same time by coroutines while the next one fills up.  Only the last
+ * chunk is not full; it is padded to whole sectors.
+ */
+#define VMSTATE_CHUNK_SIZE          (1024 * 1024)
+#define VMSTATE_WRITES_IN_FLIGHT    4
+
+typedef struct BdrvVMStateWriter {
+    BlockDriverState *bs;
+    uint8_t *buf;       /* Chunk being filled */
+    size_t len;         /* Bytes in buf */
+    int64_t pos;        /* Position of buf in the VM state */
+    int in_flight;
+    int ret;            /* First error of a write */
+} BdrvVMStateWriter;
+
+typedef struct BdrvVMStateWrite {
+    BdrvVMStateWriter *w;
+    uint8_t *buf;
+    size_t len;
+    int64_t pos;
+} BdrvVMStateWrite;
+
+static void coroutine_fn block_vmstate_write_co(void *opaque)
 {
-    int ret;
+    BdrvVMStateWrite *req = opaque;
+    BdrvVMStateWriter *w = req->w;
+    struct iovec iov = {
+        .iov_base   = req->buf,
+        .iov_len    = req->len,
+    };
     QEMUIOVector qiov;
+    int ret;
 
-    qemu_iovec_init_external(&qiov, iov, iovcnt);
-    ret = bdrv_writev_vmstate(opaque, &qiov, pos);
-    if (ret < 0) {
-        return ret;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_writev_vmstate(w->bs, &qiov, req->pos);
+    if (ret < 0 && !w->ret) {
+        w->ret = ret;
+    }
+    qemu_vfree(req->buf);
+    g_free(req);
+    w->in_flight--;
+}
+
+static void block_vmstate_submit(BdrvVMStateWriter *w)
+{
+    BdrvVMStateWrite *req;
+    Coroutine *co;
+
+    if (!w->len) {
+        return;
+    }
+    while (w->in_flight >= VMSTATE_WRITES_IN_FLIGHT) {
+        qemu_aio_wait();
     }
 
-    return qiov.size;
+    req = g_new(BdrvVMStateWrite, 1);
+    req->w = w;
+    req->buf = w->buf;
+    req->len = ROUND_UP(w->len, BDRV_SECTOR_SIZE);
+    req->pos = w->pos;
+    memset(req->buf + w->len, 0, req->len - w->len);
+
+    w->buf = qemu_blockalign(w->bs, VMSTATE_CHUNK_SIZE);
+    w->pos += w->len;
+    w->len = 0;
+
+    w->in_flight++;
+    co = qemu_coroutine_create(block_vmstate_write_co);
+    qemu_coroutine_enter(co, req);
+}
+
+static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                   int64_t pos)
+{
+    BdrvVMStateWriter *w = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+
+    assert(pos == w->pos + w->len);
+    while (done < size) {
+        size_t len = MIN(size - done, VMSTATE_CHUNK_SIZE - w->len);
+
+        iov_to_buf(iov, iovcnt, done, w->buf + w->len, len);
+        w->len += len;
+        done += len;
+        if (w->len == VMSTATE_CHUNK_SIZE) {
+            block_vmstate_submit(w);
+        }
+    }
+
+    /* Let the writes in flight complete without waiting for them */
+    aio_poll(qemu_get_aio_context(), false);
+    if (w->ret < 0) {
+        return w->ret;
+    }
+    return size;
 }
 
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
+    struct iovec iov = {
+        .iov_base   = (void *)buf,
+        .iov_len    = size,
+    };
+
+    return block_writev_buffer(opaque, &iov, 1, pos);
+}
+
+static int block_vmstate_close(void *opaque)
+{
+    BdrvVMStateWriter *w = opaque;
+    int ret;
+
+    block_vmstate_submit(w);
+    while (w->in_flight) {
+        qemu_aio_wait();
+    }
+
+    ret = w->ret;
+    if (ret >= 0) {
+        ret = bdrv_flush(w->bs);
+    }
+    qemu_vfree(w->buf);
+    g_free(w);
+    return ret;
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
@@ -155,13 +265,17 @@ static const QEMUFileOps bdrv_read_ops = {
 static const QEMUFileOps bdrv_write_ops = {
     .put_buffer     = block_put_buffer,
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = block_vmstate_close
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
     if (is_writable) {
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
+        BdrvVMStateWriter *w = g_new0(BdrvVMStateWriter, 1);
+
+        w->bs = bs;
+        w->buf = qemu_blockalign(bs, VMSTATE_CHUNK_SIZE);
+        return qemu_fopen_ops(w, &bdrv_write_ops);
     }
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
@@ -234,6 +348,21 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* Cost of the section in the last completion phase and load,
+     * updated by the thread that saves or loads the state.
+     */
+    int64_t save_time_ns;
+    uint64_t save_bytes;
+    int64_t load_time_ns;
+    uint64_t load_bytes;
+    /* The same for the last migration, as reported by query-migrate.
+     * Protected by the iothread lock, see
+     * qemu_savevm_publish_section_stats.
+     */
+    int64_t mig_save_time_ns;
+    uint64_t mig_save_bytes;
+    int64_t mig_load_time_ns;
+    uint64_t mig_load_bytes;
 } SaveStateEntry;
 
 
@@ -555,16 +684,126 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/* Commands embedded in the migration stream, see QEMU_VM_COMMAND.  Each
+ * is a be16 command and a be16 length, followed by that many bytes.
+ */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,
+    MIG_CMD_OPEN_RETURN_PATH,     /* Open the return path to the source */
+    MIG_CMD_POSTCOPY_ADVISE,      /* The source may switch to postcopy */
+    MIG_CMD_POSTCOPY_RAM_DISCARD, /* Drop pages dirtied since they were sent */
+    MIG_CMD_POSTCOPY_LISTEN,      /* Start handling page faults */
+    MIG_CMD_POSTCOPY_RUN,         /* Start the guest */
+    MIG_CMD_PACKAGED,             /* be32 length, and a stream that long */
+};
+
+/* Upper bound for the device state sent with MIG_CMD_PACKAGED */
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 24)
+
+static void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                                     uint16_t len, uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+void qemu_savevm_send_open_return_path(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
+}
+
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 0, NULL);
+}
+
+/* Ask the destination to drop @len ranges of pages in block @idstr.  */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *idstr,
+                                           uint16_t len, uint64_t *start,
+                                           uint64_t *length)
+{
+    size_t idlen = strlen(idstr);
+    size_t size = 1 + idlen + len * 16;
+    uint8_t *buf, *p;
+    int i;
+
+    assert(size <= UINT16_MAX);
+    buf = p = g_malloc(size);
+    *p++ = idlen;
+    memcpy(p, idstr, idlen);
+    p += idlen;
+    for (i = 0; i < len; i++) {
+        stq_be_p(p, start[i]);
+        stq_be_p(p + 8, length[i]);
+        p += 16;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, size, buf);
+    g_free(buf);
+}
+
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
+/* Send @buf, which the destination loads as a stream of its own while
+ * the rest of @f is read by the postcopy listen thread.
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, GByteArray *buf)
+{
+    uint32_t len;
+
+    if (buf->len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Device state too large for postcopy: %u bytes",
+                     buf->len);
+        return -E2BIG;
+    }
+
+    len = cpu_to_be32(buf->len);
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&len);
+    qemu_put_buffer(f, buf->data, buf->len);
+    qemu_fflush(f);
+    return qemu_file_get_error(f);
+}
+
+static void savevm_reset_stats(void)
 {
     SaveStateEntry *se;
-    int ret;
 
-    trace_savevm_state_complete();
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->save_time_ns = 0;
+        se->save_bytes = 0;
+    }
+}
 
-    cpu_synchronize_all_states();
+static void savevm_account_section(QEMUFile *f, SaveStateEntry *se,
+                                   int64_t start_time, int64_t start_pos)
+{
+    int64_t time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    uint64_t bytes = qemu_ftell_fast(f) - start_pos;
+
+    se->save_time_ns += time_ns;
+    se->save_bytes += bytes;
+    trace_savevm_section_stats(se->idstr, se->section_id, time_ns, bytes);
+}
+
+static int qemu_savevm_state_complete_live(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int ret;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_time, start_pos;
+
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
@@ -578,15 +817,25 @@ void qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
         ret = se->ops->save_live_complete(f, se->opaque);
+        savevm_account_section(f, se, start_time, start_pos);
         trace_savevm_section_end(se->idstr, se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_time, start_pos;
         int len;
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -605,14 +854,141 @@ void qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->instance_id);
         qemu_put_be32(f, se->version_id);
 
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
         vmstate_save(f, se);
+        savevm_account_section(f, se, start_time, start_pos);
         trace_savevm_section_end(se->idstr, se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+    savevm_reset_stats();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+    qemu_savevm_state_complete_devices(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
 }
 
+/* Device state for the switch to postcopy, and for the start of a
+ * background snapshot; live sections go on until
+ * qemu_savevm_state_postcopy_complete or
+ * qemu_savevm_state_background_complete.
+ */
+void qemu_savevm_state_postcopy_devices(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+    savevm_reset_stats();
+    qemu_savevm_state_complete_devices(f);
+}
+
+void qemu_savevm_state_postcopy_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/* End of a background snapshot.  The device state in @devices was saved
+ * when the snapshot started, and goes after the RAM, so that devices
+ * that look at guest memory when they are loaded find it in place.
+ */
+void qemu_savevm_state_background_complete(QEMUFile *f, GByteArray *devices)
+{
+    trace_savevm_state_complete();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    qemu_put_buffer(f, devices->data, devices->len);
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/* Time and size of the device state, that is of everything but the
+ * live sections, in the completion phase of the last migration.  This
+ * part of the downtime does not show up in qemu_savevm_state_pending.
+ *
+ * Only the migration thread publishes the save side, so it can call
+ * this without the iothread lock.
+ */
+void qemu_savevm_device_cost(int64_t *time_ns, uint64_t *bytes)
+{
+    SaveStateEntry *se;
+
+    *time_ns = 0;
+    *bytes = 0;
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->is_ram) {
+            *time_ns += se->mig_save_time_ns;
+            *bytes += se->mig_save_bytes;
+        }
+    }
+}
+
+/* Make the cost of the completion phase (@load false) or of the load
+ * (@load true) that just finished visible to query-migrate.  Called
+ * with the iothread lock held, and only for migrations, so that the
+ * savevm and loadvm commands do not show up in the statistics.
+ */
+void qemu_savevm_publish_section_stats(bool load)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (load) {
+            se->mig_load_time_ns = se->load_time_ns;
+            se->mig_load_bytes = se->load_bytes;
+        } else {
+            se->mig_save_time_ns = se->save_time_ns;
+            se->mig_save_bytes = se->save_bytes;
+        }
+    }
+}
+
+/* Per-section cost of the completion phase of the last migration
+ * (@load false) or of the last incoming migration (@load true), or NULL
+ * if there was none.  Called with the iothread lock held.
+ */
+MigrationSectionStatsList *qemu_savevm_section_stats(bool load)
+{
+    MigrationSectionStatsList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t time_ns = load ? se->mig_load_time_ns : se->mig_save_time_ns;
+        uint64_t bytes = load ? se->mig_load_bytes : se->mig_save_bytes;
+        MigrationSectionStatsList *entry;
+
+        if (!time_ns && !bytes) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->idstr = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->time = time_ns / 1000;
+        entry->value->bytes = bytes;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -743,33 +1119,280 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+/* Sections of the incoming migration stream.  In postcopy, the stream
+ * and this list are handed over to the listen thread.
+ */
+static LoadStateList loadvm_handlers = QLIST_HEAD_INITIALIZER(loadvm_handlers);
+static QEMUFile *loadvm_file;
+
+/* Set in the threads that load an incoming migration.  They do not hold
+ * the iothread lock, so that the monitor keeps running, and take it for
+ * the sections and commands that need it.
+ */
+static __thread bool loadvm_unlocked;
+
+static void loadvm_lock_iothread(void)
+{
+    if (loadvm_unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static void loadvm_unlock_iothread(void)
+{
+    if (loadvm_unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Returned by qemu_loadvm_state_main when the rest of the stream is read
+ * by the postcopy listen thread.
+ */
+#define LOADVM_QUIT 1
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers);
+
+static void loadvm_free_handlers(LoadStateList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/* Reads the rest of the stream, while the guest runs on the destination
+ * and the page faults it takes are served from the source.
+ */
+static void *postcopy_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    loadvm_unlocked = true;
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    loadvm_free_handlers(&loadvm_handlers);
+    migrate_load_threads_join();
+
+    postcopy_ram_incoming_cleanup();
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+    migrate_incoming_close_return_path(ret);
+    qemu_fclose(f);
+
+    if (ret < 0) {
+        /* The guest runs here already, and part of its memory is lost.  */
+        error_report("Error %d while loading postcopy state", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_savevm_publish_section_stats(true);
+    qemu_mutex_unlock_iothread();
+    return NULL;
+}
+
+static int loadvm_postcopy_handle_advise(void)
+{
+    if (postcopy_state_get() != POSTCOPY_INCOMING_NONE) {
+        error_report("Unexpected postcopy advise");
+        return -EINVAL;
+    }
+    if (!migrate_postcopy_ram()) {
+        error_report("Postcopy requested, but the postcopy-ram capability "
+                     "is disabled");
+        return -EINVAL;
+    }
+    if (!postcopy_ram_supported()) {
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
+    postcopy_state_set(POSTCOPY_INCOMING_ADVISE);
+    return 0;
+}
+
+static int loadvm_postcopy_ram_handle_discard(QEMUFile *f, uint16_t len)
+{
+    uint64_t start, length;
+    char idstr[256];
+    uint8_t idlen;
+    int ret;
+
+    if (postcopy_state_get() != POSTCOPY_INCOMING_ADVISE) {
+        error_report("Unexpected postcopy RAM discard");
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    idlen = qemu_get_byte(f);
+    if (len < 1 + idlen || (len - 1 - idlen) % 16) {
+        error_report("Invalid postcopy RAM discard length %d", len);
+        return -EINVAL;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
+    qemu_get_buffer(f, (uint8_t *)idstr, idlen);
+    idstr[idlen] = 0;
+
+    for (len -= 1 + idlen; len; len -= 16) {
+        start = qemu_get_be64(f);
+        length = qemu_get_be64(f);
+        ret = postcopy_ram_discard_range(idstr, start, length);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int loadvm_postcopy_handle_listen(void)
+{
+    QemuThread thread;
+
+    if (postcopy_state_get() != POSTCOPY_INCOMING_ADVISE) {
+        error_report("Unexpected postcopy listen");
+        return -EINVAL;
+    }
+    if (postcopy_ram_incoming_init() < 0) {
+        return -EINVAL;
     }
 
+    postcopy_state_set(POSTCOPY_INCOMING_LISTENING);
+    qemu_thread_create(&thread, "postcopy/listen", postcopy_listen_thread,
+                       loadvm_file, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+static int loadvm_postcopy_handle_run(void)
+{
+    Error *local_err = NULL;
+    int ret = 0;
+
+    /* The listen thread may have reached the end of the stream already.  */
+    if (postcopy_state_get() < POSTCOPY_INCOMING_LISTENING) {
+        error_report("Unexpected postcopy run");
+        return -EINVAL;
+    }
+
+    loadvm_lock_iothread();
+    cpu_synchronize_all_post_init();
+    qemu_announce_self();
+
+    bdrv_clear_incoming_migration_all();
+    /* Make sure all file formats flush their mutable metadata */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+    } else if (autostart) {
+        vm_start();
+    } else {
+        runstate_set(RUN_STATE_PAUSED);
+    }
+    loadvm_unlock_iothread();
+    return ret;
+}
+
+static int loadvm_handle_cmd_packaged(QEMUFile *f)
+{
+    LoadStateList handlers = QLIST_HEAD_INITIALIZER(handlers);
+    QEMUFile *packf;
+    GByteArray *buf;
+    uint32_t length;
+    int ret;
+
+    length = qemu_get_be32(f);
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -EINVAL;
+    }
+
+    buf = g_byte_array_sized_new(length);
+    g_byte_array_set_size(buf, length);
+    if (qemu_get_buffer(f, buf->data, length) != length) {
+        error_report("Truncated packaged state");
+        g_byte_array_free(buf, TRUE);
+        return -EINVAL;
+    }
+
+    packf = qemu_bufopen("rb", buf);
+    ret = qemu_loadvm_state_main(packf, &handlers);
+    loadvm_free_handlers(&handlers);
+    qemu_fclose(packf);
+    g_byte_array_free(buf, TRUE);
+
+    if (ret == 0 && postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        return LOADVM_QUIT;
+    }
+    return ret;
+}
+
+static int loadvm_process_command(QEMUFile *f)
+{
+    uint16_t cmd;
+    uint16_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+    trace_loadvm_process_command(cmd, len);
+
+    switch (cmd) {
+    case MIG_CMD_OPEN_RETURN_PATH:
+        return migrate_incoming_open_return_path(f);
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise();
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(f, len);
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen();
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run();
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(f);
+    default:
+        error_report("Unknown migration command %d", cmd);
+        return -EINVAL;
+    }
+}
+
+static int loadvm_load_section(QEMUFile *f, LoadStateEntry *le)
+{
+    SaveStateEntry *se = le->se;
+    bool lock = !(se->ops && se->ops->load_state_unlocked);
+    int64_t start_time, start_pos, time_ns;
+    uint64_t bytes;
+    int ret;
+
+    if (lock) {
+        loadvm_lock_iothread();
+    }
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    start_pos = qemu_ftell_fast(f);
+    ret = vmstate_load(f, se, le->version_id);
+    time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    bytes = qemu_ftell_fast(f) - start_pos;
+    if (lock) {
+        loadvm_unlock_iothread();
+    }
+
+    se->load_time_ns += time_ns;
+    se->load_bytes += bytes;
+    trace_loadvm_section_stats(se->idstr, le->section_id, time_ns, bytes);
+    return ret;
+}
+
+/* Returns 0 at the end of the stream, LOADVM_QUIT if the rest of the
+ * stream goes to the postcopy listen thread, or -errno.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -791,16 +1414,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -809,54 +1430,95 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = loadvm_load_section(f, le);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = loadvm_load_section(f, le);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret) {
+                return ret;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    unsigned int v;
+    int ret;
 
-    ret = 0;
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->load_time_ns = 0;
+        se->load_bytes = 0;
+    }
+
+    loadvm_file = f;
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == LOADVM_QUIT) {
+        /* The listen thread owns f and loadvm_handlers now.  */
+        return 0;
     }
 
+    if (ret == 0) {
+        loadvm_lock_iothread();
+        cpu_synchronize_all_post_init();
+        loadvm_unlock_iothread();
+    }
+
+    loadvm_free_handlers(&loadvm_handlers);
+
     if (ret == 0) {
         ret = qemu_file_get_error(f);
     }
@@ -864,6 +1526,19 @@ out:
     return ret;
 }
 
+/* Same as qemu_loadvm_state, in a thread that does not hold the iothread
+ * lock.
+ */
+int qemu_loadvm_state_unlocked(QEMUFile *f)
+{
+    int ret;
+
+    loadvm_unlocked = true;
+    ret = qemu_loadvm_state(f);
+    loadvm_unlocked = false;
+    return ret;
+}
+
 static BlockDriverState *find_vmstate_bs(void)
 {
     BlockDriverState *bs = NULL;
@@ -975,7 +1650,12 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    /* Writes may still be in flight, and fail, until the file is closed */
+    if (ret >= 0) {
+        ret = qemu_fclose(f);
+    } else {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
@@ -1098,6 +1778,7 @@ int load_vmstate(const char *name)
 
     qemu_system_reset(VMRESET_SILENT);
     ret = qemu_loadvm_state(f);
+    migrate_decompress_threads_join();
 
     qemu_fclose(f);
     if (ret < 0) {
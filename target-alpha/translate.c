@@ -2851,7 +2851,7 @@ static inline void gen_intermediate_code_internal(AlphaCPU *cpu,
         insn = cpu_ldl_code(env, ctx.pc);
         num_insns++;
 
-	if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+	if (unlikely(tcg_debug_insn_start_enabled())) {
             tcg_gen_debug_insn_start(ctx.pc);
         }
 
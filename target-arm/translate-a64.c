@@ -10707,7 +10707,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
             gen_io_start();
         }
 
-        if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+        if (unlikely(tcg_debug_insn_start_enabled())) {
             tcg_gen_debug_insn_start(dc->pc);
         }
 
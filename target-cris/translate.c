@@ -3044,7 +3044,7 @@ static unsigned int crisv32_decoder(CPUCRISState *env, DisasContext *dc)
     int insn_len = 2;
     int i;
 
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+    if (unlikely(tcg_debug_insn_start_enabled())) {
         tcg_gen_debug_insn_start(dc->pc);
         }
 
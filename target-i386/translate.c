@@ -4412,7 +4412,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     target_ulong next_eip, tval;
     int rex_w, rex_r;
 
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+    if (unlikely(tcg_debug_insn_start_enabled())) {
         tcg_gen_debug_insn_start(pc_start);
     }
     s->pc = pc_start;
@@ -1003,7 +1003,7 @@ static const DecoderInfo decinfo[] = {
 
 static inline void decode(DisasContext *dc, uint32_t ir)
 {
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+    if (unlikely(tcg_debug_insn_start_enabled())) {
         tcg_gen_debug_insn_start(dc->pc);
     }
 
@@ -1618,7 +1618,7 @@ static inline void decode(DisasContext *dc, uint32_t ir)
 {
     int i;
 
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+    if (unlikely(tcg_debug_insn_start_enabled())) {
         tcg_gen_debug_insn_start(dc->pc);
     }
 
@@ -4789,7 +4789,7 @@ static inline void gen_intermediate_code_internal(S390CPU *cpu,
             gen_io_start();
         }
 
-        if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT))) {
+        if (unlikely(tcg_debug_insn_start_enabled())) {
             tcg_gen_debug_insn_start(dc.pc);
         }
 
@@ -0,0 +1,499 @@
+/*
+ * TCG instrumentation plugins
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <gmodule.h>
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/queue.h"
+#include "qemu/qemu-plugin.h"
+#include "cpu.h"
+#include "tcg-op.h"
+#include "exec/tcg-plugin.h"
+
+/*
+ * Instrumentation is decided per translation block.  When a plugin wants
+ * to see the translated blocks, cpu_gen_code translates each block twice:
+ * the first pass only records the guest instructions, then the plugins
+ * register their callbacks and inline operations on the block, and the
+ * second pass emits them at the start of the block and of each guest
+ * instruction (tcg_gen_debug_insn_start).  Everything is recorded in the
+ * qemu_plugin_tb attached to the TranslationBlock, so that retranslating
+ * the block in cpu_restore_state_from_tb generates the very same code.
+ */
+
+typedef struct TCGPlugin {
+    qemu_plugin_id_t id;
+    char *path;
+    char **argv;                /* Owned here, the plugin may keep pointers */
+    GModule *handle;
+    qemu_plugin_vcpu_tb_trans_cb_t tb_trans_cb;
+    QTAILQ_ENTRY(TCGPlugin) next;
+} TCGPlugin;
+
+typedef struct TCGPluginCB {
+    qemu_plugin_vcpu_udata_cb_t cb;
+    void *userdata;
+} TCGPluginCB;
+
+typedef struct TCGPluginMemCB {
+    qemu_plugin_vcpu_mem_cb_t cb;
+    enum qemu_plugin_mem_rw rw;
+    void *userdata;
+} TCGPluginMemCB;
+
+typedef struct TCGPluginExitCB {
+    qemu_plugin_id_t id;
+    qemu_plugin_udata_cb_t cb;
+    void *userdata;
+} TCGPluginExitCB;
+
+typedef struct TCGPluginInline {
+    uint64_t *ptr;
+    uint64_t imm;
+} TCGPluginInline;
+
+struct qemu_plugin_insn {
+    uint64_t vaddr;
+    GArray *cbs;                /* TCGPluginCB */
+    GArray *inlines;            /* TCGPluginInline */
+};
+
+struct qemu_plugin_tb {
+    uint64_t vaddr;
+    size_t size;
+    size_t n_insns;
+    struct qemu_plugin_insn *insns;
+    GArray *cbs;
+    GArray *inlines;
+    bool instrumented;
+};
+
+bool tcg_plugin_tb_enabled;
+bool tcg_plugin_mem_enabled;
+
+static QTAILQ_HEAD(, TCGPlugin) plugins = QTAILQ_HEAD_INITIALIZER(plugins);
+static qemu_plugin_id_t next_plugin_id = 1;
+static bool plugins_installing;
+
+static GArray *mem_cbs;         /* TCGPluginMemCB */
+static GArray *exit_cbs;        /* TCGPluginExitCB */
+
+/* The block being translated, and whether this is the first pass.  */
+static struct qemu_plugin_tb *cur_tb;
+static bool cur_tb_recording;
+static size_t cur_insn;
+
+static TCGPlugin *plugin_by_id(qemu_plugin_id_t id)
+{
+    TCGPlugin *p;
+
+    QTAILQ_FOREACH(p, &plugins, next) {
+        if (p->id == id) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Registration must happen before the first translation, because the
+   code generated for memory accesses does not depend on the TB.  */
+static void check_installing(const char *what)
+{
+    if (!plugins_installing) {
+        error_report("plugin: %s can only be registered at install time",
+                     what);
+        abort();
+    }
+}
+
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb)
+{
+    TCGPlugin *p = plugin_by_id(id);
+
+    check_installing("tb_trans callback");
+    assert(p);
+    p->tb_trans_cb = cb;
+    tcg_plugin_tb_enabled = true;
+}
+
+void qemu_plugin_register_vcpu_mem_cb(qemu_plugin_id_t id,
+                                      qemu_plugin_vcpu_mem_cb_t cb,
+                                      enum qemu_plugin_mem_rw rw,
+                                      void *userdata)
+{
+    TCGPluginMemCB mem_cb = { .cb = cb, .rw = rw, .userdata = userdata };
+
+    check_installing("memory callback");
+    assert(plugin_by_id(id));
+    if (!mem_cbs) {
+        mem_cbs = g_array_new(FALSE, FALSE, sizeof(TCGPluginMemCB));
+    }
+    g_array_append_val(mem_cbs, mem_cb);
+    tcg_plugin_mem_enabled = true;
+}
+
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb,
+                                    void *userdata)
+{
+    TCGPluginExitCB exit_cb = { .id = id, .cb = cb, .userdata = userdata };
+
+    assert(plugin_by_id(id));
+    if (!exit_cbs) {
+        exit_cbs = g_array_new(FALSE, FALSE, sizeof(TCGPluginExitCB));
+    }
+    g_array_append_val(exit_cbs, exit_cb);
+}
+
+uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb)
+{
+    return tb->vaddr;
+}
+
+size_t qemu_plugin_tb_size(const struct qemu_plugin_tb *tb)
+{
+    return tb->size;
+}
+
+size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb)
+{
+    return tb->n_insns;
+}
+
+struct qemu_plugin_insn *qemu_plugin_tb_get_insn(
+    const struct qemu_plugin_tb *tb, size_t idx)
+{
+    if (idx >= tb->n_insns) {
+        return NULL;
+    }
+    return &tb->insns[idx];
+}
+
+uint64_t qemu_plugin_insn_vaddr(const struct qemu_plugin_insn *insn)
+{
+    return insn->vaddr;
+}
+
+static void add_cb(GArray **cbs, qemu_plugin_vcpu_udata_cb_t cb,
+                   void *userdata)
+{
+    TCGPluginCB udata_cb = { .cb = cb, .userdata = userdata };
+
+    assert(cur_tb && cur_tb_recording);
+    if (!*cbs) {
+        *cbs = g_array_new(FALSE, FALSE, sizeof(TCGPluginCB));
+    }
+    g_array_append_val(*cbs, udata_cb);
+    cur_tb->instrumented = true;
+}
+
+static void add_inline(GArray **inlines, enum qemu_plugin_op op,
+                       void *ptr, uint64_t imm)
+{
+    TCGPluginInline inl = { .ptr = ptr, .imm = imm };
+
+    assert(cur_tb && cur_tb_recording);
+    assert(op == QEMU_PLUGIN_INLINE_ADD_U64);
+    if (!*inlines) {
+        *inlines = g_array_new(FALSE, FALSE, sizeof(TCGPluginInline));
+    }
+    g_array_append_val(*inlines, inl);
+    cur_tb->instrumented = true;
+}
+
+void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                          qemu_plugin_vcpu_udata_cb_t cb,
+                                          void *userdata)
+{
+    add_cb(&tb->cbs, cb, userdata);
+}
+
+void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                              enum qemu_plugin_op op,
+                                              void *ptr, uint64_t imm)
+{
+    add_inline(&tb->inlines, op, ptr, imm);
+}
+
+void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
+                                            qemu_plugin_vcpu_udata_cb_t cb,
+                                            void *userdata)
+{
+    add_cb(&insn->cbs, cb, userdata);
+}
+
+void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
+                                                enum qemu_plugin_op op,
+                                                void *ptr, uint64_t imm)
+{
+    add_inline(&insn->inlines, op, ptr, imm);
+}
+
+/* Helpers called from the generated code.  */
+
+void HELPER(plugin_vcpu_udata_cbs)(void *arg)
+{
+    GArray *cbs = arg;
+    unsigned int vcpu_index = current_cpu->cpu_index;
+    guint i;
+
+    for (i = 0; i < cbs->len; i++) {
+        TCGPluginCB *cb = &g_array_index(cbs, TCGPluginCB, i);
+
+        cb->cb(vcpu_index, cb->userdata);
+    }
+}
+
+void HELPER(plugin_vcpu_mem_cb)(uint64_t vaddr, uint32_t info)
+{
+    unsigned int vcpu_index = current_cpu->cpu_index;
+    enum qemu_plugin_mem_rw rw;
+    guint i;
+
+    rw = qemu_plugin_mem_is_store(info) ? QEMU_PLUGIN_MEM_W : QEMU_PLUGIN_MEM_R;
+    for (i = 0; i < mem_cbs->len; i++) {
+        TCGPluginMemCB *cb = &g_array_index(mem_cbs, TCGPluginMemCB, i);
+
+        if (cb->rw & rw) {
+            cb->cb(vcpu_index, info, vaddr, cb->userdata);
+        }
+    }
+}
+
+/* Code generation.  */
+
+static void gen_inlines(GArray *inlines)
+{
+    guint i;
+
+    if (!inlines) {
+        return;
+    }
+    for (i = 0; i < inlines->len; i++) {
+        TCGPluginInline *inl = &g_array_index(inlines, TCGPluginInline, i);
+        TCGv_ptr ptr = tcg_const_ptr(inl->ptr);
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(val, ptr, 0);
+        tcg_gen_addi_i64(val, val, inl->imm);
+        tcg_gen_st_i64(val, ptr, 0);
+
+        tcg_temp_free_i64(val);
+        tcg_temp_free_ptr(ptr);
+    }
+}
+
+static void gen_cbs(GArray *cbs)
+{
+    TCGv_ptr arg;
+
+    if (!cbs) {
+        return;
+    }
+    arg = tcg_const_ptr(cbs);
+    gen_helper_plugin_vcpu_udata_cbs(arg);
+    tcg_temp_free_ptr(arg);
+}
+
+void tcg_plugin_tb_start(TranslationBlock *tb)
+{
+    cur_tb = NULL;
+    if (!tcg_plugin_tb_enabled) {
+        return;
+    }
+
+    if (!tb->plugin) {
+        tb->plugin = g_new0(struct qemu_plugin_tb, 1);
+        cur_tb_recording = true;
+    } else {
+        cur_tb_recording = false;
+    }
+    cur_tb = tb->plugin;
+    cur_insn = 0;
+}
+
+void tcg_plugin_gen_tb_start(void)
+{
+    if (!cur_tb || cur_tb_recording || !cur_tb->instrumented) {
+        return;
+    }
+    gen_inlines(cur_tb->inlines);
+    gen_cbs(cur_tb->cbs);
+}
+
+void tcg_plugin_gen_insn_start(uint64_t pc)
+{
+    struct qemu_plugin_insn *insn;
+
+    if (!cur_tb) {
+        return;
+    }
+
+    if (cur_tb_recording) {
+        cur_tb->insns = g_renew(struct qemu_plugin_insn, cur_tb->insns,
+                                cur_tb->n_insns + 1);
+        insn = &cur_tb->insns[cur_tb->n_insns++];
+        memset(insn, 0, sizeof(*insn));
+        insn->vaddr = pc;
+        return;
+    }
+
+    if (!cur_tb->instrumented || cur_insn >= cur_tb->n_insns) {
+        return;
+    }
+    insn = &cur_tb->insns[cur_insn++];
+    assert(insn->vaddr == pc);
+    gen_inlines(insn->inlines);
+    gen_cbs(insn->cbs);
+}
+
+static void free_insns(struct qemu_plugin_tb *ptb)
+{
+    size_t i;
+
+    for (i = 0; i < ptb->n_insns; i++) {
+        if (ptb->insns[i].cbs) {
+            g_array_free(ptb->insns[i].cbs, TRUE);
+        }
+        if (ptb->insns[i].inlines) {
+            g_array_free(ptb->insns[i].inlines, TRUE);
+        }
+    }
+    g_free(ptb->insns);
+    ptb->insns = NULL;
+    ptb->n_insns = 0;
+}
+
+bool tcg_plugin_tb_translated(CPUState *cpu, TranslationBlock *tb)
+{
+    struct qemu_plugin_tb *ptb = tb->plugin;
+    TCGPlugin *p;
+
+    if (!ptb || !cur_tb_recording) {
+        return false;
+    }
+
+    ptb->vaddr = tb->pc;
+    ptb->size = tb->size;
+    QTAILQ_FOREACH(p, &plugins, next) {
+        if (p->tb_trans_cb) {
+            p->tb_trans_cb(p->id, cpu->cpu_index, ptb);
+        }
+    }
+    cur_tb = NULL;
+
+    if (!ptb->instrumented) {
+        /* Keep the empty record, so that retranslation knows that
+           there is nothing to emit.  */
+        free_insns(ptb);
+        return false;
+    }
+    return true;
+}
+
+void tcg_plugin_tb_free(TranslationBlock *tb)
+{
+    struct qemu_plugin_tb *ptb = tb->plugin;
+
+    if (!ptb) {
+        return;
+    }
+    free_insns(ptb);
+    if (ptb->cbs) {
+        g_array_free(ptb->cbs, TRUE);
+    }
+    if (ptb->inlines) {
+        g_array_free(ptb->inlines, TRUE);
+    }
+    g_free(ptb);
+    tb->plugin = NULL;
+}
+
+/* Loading and unloading.  */
+
+void tcg_plugin_exit(void)
+{
+    static bool done;
+    guint i;
+
+    if (done || !exit_cbs) {
+        return;
+    }
+    done = true;
+
+    for (i = 0; i < exit_cbs->len; i++) {
+        TCGPluginExitCB *cb = &g_array_index(exit_cbs, TCGPluginExitCB, i);
+
+        cb->cb(cb->id, cb->userdata);
+    }
+}
+
+int tcg_plugin_load(const char *path, int argc, char **argv)
+{
+    int (*install)(qemu_plugin_id_t, int, char **);
+    int *version;
+    TCGPlugin *p;
+    int i, ret;
+
+    if (!g_module_supported()) {
+        error_report("plugin: dynamic loading is not supported");
+        return -1;
+    }
+
+    p = g_new0(TCGPlugin, 1);
+    p->path = g_strdup(path);
+    p->argv = g_new0(char *, argc + 1);
+    for (i = 0; i < argc; i++) {
+        p->argv[i] = g_strdup(argv[i]);
+    }
+    p->handle = g_module_open(path, G_MODULE_BIND_LOCAL);
+    if (!p->handle) {
+        error_report("plugin: could not load %s: %s", path, g_module_error());
+        goto fail;
+    }
+    if (!g_module_symbol(p->handle, "qemu_plugin_version",
+                         (gpointer *)&version) ||
+        !g_module_symbol(p->handle, "qemu_plugin_install",
+                         (gpointer *)&install)) {
+        error_report("plugin: %s is not a QEMU plugin", path);
+        goto fail_close;
+    }
+    if (*version != QEMU_PLUGIN_VERSION) {
+        error_report("plugin: %s uses API version %d, but QEMU provides %d",
+                     path, *version, QEMU_PLUGIN_VERSION);
+        goto fail_close;
+    }
+
+    p->id = next_plugin_id++;
+    QTAILQ_INSERT_TAIL(&plugins, p, next);
+
+    plugins_installing = true;
+    ret = install(p->id, argc, p->argv);
+    plugins_installing = false;
+    if (ret < 0) {
+        error_report("plugin: %s failed to install", path);
+        QTAILQ_REMOVE(&plugins, p, next);
+        goto fail_close;
+    }
+
+    if (QTAILQ_FIRST(&plugins) == p) {
+        atexit(tcg_plugin_exit);
+    }
+    return 0;
+
+fail_close:
+    g_module_close(p->handle);
+fail:
+    g_strfreev(p->argv);
+    g_free(p->path);
+    g_free(p);
+    return -1;
+}
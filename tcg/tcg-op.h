@@ -22,6 +22,8 @@
  * THE SOFTWARE.
  */
 #include "tcg.h"
+#include "qemu/log.h"
+#include "exec/tcg-plugin.h"
 #include "exec/helper-proto.h"
 #include "exec/helper-gen.h"
 
@@ -2491,9 +2493,20 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i64
 #endif
 
+/* Whether the translators should call tcg_gen_debug_insn_start at the
+   start of each guest instruction: for logging, or for plugins that
+   instrument instructions.  */
+static inline bool tcg_debug_insn_start_enabled(void)
+{
+    return qemu_loglevel_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT)
+           || tcg_plugin_tb_enabled;
+}
+
 /* debug info: write the PC of the corresponding QEMU CPU instruction */
 static inline void tcg_gen_debug_insn_start(uint64_t pc)
 {
+    tcg_plugin_gen_insn_start(pc);
+
     /* XXX: must really use a 32 bit size for TCGArg in all cases */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
     tcg_gen_op2ii(INDEX_op_debug_insn_start, 
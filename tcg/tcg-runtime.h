@@ -14,3 +14,8 @@ DEF_HELPER_FLAGS_2(sar_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 
 DEF_HELPER_FLAGS_2(mulsh_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 DEF_HELPER_FLAGS_2(muluh_i64, TCG_CALL_NO_RWG_SE, i64, i64, i64)
+
+#ifdef CONFIG_TCG_PLUGIN
+DEF_HELPER_FLAGS_1(plugin_vcpu_udata_cbs, TCG_CALL_NO_RWG, void, ptr)
+DEF_HELPER_FLAGS_2(plugin_vcpu_mem_cb, TCG_CALL_NO_RWG, void, i64, i32)
+#endif
@@ -48,6 +48,7 @@
 #include "cpu.h"
 
 #include "tcg-op.h"
+#include "qemu/qemu-plugin.h"
 
 #if UINTPTR_MAX == UINT32_MAX
 # define ELF_CLASS  ELFCLASS32
@@ -963,7 +964,7 @@ static const TCGOpcode old_st_opc[4] = {
     [MO_Q]  = INDEX_op_qemu_st64,
 };
 
-void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+static void gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
 {
     memop = tcg_canonicalize_memop(memop, 0, 0);
 
@@ -998,7 +999,7 @@ void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     }
 }
 
-void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+static void gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
 {
     memop = tcg_canonicalize_memop(memop, 0, 1);
 
@@ -1034,13 +1035,13 @@ void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     }
 }
 
-void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+static void gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
 {
     memop = tcg_canonicalize_memop(memop, 1, 0);
 
 #if TCG_TARGET_REG_BITS == 32
     if ((memop & MO_SIZE) < MO_64) {
-        tcg_gen_qemu_ld_i32(TCGV_LOW(val), addr, idx, memop);
+        gen_qemu_ld_i32(TCGV_LOW(val), addr, idx, memop);
         if (memop & MO_SIGN) {
             tcg_gen_sari_i32(TCGV_HIGH(val), TCGV_LOW(val), 31);
         } else {
@@ -1069,13 +1070,13 @@ void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     *tcg_ctx.gen_opparam_ptr++ = idx;
 }
 
-void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+static void gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
 {
     memop = tcg_canonicalize_memop(memop, 1, 1);
 
 #if TCG_TARGET_REG_BITS == 32
     if ((memop & MO_SIZE) < MO_64) {
-        tcg_gen_qemu_st_i32(TCGV_LOW(val), addr, idx, memop);
+        gen_qemu_st_i32(TCGV_LOW(val), addr, idx, memop);
         return;
     }
 #endif
@@ -1099,6 +1100,92 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     *tcg_ctx.gen_opparam_ptr++ = idx;
 }
 
+#ifdef CONFIG_TCG_PLUGIN
+/* Memory callbacks for plugins run after the access, so that only the
+   accesses that did not fault are reported.  The address is copied
+   first because a load may overwrite it.  */
+static TCGv_i64 plugin_gen_mem_prepare(TCGv addr)
+{
+    TCGv_i64 vaddr;
+
+    if (!tcg_plugin_mem_enabled) {
+        return MAKE_TCGV_I64(-1);
+    }
+    vaddr = tcg_temp_new_i64();
+    tcg_gen_extu_tl_i64(vaddr, addr);
+    return vaddr;
+}
+
+static void plugin_gen_mem(TCGv_i64 vaddr, TCGArg idx, TCGMemOp memop,
+                           bool is_store)
+{
+    uint32_t info;
+    TCGv_i32 tinfo;
+
+    if (!tcg_plugin_mem_enabled) {
+        return;
+    }
+
+    info = (memop & MO_SIZE) | (idx << QEMU_PLUGIN_MEMINFO_MMU_IDX_SHIFT);
+    if (memop & MO_SIGN) {
+        info |= QEMU_PLUGIN_MEMINFO_SIGN;
+    }
+    if ((memop & MO_BSWAP) == MO_BE) {
+        info |= QEMU_PLUGIN_MEMINFO_BE;
+    }
+    if (is_store) {
+        info |= QEMU_PLUGIN_MEMINFO_STORE;
+    }
+
+    tinfo = tcg_const_i32(info);
+    gen_helper_plugin_vcpu_mem_cb(vaddr, tinfo);
+    tcg_temp_free_i32(tinfo);
+    tcg_temp_free_i64(vaddr);
+}
+#else
+static inline TCGv_i64 plugin_gen_mem_prepare(TCGv addr)
+{
+    return MAKE_TCGV_I64(-1);
+}
+
+static inline void plugin_gen_mem(TCGv_i64 vaddr, TCGArg idx,
+                                  TCGMemOp memop, bool is_store)
+{
+}
+#endif
+
+void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 vaddr = plugin_gen_mem_prepare(addr);
+
+    gen_qemu_ld_i32(val, addr, idx, memop);
+    plugin_gen_mem(vaddr, idx, memop, false);
+}
+
+void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 vaddr = plugin_gen_mem_prepare(addr);
+
+    gen_qemu_st_i32(val, addr, idx, memop);
+    plugin_gen_mem(vaddr, idx, memop, true);
+}
+
+void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 vaddr = plugin_gen_mem_prepare(addr);
+
+    gen_qemu_ld_i64(val, addr, idx, memop);
+    plugin_gen_mem(vaddr, idx, memop, false);
+}
+
+void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 vaddr = plugin_gen_mem_prepare(addr);
+
+    gen_qemu_st_i64(val, addr, idx, memop);
+    plugin_gen_mem(vaddr, idx, memop, true);
+}
+
 static void tcg_reg_alloc_start(TCGContext *s)
 {
     int i;
@@ -0,0 +1,63 @@
+/*
+ * TCG plugin counting the guest instructions executed
+ *
+ * Used by bench.py to compute the guest MIPS of the benchmark kernels.
+ * Prints "guest_insns N" to the file given as "out=FILE", or to stderr.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "qemu/qemu-plugin.h"
+
+int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+static uint64_t insn_count;
+static const char *out_file;
+
+static void tb_trans(qemu_plugin_id_t id, unsigned int vcpu_index,
+                     struct qemu_plugin_tb *tb)
+{
+    qemu_plugin_register_vcpu_tb_exec_inline(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                             &insn_count,
+                                             qemu_plugin_tb_n_insns(tb));
+}
+
+static void at_exit(qemu_plugin_id_t id, void *userdata)
+{
+    FILE *f = stderr;
+
+    if (out_file) {
+        f = fopen(out_file, "w");
+        if (!f) {
+            perror(out_file);
+            return;
+        }
+    }
+    fprintf(f, "guest_insns %" PRIu64 "\n", insn_count);
+    if (f != stderr) {
+        fclose(f);
+    }
+}
+
+int qemu_plugin_install(qemu_plugin_id_t id, int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (!strncmp(argv[i], "out=", 4)) {
+            out_file = argv[i] + 4;
+        } else {
+            fprintf(stderr, "bench-insn-plugin: unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    qemu_plugin_register_vcpu_tb_trans_cb(id, tb_trans);
+    qemu_plugin_register_atexit_cb(id, at_exit, NULL);
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * TCG throughput microkernels
+ *
+ * Each kernel stresses one part of the translator or of the generated
+ * code.  The work done only depends on the iteration count, so that the
+ * number of guest instructions executed is the same from run to run and
+ * the run time can be compared between QEMU versions.
+ *
+ * Usage: bench KERNEL [ITERATIONS]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* Keep the compiler from optimizing the kernels away.  */
+static volatile uint32_t sink;
+
+static void bench_int(unsigned long n)
+{
+    uint32_t a = 1, b = 2, c = 3;
+    unsigned long i;
+
+    for (i = 0; i < n * 1000; i++) {
+        a += b ^ (c >> 3);
+        b = (b * 33) + a;
+        c -= a | (b << 5);
+        if (a & 0x100) {
+            c++;
+        }
+    }
+    sink = a + b + c;
+}
+
+#define CHASE_NODES (1 << 16)
+
+/* A random cyclic permutation spread over 1 MB (4 MB on 64-bit guests),
+   so that most loads miss the softmmu TLB of system mode and the host
+   data cache.  */
+static void bench_ptrchase(unsigned long n)
+{
+    struct node {
+        struct node *next;
+        char pad[16 - sizeof(struct node *)];
+    } *nodes, *p;
+    uint32_t *perm;
+    uint32_t seed = 12345;
+    unsigned long i;
+
+    nodes = calloc(CHASE_NODES, sizeof(*nodes));
+    perm = malloc(CHASE_NODES * sizeof(*perm));
+    for (i = 0; i < CHASE_NODES; i++) {
+        perm[i] = i;
+    }
+    for (i = CHASE_NODES - 1; i > 0; i--) {
+        uint32_t j, tmp;
+
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 8) % (i + 1);
+        tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+    }
+    for (i = 0; i < CHASE_NODES; i++) {
+        nodes[perm[i]].next = &nodes[perm[(i + 1) % CHASE_NODES]];
+    }
+
+    p = &nodes[perm[0]];
+    for (i = 0; i < n * 1000; i++) {
+        p = p->next;
+    }
+    sink = (uintptr_t)p;
+    free(perm);
+    free(nodes);
+}
+
+static uint32_t f0(uint32_t x) { return x + 1; }
+static uint32_t f1(uint32_t x) { return x ^ 0x55; }
+static uint32_t f2(uint32_t x) { return x << 1; }
+static uint32_t f3(uint32_t x) { return x - 3; }
+
+/* Indirect calls and returns end every TB with a jump whose target is
+   only known at run time.  */
+static void bench_icall(unsigned long n)
+{
+    static uint32_t (* volatile table[4])(uint32_t) = { f0, f1, f2, f3 };
+    uint32_t x = 0;
+    unsigned long i;
+
+    for (i = 0; i < n * 1000; i++) {
+        x = table[i & 3](x);
+    }
+    sink = x;
+}
+
+static void bench_fp(unsigned long n)
+{
+    double a = 1.0, b = 0.5, c = 0.0;
+    unsigned long i;
+
+    for (i = 0; i < n * 1000; i++) {
+        c += a * b;
+        a = a * 1.000001 + 0.000001;
+        b = b / 1.0000001;
+        if (c > 1e6) {
+            c -= 1e6;
+        }
+    }
+    sink = (uint32_t)c;
+}
+
+#define MEMCPY_SIZE 4096
+
+static void bench_memcpy(unsigned long n)
+{
+    static char src[MEMCPY_SIZE], dst[MEMCPY_SIZE];
+    unsigned long i;
+
+    memset(src, 0x5a, sizeof(src));
+    for (i = 0; i < n * 10; i++) {
+        src[i % MEMCPY_SIZE] = i;
+        memcpy(dst, src, sizeof(dst));
+    }
+    sink = dst[n % MEMCPY_SIZE];
+}
+
+/* Self-modifying code: patch the immediate of a small function before
+   every call, which invalidates and retranslates its TB.  */
+#if defined(__i386__) || defined(__x86_64__)
+static const uint8_t smc_code[] = {
+    0xb8, 0, 0, 0, 0,               /* mov $imm, %eax */
+    0xc3,                           /* ret */
+};
+#define SMC_IMM_OFFSET 1
+#define HAVE_SMC
+
+static void smc_patch(uint8_t *code, uint32_t imm)
+{
+    memcpy(code + SMC_IMM_OFFSET, &imm, sizeof(imm));
+}
+#elif defined(__arm__)
+static const uint32_t smc_code[] = {
+    0xe3a00000,                     /* mov r0, #imm */
+    0xe12fff1e,                     /* bx lr */
+};
+#define HAVE_SMC
+
+static void smc_patch(uint8_t *code, uint32_t imm)
+{
+    uint32_t *insn = (uint32_t *)code;
+
+    insn[0] = 0xe3a00000 | (imm & 0xff);
+    __builtin___clear_cache((char *)code, (char *)code + sizeof(smc_code));
+}
+#endif
+
+static void bench_smc(unsigned long n)
+{
+#ifdef HAVE_SMC
+    uint8_t *code;
+    uint32_t (*fn)(void);
+    uint32_t x = 0;
+    unsigned long i;
+
+    code = mmap(NULL, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memcpy(code, smc_code, sizeof(smc_code));
+    fn = (uint32_t (*)(void))(uintptr_t)code;
+
+    for (i = 0; i < n; i++) {
+        smc_patch(code, i);
+        x += fn();
+    }
+    sink = x;
+    munmap(code, 4096);
+#else
+    fprintf(stderr, "smc: not supported on this architecture\n");
+    exit(1);
+#endif
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(unsigned long n);
+    unsigned long default_n;
+} kernels[] = {
+    { "int",      bench_int,      100000 },
+    { "ptrchase", bench_ptrchase, 20000 },
+    { "icall",    bench_icall,    50000 },
+    { "fp",       bench_fp,       10000 },
+    { "memcpy",   bench_memcpy,   100000 },
+    { "smc",      bench_smc,      100000 },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned long n;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s KERNEL [ITERATIONS]\nkernels:", argv[0]);
+        for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+            fprintf(stderr, " %s", kernels[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!strcmp(argv[1], kernels[i].name)) {
+            n = argc > 2 ? strtoul(argv[2], NULL, 0) : kernels[i].default_n;
+            kernels[i].fn(n);
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown kernel %s\n", argv[1]);
+    return 1;
+}
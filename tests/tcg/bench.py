@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+#
+# Run the TCG benchmark kernels (bench.c) under a linux-user QEMU and
+# print one JSON object per kernel on stdout, for example:
+#
+#   {"arch": "i386", "kernel": "int", "seconds": 1.92, "guest_insns": ...,
+#    "mips": 612.4, "tb_translations": 311, "tb_translation_ns": 1840211,
+#    "tb_flushes": 0, "tb_invalidations": 0}
+#
+# The time is the best of --repeat runs.  Guest instructions are counted
+# in a separate run with bench-insn-plugin.so, so that the instrumentation
+# does not affect the timing; without --plugin, guest_insns and mips are
+# null.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import json
+import optparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+KERNELS = ['int', 'ptrchase', 'icall', 'fp', 'memcpy', 'smc']
+
+def read_stats(path):
+    stats = {}
+    with open(path) as f:
+        for line in f:
+            key, value = line.split()
+            stats[key] = int(value)
+    return stats
+
+def run(cmd):
+    start = time.time()
+    ret = subprocess.call(cmd)
+    elapsed = time.time() - start
+    if ret != 0:
+        raise Exception('%s failed with status %d' % (' '.join(cmd), ret))
+    return elapsed
+
+def bench_kernel(opts, kernel, stats_file):
+    result = {'arch': opts.arch, 'kernel': kernel}
+
+    best = None
+    for i in range(opts.repeat):
+        cmd = [opts.qemu, '-jitstats', stats_file, opts.binary, kernel]
+        if opts.iterations:
+            cmd.append(str(opts.iterations))
+        elapsed = run(cmd)
+        if best is None or elapsed < best:
+            best = elapsed
+            stats = read_stats(stats_file)
+    result['seconds'] = round(best, 4)
+
+    result['guest_insns'] = None
+    result['mips'] = None
+    if opts.plugin:
+        cmd = [opts.qemu, '-plugin',
+               '%s,out=%s' % (opts.plugin, stats_file),
+               opts.binary, kernel]
+        if opts.iterations:
+            cmd.append(str(opts.iterations))
+        run(cmd)
+        insns = read_stats(stats_file)['guest_insns']
+        result['guest_insns'] = insns
+        result['mips'] = round(insns / best / 1e6, 2)
+
+    result.update(stats)
+    return result
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--qemu', help='linux-user QEMU binary')
+    parser.add_option('--binary', help='benchmark binary built from bench.c')
+    parser.add_option('--arch', help='name of the guest architecture')
+    parser.add_option('--plugin', help='path to bench-insn-plugin.so')
+    parser.add_option('--kernels', default=','.join(KERNELS),
+                      help='comma-separated list of kernels to run')
+    parser.add_option('--iterations', type='int',
+                      help='override the default iteration count')
+    parser.add_option('--repeat', type='int', default=3,
+                      help='number of timed runs per kernel')
+    opts, args = parser.parse_args()
+    if not opts.qemu or not opts.binary or not opts.arch:
+        parser.error('--qemu, --binary and --arch are required')
+
+    fd, stats_file = tempfile.mkstemp(prefix='qemu-bench-')
+    os.close(fd)
+    try:
+        for kernel in opts.kernels.split(','):
+            result = bench_kernel(opts, kernel, stats_file)
+            sys.stdout.write(json.dumps(result, sort_keys=True) + '\n')
+            sys.stdout.flush()
+    finally:
+        os.unlink(stats_file)
+
+if __name__ == '__main__':
+    main()
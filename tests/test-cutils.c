@@ -226,6 +226,71 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+#define BUFFER_TEST_SIZE 1024
+
+/* Exercises every offset, length and non-zero position in a small buffer */
+static void test_buffer_find_nonzero_one(void)
+{
+    uint8_t *buf = g_malloc0(BUFFER_TEST_SIZE + 64);
+    size_t start, len, pos;
+
+    for (start = 0; start < 64; start += 7) {
+        for (len = 0; len <= BUFFER_TEST_SIZE; len += len < 256 ? 1 : 61) {
+            g_assert_cmpint(buffer_find_nonzero_offset(buf + start, len),
+                            ==, len);
+            g_assert(buffer_is_zero(buf + start, len));
+            for (pos = 0; pos < len; pos += pos < 128 ? 1 : 13) {
+                buf[start + pos] = 0x80;
+                g_assert_cmpint(buffer_find_nonzero_offset(buf + start, len),
+                                ==, pos);
+                g_assert(!buffer_is_zero(buf + start, len));
+                buf[start + pos] = 0;
+            }
+            /* Non-zero bytes around the buffer are ignored */
+            if (start) {
+                buf[start - 1] = 1;
+            }
+            buf[start + len] = 1;
+            g_assert(buffer_is_zero(buf + start, len));
+            buf[start + len] = 0;
+            if (start) {
+                buf[start - 1] = 0;
+            }
+        }
+    }
+    g_free(buf);
+}
+
+static void test_buffer_find_nonzero(void)
+{
+    do {
+        test_buffer_find_nonzero_one();
+    } while (test_buffer_is_zero_next_accel());
+}
+
+static void test_perf_buffer_is_zero(void)
+{
+    size_t len = 64 * 1024 * 1024;
+    uint8_t *buf = g_malloc(len);
+    double elapsed;
+    int i, accel = 0;
+
+    /* Fault the pages in before timing */
+    memset(buf, 0, len);
+    do {
+        g_assert(buffer_is_zero(buf, len));
+        g_test_timer_start();
+        for (i = 0; i < 16; i++) {
+            g_assert(buffer_is_zero(buf + (i & 1), len - 64));
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_maximized_result(16 * len / elapsed / (1024 * 1024),
+                                "buffer_is_zero, version %d: %.0f MB/s",
+                                accel++, 16 * len / elapsed / (1024 * 1024));
+    } while (test_buffer_is_zero_next_accel());
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +311,11 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero", test_buffer_find_nonzero);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/perf/buffer_is_zero",
+                        test_perf_buffer_is_zero);
+    }
 
     return g_test_run();
 }
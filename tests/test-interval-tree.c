@@ -0,0 +1,159 @@
+/*
+ * Test interval trees
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu/interval-tree.h"
+#include "qemu/osdep.h"
+
+#define NR_NODES  1024
+
+static IntervalTreeNode nodes[NR_NODES];
+static bool inserted[NR_NODES];
+
+/* Check the red-black and augmentation invariants, return black height.  */
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent)
+{
+    int left_height, right_height;
+    uint64_t max;
+
+    if (!node) {
+        return 1;
+    }
+    g_assert(node->parent == parent);
+    if (node->red) {
+        g_assert(!node->left || !node->left->red);
+        g_assert(!node->right || !node->right->red);
+    }
+
+    max = node->last;
+    if (node->left) {
+        g_assert_cmpint(node->left->start, <=, node->start);
+        max = MAX(max, node->left->subtree_last);
+    }
+    if (node->right) {
+        g_assert_cmpint(node->right->start, >=, node->start);
+        max = MAX(max, node->right->subtree_last);
+    }
+    g_assert_cmpint(node->subtree_last, ==, max);
+
+    left_height = check_subtree(node->left, node);
+    right_height = check_subtree(node->right, node);
+    g_assert_cmpint(left_height, ==, right_height);
+    return left_height + !node->red;
+}
+
+static void check_range(IntervalTreeRoot *root, uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node;
+    uint64_t prev_start = 0;
+    int i, found = 0, expected = 0;
+
+    for (i = 0; i < NR_NODES; i++) {
+        if (inserted[i] && nodes[i].start <= last && start <= nodes[i].last) {
+            expected++;
+        }
+    }
+
+    for (node = interval_tree_iter_first(root, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        g_assert_cmpint(node->start, <=, last);
+        g_assert_cmpint(node->last, >=, start);
+        g_assert_cmpint(node->start, >=, prev_start);
+        prev_start = node->start;
+        found++;
+    }
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INITIALIZER;
+
+    g_assert(interval_tree_empty(&root));
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == NULL);
+    g_assert(interval_tree_first(&root) == NULL);
+    g_assert(interval_tree_last(&root) == NULL);
+}
+
+static void test_disjoint(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INITIALIZER;
+    IntervalTreeNode *node;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        nodes[i].start = i * 0x1000;
+        nodes[i].last = i * 0x1000 + 0x7ff;
+        interval_tree_insert(&nodes[i], &root);
+    }
+
+    g_assert(interval_tree_iter_first(&root, 0x800, 0xfff) == NULL);
+    g_assert(interval_tree_iter_first(&root, 0x1000, 0x1000) == &nodes[1]);
+    g_assert(interval_tree_iter_first(&root, 0x1800, 0x3000) == &nodes[2]);
+
+    node = interval_tree_first(&root);
+    for (i = 0; i < 16; i++) {
+        g_assert(node == &nodes[i]);
+        node = interval_tree_next(node);
+    }
+    g_assert(node == NULL);
+
+    node = interval_tree_last(&root);
+    for (i = 15; i >= 0; i--) {
+        g_assert(node == &nodes[i]);
+        node = interval_tree_prev(node);
+    }
+    g_assert(node == NULL);
+
+    for (i = 0; i < 16; i++) {
+        interval_tree_remove(&nodes[i], &root);
+    }
+    g_assert(interval_tree_empty(&root));
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INITIALIZER;
+    GRand *rand = g_rand_new_with_seed(42);
+    int iter, i;
+
+    memset(inserted, 0, sizeof(inserted));
+    for (iter = 0; iter < 100000; iter++) {
+        i = g_rand_int_range(rand, 0, NR_NODES);
+        if (inserted[i]) {
+            interval_tree_remove(&nodes[i], &root);
+            inserted[i] = false;
+        } else {
+            nodes[i].start = g_rand_int_range(rand, 0, 65536);
+            nodes[i].last = nodes[i].start + g_rand_int_range(rand, 0, 256);
+            interval_tree_insert(&nodes[i], &root);
+            inserted[i] = true;
+        }
+
+        if (iter % 1024 == 0) {
+            g_assert(!root.node || !root.node->red);
+            check_subtree(root.node, NULL);
+        }
+        if (iter % 128 == 0) {
+            uint64_t start = g_rand_int_range(rand, 0, 65536);
+            check_range(&root, start, start + g_rand_int_range(rand, 0, 1024));
+        }
+    }
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/disjoint", test_disjoint);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
@@ -0,0 +1,189 @@
+/*
+ * Page cache unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* Address of the @n-th page that maps to the first set of @cache */
+static uint64_t set0_addr(int64_t num_sets, int n)
+{
+    return (uint64_t)n * num_sets * PAGE_SIZE;
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+
+    g_assert(cache);
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(get_cached_data(cache, 0) == NULL);
+
+    memset(page, 0x42, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 5 * PAGE_SIZE, page), ==, 0);
+    g_assert(cache_is_cached(cache, 5 * PAGE_SIZE));
+    g_assert(!cache_is_cached(cache, 6 * PAGE_SIZE));
+
+    data = get_cached_data(cache, 5 * PAGE_SIZE);
+    g_assert(data && data != page);
+    g_assert(!memcmp(data, page, PAGE_SIZE));
+
+    /* Updating a cached page replaces its data in place */
+    memset(page, 0x17, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 5 * PAGE_SIZE, page), ==, 0);
+    g_assert(get_cached_data(cache, 5 * PAGE_SIZE) == data);
+    g_assert(!memcmp(data, page, PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_associativity(void)
+{
+    int64_t num_sets = 64 / PAGE_CACHE_WAYS;
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE] = { 0 };
+    int i;
+
+    /* Pages colliding on the same set do not evict each other... */
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert_cmpint(cache_insert(cache, set0_addr(num_sets, i), page),
+                        ==, 0);
+    }
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(num_sets, i)));
+    }
+
+    /* ...until the set is full */
+    g_assert_cmpint(cache_insert(cache, set0_addr(num_sets, i), page), ==, 0);
+    g_assert(cache_is_cached(cache, set0_addr(num_sets, i)));
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        if (!cache_is_cached(cache, set0_addr(num_sets, i))) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, PAGE_CACHE_WAYS);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_hot_pages_stay(void)
+{
+    int64_t num_sets = 64 / PAGE_CACHE_WAYS;
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE] = { 0 };
+    int i;
+
+    /* Half of the set is dirtied over and over */
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        cache_insert(cache, set0_addr(num_sets, i), page);
+    }
+    for (i = 0; i < PAGE_CACHE_WAYS / 2; i++) {
+        get_cached_data(cache, set0_addr(num_sets, i));
+        get_cached_data(cache, set0_addr(num_sets, i));
+        get_cached_data(cache, set0_addr(num_sets, i));
+    }
+
+    /*
+     * A stream of pages that are only sent once must not evict it, even
+     * though it is larger than what is left of the set (unlike LRU).
+     */
+    for (i = PAGE_CACHE_WAYS; i < 2 * PAGE_CACHE_WAYS; i++) {
+        cache_insert(cache, set0_addr(num_sets, i), page);
+    }
+    for (i = 0; i < PAGE_CACHE_WAYS / 2; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(num_sets, i)));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_insert_eviction_order(void)
+{
+    int64_t num_sets = 64 / PAGE_CACHE_WAYS;
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE] = { 0 };
+    int i;
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert_cmpint(cache_insert(cache, set0_addr(num_sets, i), page),
+                        ==, 0);
+        g_assert(cache_peek_data(cache, set0_addr(num_sets, i)));
+    }
+    /* All pages but the last one are sent again */
+    for (i = 0; i < PAGE_CACHE_WAYS - 1; i++) {
+        get_cached_data(cache, set0_addr(num_sets, i));
+    }
+
+    /* The page that was inserted and looked at, but not hit, goes first */
+    cache_insert(cache, set0_addr(num_sets, PAGE_CACHE_WAYS), page);
+    g_assert(!cache_is_cached(cache, set0_addr(num_sets, PAGE_CACHE_WAYS - 1)));
+    for (i = 0; i < PAGE_CACHE_WAYS - 1; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(num_sets, i)));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+    int i, cached;
+
+    for (i = 0; i < 64; i++) {
+        memset(page, i, PAGE_SIZE);
+        cache_insert(cache, i * PAGE_SIZE, page);
+    }
+    /* Pages 0..7 are the hot ones */
+    for (i = 0; i < 8; i++) {
+        get_cached_data(cache, i * PAGE_SIZE);
+    }
+
+    /* Growing keeps everything */
+    g_assert_cmpint(cache_resize(cache, 200), ==, 128);
+    for (i = 0; i < 64; i++) {
+        data = get_cached_data(cache, i * PAGE_SIZE);
+        g_assert(data && data[0] == i && data[PAGE_SIZE - 1] == i);
+    }
+
+    /* Shrinking keeps the pages that were used the most */
+    g_assert_cmpint(cache_resize(cache, 16), ==, 16);
+    for (i = 0; i < 8; i++) {
+        data = get_cached_data(cache, i * PAGE_SIZE);
+        g_assert(data && data[0] == i);
+    }
+    for (i = 0, cached = 0; i < 64; i++) {
+        cached += cache_is_cached(cache, i * PAGE_SIZE);
+    }
+    g_assert_cmpint(cached, ==, 16);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/associativity", test_associativity);
+    g_test_add_func("/page-cache/hot_pages_stay", test_hot_pages_stay);
+    g_test_add_func("/page-cache/insert_eviction_order",
+                    test_insert_eviction_order);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
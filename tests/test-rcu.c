@@ -0,0 +1,127 @@
+/*
+ * RCU tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+
+#define NR_READERS      4
+#define NR_UPDATES      2000
+#define RCU_MAGIC       0x12345678
+
+typedef struct RCUItem {
+    struct rcu_head rcu;
+    int magic;
+} RCUItem;
+
+static RCUItem *rcu_item;
+static bool stop_readers;
+static int nr_reclaimed;
+
+static RCUItem *rcu_item_new(void)
+{
+    RCUItem *item = g_new0(RCUItem, 1);
+
+    item->magic = RCU_MAGIC;
+    return item;
+}
+
+static void rcu_item_free(RCUItem *item)
+{
+    /* Poison the item so that readers that still see it fail.  */
+    item->magic = 0;
+    g_free(item);
+    atomic_inc(&nr_reclaimed);
+}
+
+static void *rcu_reader_thread(void *opaque)
+{
+    RCUItem *item;
+
+    rcu_register_thread();
+    while (!atomic_read(&stop_readers)) {
+        rcu_read_lock();
+        item = atomic_rcu_read(&rcu_item);
+        g_assert_cmpint(item->magic, ==, RCU_MAGIC);
+
+        /* Nested critical sections do not end the outer one.  */
+        rcu_read_lock();
+        rcu_read_unlock();
+        g_assert_cmpint(item->magic, ==, RCU_MAGIC);
+        rcu_read_unlock();
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_synchronize_no_readers(void)
+{
+    /* Must not block: the main thread is not in a critical section.  */
+    synchronize_rcu();
+    synchronize_rcu();
+}
+
+static void run_updates(bool async)
+{
+    QemuThread threads[NR_READERS];
+    RCUItem *old;
+    int i;
+
+    nr_reclaimed = 0;
+    stop_readers = false;
+    rcu_item = rcu_item_new();
+
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_create(&threads[i], "rcu-reader", rcu_reader_thread,
+                           NULL, QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < NR_UPDATES; i++) {
+        old = rcu_item;
+        atomic_rcu_set(&rcu_item, rcu_item_new());
+        if (async) {
+            call_rcu(old, rcu_item_free, rcu);
+        } else {
+            synchronize_rcu();
+            rcu_item_free(old);
+        }
+    }
+
+    atomic_set(&stop_readers, true);
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    /* call_rcu callbacks run in a separate thread; wait for them.  */
+    for (i = 0; i < 1000 && atomic_read(&nr_reclaimed) < NR_UPDATES; i++) {
+        g_usleep(10000);
+    }
+    g_assert_cmpint(atomic_read(&nr_reclaimed), ==, NR_UPDATES);
+
+    rcu_item_free(rcu_item);
+    rcu_item = NULL;
+}
+
+static void test_synchronize(void)
+{
+    run_updates(false);
+}
+
+static void test_call_rcu(void)
+{
+    run_updates(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/synchronize-no-readers", test_synchronize_no_readers);
+    g_test_add_func("/rcu/synchronize", test_synchronize);
+    g_test_add_func("/rcu/call-rcu", test_call_rcu);
+    return g_test_run();
+}
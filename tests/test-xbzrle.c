@@ -179,6 +179,145 @@ static void test_encode_decode(void)
     }
 }
 
+/* Changes one byte every @stride bytes, with runs of @run bytes */
+static void make_page_pair(uint8_t *old_buf, uint8_t *new_buf, int stride,
+                           int run)
+{
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    for (i = g_test_rand_int_range(0, stride); i < PAGE_SIZE; i += stride) {
+        for (j = i; j < i + run && j < PAGE_SIZE; j++) {
+            new_buf[j] = ~old_buf[j];
+        }
+    }
+}
+
+/* All encoders must produce the same stream */
+static void test_encode_accel(void)
+{
+    static const int strides[] = { 1, 2, 3, 17, 64, 100, 1000, 5000 };
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, n, dlen, ref_len = 0;
+
+    for (i = 0; i < 1000; i++) {
+        int stride = strides[i % ARRAY_SIZE(strides)];
+        int run = g_test_rand_int_range(1, stride + 1);
+
+        make_page_pair(old_buf, new_buf, stride, run);
+        dlen = g_test_rand_int_range(PAGE_SIZE / 4, PAGE_SIZE + 1);
+
+        n = 0;
+        do {
+            int len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                           n ? compressed : ref, dlen);
+            if (n == 0) {
+                ref_len = len;
+            } else {
+                g_assert_cmpint(len, ==, ref_len);
+                g_assert(len <= 0 || memcmp(compressed, ref, len) == 0);
+            }
+            n++;
+        } while (test_xbzrle_encode_next_accel());
+
+        if (ref_len > 0) {
+            g_assert_cmpint(xbzrle_decode_buffer(ref, ref_len, old_buf,
+                                                 PAGE_SIZE), >, 0);
+            g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(compressed);
+}
+
+#define PERF_PAGES 4096
+#define PERF_ROUNDS 64
+
+static void perf_encode(int stride, int run)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * PERF_PAGES);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * PERF_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int accel = 0;
+    int i, j;
+
+    for (i = 0; i < PERF_PAGES; i++) {
+        make_page_pair(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE,
+                       stride, run);
+    }
+
+    do {
+        double secs;
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_ROUNDS; j++) {
+            for (i = 0; i < PERF_PAGES; i++) {
+                xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                     new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                     compressed, PAGE_SIZE);
+            }
+        }
+        secs = g_test_timer_elapsed();
+        g_test_maximized_result(PAGE_SIZE * (double)PERF_PAGES * PERF_ROUNDS
+                                / secs / 1e6,
+                                "encoder %d, stride %d: %.1f MB/s", accel,
+                                stride, PAGE_SIZE * (double)PERF_PAGES *
+                                PERF_ROUNDS / secs / 1e6);
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
+static void test_perf_encode_sparse(void)
+{
+    perf_encode(1024, 1);
+}
+
+static void test_perf_encode_dense(void)
+{
+    perf_encode(64, 8);
+}
+
+static void test_perf_decode(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double secs;
+    int dlen, i;
+
+    make_page_pair(old_buf, new_buf, 64, 8);
+    dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                PAGE_SIZE);
+    g_assert(dlen > 0);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_PAGES * PERF_ROUNDS; i++) {
+        xbzrle_decode_buffer(compressed, dlen, old_buf, PAGE_SIZE);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_maximized_result(PAGE_SIZE * (double)PERF_PAGES * PERF_ROUNDS
+                            / secs / 1e6, "decode: %.1f MB/s",
+                            PAGE_SIZE * (double)PERF_PAGES * PERF_ROUNDS
+                            / secs / 1e6);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +330,13 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode_sparse",
+                        test_perf_encode_sparse);
+        g_test_add_func("/xbzrle/perf/encode_dense", test_perf_encode_dense);
+        g_test_add_func("/xbzrle/perf/decode", test_perf_decode);
+    }
 
     return g_test_run();
 }
@@ -10,21 +10,223 @@
 #include <glib.h>
 #include <string.h>
 #include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
 #include "qemu/osdep.h"
+#include "hw/pci/pci_regs.h"
+
+#define BALLOON_PCI_SLOT            0x04
+
+/* Legacy virtio-pci registers, in the I/O BAR */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+#define VIRTIO_PCI_CONFIG           20
+
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER      2
+#define VIRTIO_CONFIG_S_DRIVER_OK   4
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_ALIGN                 4096
+
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3
+#define VIRTIO_BALLOON_FREE_PAGE_VQ     3
+/* Offset of free_page_hint_cmd_id in the config space */
+#define VIRTIO_BALLOON_CMD_ID_OFFSET    8
+#define VIRTIO_BALLOON_CMD_ID_STOP      0
+#define VIRTIO_BALLOON_CMD_ID_DONE      1
+#define VIRTIO_BALLOON_CMD_ID_MIN       2
+
+#define HINT_PAGES                  64
+#define WAIT_TIMEOUT_US             (10 * G_USEC_PER_SEC)
+
+typedef struct TestVirtQueue {
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t num;
+    uint16_t free_head;
+    uint16_t avail_idx;
+} TestVirtQueue;
+
+static QPCIBus *pcibus;
+static QGuestAllocator *guest_malloc;
+static QPCIDevice *dev;
+static void *base;
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
 }
 
+static uint32_t balloon_cmd_id(void)
+{
+    return qpci_io_readl(dev, base + VIRTIO_PCI_CONFIG +
+                              VIRTIO_BALLOON_CMD_ID_OFFSET);
+}
+
+static uint32_t balloon_wait_cmd_id(uint32_t min, uint32_t max)
+{
+    gint64 deadline = g_get_monotonic_time() + WAIT_TIMEOUT_US;
+    uint32_t id;
+
+    for (;;) {
+        id = balloon_cmd_id();
+        if ((id >= min && id <= max) || g_get_monotonic_time() > deadline) {
+            return id;
+        }
+        g_usleep(10000);
+    }
+}
+
+static void balloon_setup(TestVirtQueue *vq)
+{
+    uint32_t features;
+    uint64_t ring;
+
+    pcibus = qpci_init_pc();
+    g_assert(pcibus != NULL);
+    guest_malloc = pc_alloc_init();
+
+    dev = qpci_device_find(pcibus, QPCI_DEVFN(BALLOON_PCI_SLOT, 0));
+    g_assert(dev != NULL);
+    g_assert_cmphex(qpci_config_readw(dev, PCI_VENDOR_ID), ==, 0x1af4);
+    g_assert_cmphex(qpci_config_readw(dev, PCI_DEVICE_ID), ==, 0x1002);
+    qpci_device_enable(dev);
+    base = qpci_iomap(dev, 0);
+    g_assert(base != NULL);
+
+    qpci_io_writeb(dev, base + VIRTIO_PCI_STATUS, 0);
+    qpci_io_writeb(dev, base + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    features = qpci_io_readl(dev, base + VIRTIO_PCI_HOST_FEATURES);
+    g_assert(features & (1u << VIRTIO_BALLOON_F_FREE_PAGE_HINT));
+    qpci_io_writel(dev, base + VIRTIO_PCI_GUEST_FEATURES,
+                   1u << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+
+    /* Only the free page queue is used, the others stay unconfigured */
+    qpci_io_writew(dev, base + VIRTIO_PCI_QUEUE_SEL,
+                   VIRTIO_BALLOON_FREE_PAGE_VQ);
+    vq->num = qpci_io_readw(dev, base + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->num, >, 2);
+
+    /* Descriptors, then the available ring, then the aligned used ring */
+    ring = guest_alloc(guest_malloc, 2 * VRING_ALIGN + vq->num * 24);
+    g_assert_cmphex(ring & (VRING_ALIGN - 1), ==, 0);
+    vq->desc = ring;
+    vq->avail = ring + vq->num * 16;
+    vq->used = (vq->avail + 6 + vq->num * 2 + VRING_ALIGN - 1) &
+               ~(uint64_t)(VRING_ALIGN - 1);
+    vq->free_head = 0;
+    vq->avail_idx = 0;
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used, 0);
+    writew(vq->used + 2, 0);
+    qpci_io_writel(dev, base + VIRTIO_PCI_QUEUE_PFN, ring / VRING_ALIGN);
+
+    qpci_io_writeb(dev, base + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                   VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
+static void vq_add_desc(TestVirtQueue *vq, uint64_t addr, uint32_t len,
+                        uint16_t flags)
+{
+    uint64_t desc = vq->desc + vq->free_head * 16;
+
+    writeq(desc, addr);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+    writew(desc + 14, vq->free_head + 1);
+    vq->free_head++;
+}
+
+/* Send a command id, optionally with free pages, and wait until the
+ * device has used the buffers.
+ */
+static void balloon_send_hint(TestVirtQueue *vq, uint64_t id_buf, uint32_t id,
+                              uint64_t pages, uint32_t len)
+{
+    uint16_t head = vq->free_head;
+    gint64 deadline = g_get_monotonic_time() + WAIT_TIMEOUT_US;
+
+    g_assert_cmpint(vq->free_head + 2, <=, vq->num);
+    writel(id_buf, id);
+    vq_add_desc(vq, id_buf, sizeof(id), len ? VRING_DESC_F_NEXT : 0);
+    if (len) {
+        vq_add_desc(vq, pages, len, VRING_DESC_F_WRITE);
+    }
+
+    writew(vq->avail + 4 + (vq->avail_idx % vq->num) * 2, head);
+    vq->avail_idx++;
+    writew(vq->avail + 2, vq->avail_idx);
+    qpci_io_writew(dev, base + VIRTIO_PCI_QUEUE_NOTIFY,
+                   VIRTIO_BALLOON_FREE_PAGE_VQ);
+
+    while (readw(vq->used + 2) != vq->avail_idx &&
+           g_get_monotonic_time() < deadline) {
+        g_usleep(10000);
+    }
+    g_assert_cmpint(readw(vq->used + 2), ==, vq->avail_idx);
+    g_assert_cmpint(readl(vq->used + 4 + ((vq->avail_idx - 1) % vq->num) * 8),
+                    ==, head);
+}
+
+/* Walk through a free page report: the device requests it when the
+ * migration starts, the guest acknowledges it, sends pages and stops,
+ * and the device ends the report when the migration is cancelled.
+ */
+static void pci_free_page_hint(void)
+{
+    TestVirtQueue vq;
+    uint64_t id_buf, pages;
+    uint32_t id;
+
+    balloon_setup(&vq);
+    id_buf = guest_alloc(guest_malloc, 4096);
+    pages = guest_alloc(guest_malloc, HINT_PAGES * 4096);
+
+    g_assert_cmpint(balloon_cmd_id(), ==, VIRTIO_BALLOON_CMD_ID_STOP);
+
+    /* Slow enough for the bulk stage to last until the end of the test */
+    qmp_discard_response("{ 'execute': 'migrate_set_speed',"
+                         "  'arguments': { 'value': 1024 } }");
+    qmp_discard_response("{ 'execute': 'migrate',"
+                         "  'arguments': { 'uri': 'exec:cat > /dev/null' } }");
+
+    id = balloon_wait_cmd_id(VIRTIO_BALLOON_CMD_ID_MIN, UINT32_MAX);
+    g_assert_cmpint(id, >=, VIRTIO_BALLOON_CMD_ID_MIN);
+
+    /* The report runs until the guest stops it */
+    balloon_send_hint(&vq, id_buf, id, pages, HINT_PAGES * 4096);
+    g_assert_cmpint(balloon_cmd_id(), ==, id);
+    balloon_send_hint(&vq, id_buf, VIRTIO_BALLOON_CMD_ID_STOP, 0, 0);
+    g_assert_cmpint(balloon_cmd_id(), ==, VIRTIO_BALLOON_CMD_ID_STOP);
+
+    /* The guest can take back its pages once the migration is over */
+    qmp_discard_response("{ 'execute': 'migrate_cancel' }");
+    id = balloon_wait_cmd_id(VIRTIO_BALLOON_CMD_ID_DONE,
+                             VIRTIO_BALLOON_CMD_ID_DONE);
+    g_assert_cmpint(id, ==, VIRTIO_BALLOON_CMD_ID_DONE);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/balloon/pci/nop", pci_nop);
+    qtest_add_func("/virtio/balloon/pci/free-page-hint", pci_free_page_hint);
 
-    qtest_start("-device virtio-balloon-pci");
+    qtest_start("-device virtio-balloon-pci,free-page-hint=on,addr=04.0");
     ret = g_test_run();
 
     qtest_end();
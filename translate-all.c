@@ -59,6 +59,8 @@
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/interval-tree.h"
+#include "exec/tcg-plugin.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -79,10 +81,21 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
+} PageDesc;
+
 #if defined(CONFIG_USER_ONLY)
-    unsigned long flags;
+/* In user mode the protection of guest pages is kept in an interval
+   tree of maximal ranges of guest virtual addresses that share the same
+   flags, so that mmap and mprotect of big areas do not cost one
+   PageDesc per page.  */
+typedef struct PageFlagsNode {
+    IntervalTreeNode itree;
+    int flags;
+    struct PageFlagsNode *next_free;
+} PageFlagsNode;
+
+static IntervalTreeRoot pageflags_root;
 #endif
-} PageDesc;
 
 /* In system mode we want L1_MAP to be based on ram offsets,
    while in user mode we want it to be based on virtual addresses.  */
@@ -155,9 +168,18 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    tcg_plugin_tb_start(tb);
 
     gen_intermediate_code(env, tb);
 
+    /* Once plugins have seen the guest instructions of the block and
+       asked for instrumentation, translate it again to emit it.  */
+    if (tcg_plugin_tb_translated(ENV_GET_CPU(env), tb)) {
+        tcg_func_start(s);
+        tcg_plugin_tb_start(tb);
+        gen_intermediate_code(env, tb);
+    }
+
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
     tb->tb_next_offset[0] = 0xffff;
@@ -212,6 +234,7 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    tcg_plugin_tb_start(tb);
 
     gen_intermediate_code_pc(env, tb);
 
@@ -436,6 +459,156 @@ static inline PageDesc *page_find(tb_page_addr_t index)
     return page_find_alloc(index, 0);
 }
 
+/* Like page_find, but if there is no PageDesc for INDEX also store in
+   *SKIP the number of pages, starting at INDEX, that are known not to
+   have one because a whole table of l1_map is missing.  */
+static PageDesc *page_find_or_skip(tb_page_addr_t index, uint64_t *skip)
+{
+    void **lp;
+    int i;
+
+    lp = l1_map + ((index >> V_L1_SHIFT) & (V_L1_SIZE - 1));
+    for (i = V_L1_SHIFT / V_L2_BITS - 1; ; i--) {
+        if (*lp == NULL) {
+            uint64_t span = (uint64_t)1 << ((i + 1) * V_L2_BITS);
+
+            *skip = span - (index & (span - 1));
+            return NULL;
+        }
+        if (i == 0) {
+            return (PageDesc *)*lp + (index & (V_L2_SIZE - 1));
+        }
+        lp = (void **)*lp + ((index >> (i * V_L2_BITS)) & (V_L2_SIZE - 1));
+    }
+}
+
+#if defined(CONFIG_USER_ONLY)
+/* Like the l1_map tables, the nodes are not allocated with g_malloc:
+   page_unprotect can split a node while running in a signal handler.  */
+#define PAGEFLAGS_CHUNK_SIZE 65536
+
+static PageFlagsNode *pageflags_free_list;
+
+static PageFlagsNode *pageflags_new(target_ulong start, target_ulong last,
+                                    int flags)
+{
+    PageFlagsNode *p = pageflags_free_list;
+
+    if (p == NULL) {
+        size_t i, n = PAGEFLAGS_CHUNK_SIZE / sizeof(PageFlagsNode);
+
+        p = mmap(NULL, PAGEFLAGS_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("page flags allocation");
+            abort();
+        }
+        for (i = 1; i < n - 1; i++) {
+            p[i].next_free = &p[i + 1];
+        }
+        p[n - 1].next_free = NULL;
+        pageflags_free_list = &p[1];
+    } else {
+        pageflags_free_list = p->next_free;
+    }
+
+    p->itree.start = start;
+    p->itree.last = last;
+    p->flags = flags;
+    interval_tree_insert(&p->itree, &pageflags_root);
+    return p;
+}
+
+static void pageflags_free(PageFlagsNode *p)
+{
+    interval_tree_remove(&p->itree, &pageflags_root);
+    p->next_free = pageflags_free_list;
+    pageflags_free_list = p;
+}
+
+static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
+{
+    IntervalTreeNode *n;
+
+    n = interval_tree_iter_first(&pageflags_root, start, last);
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
+}
+
+/* Set the flags of [start, last] to FLAGS, or unmap it if FLAGS is zero.
+   Ranges with the same flags are kept merged.  */
+static void pageflags_set(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *p;
+
+    /* Cut [start, last] out of the existing nodes.  */
+    while ((p = pageflags_find(start, last)) != NULL) {
+        target_ulong p_start = p->itree.start;
+        target_ulong p_last = p->itree.last;
+
+        interval_tree_remove(&p->itree, &pageflags_root);
+        if (p_start < start) {
+            p->itree.last = start - 1;
+            interval_tree_insert(&p->itree, &pageflags_root);
+            if (p_last > last) {
+                pageflags_new(last + 1, p_last, p->flags);
+            }
+        } else if (p_last > last) {
+            p->itree.start = last + 1;
+            interval_tree_insert(&p->itree, &pageflags_root);
+        } else {
+            p->next_free = pageflags_free_list;
+            pageflags_free_list = p;
+        }
+    }
+
+    if (flags == 0) {
+        return;
+    }
+
+    /* Merge with the neighbours if they have the same flags.  */
+    if (start != 0) {
+        p = pageflags_find(start - 1, start - 1);
+        if (p && p->flags == flags) {
+            start = p->itree.start;
+            pageflags_free(p);
+        }
+    }
+    if (last != (target_ulong)-1) {
+        p = pageflags_find(last + 1, last + 1);
+        if (p && p->flags == flags) {
+            last = p->itree.last;
+            pageflags_free(p);
+        }
+    }
+    pageflags_new(start, last, flags);
+}
+
+/* Add SET_FLAGS and remove CLEAR_FLAGS from the mapped pages in
+   [start, last].  Return the union of the previous flags.  */
+static int pageflags_set_clear(target_ulong start, target_ulong last,
+                               int set_flags, int clear_flags)
+{
+    PageFlagsNode *p;
+    int old_flags = 0;
+
+    while ((p = pageflags_find(start, last)) != NULL) {
+        target_ulong seg_start = MAX(p->itree.start, start);
+        target_ulong seg_last = MIN(p->itree.last, last);
+        int new_flags = (p->flags | set_flags) & ~clear_flags;
+
+        old_flags |= p->flags;
+        if (new_flags != p->flags) {
+            pageflags_set(seg_start, seg_last, new_flags);
+        }
+        if (seg_last == last) {
+            break;
+        }
+        start = seg_last + 1;
+    }
+    return old_flags;
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 #define mmap_lock() do { } while (0)
 #define mmap_unlock() do { } while (0)
@@ -721,6 +894,9 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+#ifdef CONFIG_TCG_PLUGIN
+    tb->plugin = NULL;
+#endif
     return tb;
 }
 
@@ -731,6 +907,7 @@ void tb_free(TranslationBlock *tb)
        be the last one generated.  */
     if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
             tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+        tcg_plugin_tb_free(tb);
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
@@ -778,6 +955,25 @@ static void page_flush_tb(void)
     }
 }
 
+/* Timing every translation costs two clock reads, so it is only done
+   on request; the other counters are always maintained.  */
+bool tb_stats_enabled;
+
+/* One "key value" pair per line, for scripts such as the TCG benchmarks.  */
+void dump_tb_stats(FILE *f)
+{
+    fprintf(f, "tb_translations %" PRIu64 "\n", tcg_ctx.tb_ctx.tb_gen_count);
+    if (tb_stats_enabled) {
+        fprintf(f, "tb_translation_ns %" PRId64 "\n",
+                tcg_ctx.tb_ctx.tb_gen_time);
+    }
+    fprintf(f, "tb_flushes %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    fprintf(f, "tb_invalidations %d\n",
+            tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    fprintf(f, "code_gen_bytes %td\n",
+            tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer);
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUArchState *env1)
@@ -795,6 +991,13 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
+    if (tcg_plugin_tb_enabled) {
+        int i;
+
+        for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+            tcg_plugin_tb_free(&tcg_ctx.tb_ctx.tbs[i]);
+        }
+    }
     tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
@@ -1041,6 +1244,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t ti = 0;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
@@ -1056,7 +1260,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    if (tb_stats_enabled) {
+        ti = get_clock();
+    }
     cpu_gen_code(env, tb, &code_gen_size);
+    if (tb_stats_enabled) {
+        tcg_ctx.tb_ctx.tb_gen_time += get_clock() - ti;
+    }
+    tcg_ctx.tb_ctx.tb_gen_count++;
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1081,6 +1292,18 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
                               int is_cpu_write_access)
 {
     while (start < end) {
+        uint64_t skip, next;
+
+        if (!page_find_or_skip(start >> TARGET_PAGE_BITS, &skip)) {
+            /* No code can be in the unallocated part of l1_map.  */
+            next = ((uint64_t)(start >> TARGET_PAGE_BITS) + skip)
+                   << TARGET_PAGE_BITS;
+            if (next <= start || next >= end) {
+                break;
+            }
+            start = next;
+            continue;
+        }
         tb_invalidate_phys_page_range(start, end, is_cpu_write_access);
         start &= TARGET_PAGE_MASK;
         start += TARGET_PAGE_SIZE;
@@ -1332,25 +1555,15 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #if defined(TARGET_HAS_SMC) || 1
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
-        target_ulong addr;
-        PageDesc *p2;
+    if (page_get_flags(page_addr) & PAGE_WRITE) {
         int prot;
 
         /* force the host page as non writable (writes will have a
            page fault + mprotect overhead) */
         page_addr &= qemu_host_page_mask;
-        prot = 0;
-        for (addr = page_addr; addr < page_addr + qemu_host_page_size;
-            addr += TARGET_PAGE_SIZE) {
-
-            p2 = page_find(addr >> TARGET_PAGE_BITS);
-            if (!p2) {
-                continue;
-            }
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
-          }
+        prot = pageflags_set_clear(page_addr,
+                                   page_addr + qemu_host_page_size - 1,
+                                   0, PAGE_WRITE);
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
 #ifdef DEBUG_TB_INVALIDATE
@@ -1661,89 +1874,49 @@ void cpu_interrupt(CPUState *cpu, int mask)
  * Walks guest process memory "regions" one by one
  * and calls callback function 'fn' for each region.
  */
-struct walk_memory_regions_data {
-    walk_memory_regions_fn fn;
-    void *priv;
-    uintptr_t start;
-    int prot;
-};
-
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   abi_ulong end, int new_prot)
-{
-    if (data->start != -1ul) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
-    }
-
-    data->start = (new_prot ? end : -1ul);
-    data->prot = new_prot;
-
-    return 0;
-}
-
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 abi_ulong base, int level, void **lp)
+int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    abi_ulong pa;
-    int i, rc;
-
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
-    }
-
-    if (level == 0) {
-        PageDesc *pd = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+    IntervalTreeNode *n;
+    int rc = 0;
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
+    mmap_lock();
+    for (n = interval_tree_first(&pageflags_root); n;
+         n = interval_tree_next(n)) {
+        PageFlagsNode *p = container_of(n, PageFlagsNode, itree);
 
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((abi_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
+        rc = fn(priv, n->start, n->last + 1, p->flags);
+        if (rc != 0) {
+            break;
         }
     }
+    mmap_unlock();
 
-    return 0;
+    return rc;
 }
 
-int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
+/*
+ * Like walk_memory_regions, but only for the regions that overlap
+ * [start, last]; the regions are passed whole, not clipped.
+ */
+int walk_memory_regions_range(abi_ulong start, abi_ulong last, void *priv,
+                              walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    uintptr_t i;
-
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1ul;
-    data.prot = 0;
+    IntervalTreeNode *n;
+    int rc = 0;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (abi_ulong)i << V_L1_SHIFT,
-                                       V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
+    mmap_lock();
+    for (n = interval_tree_iter_first(&pageflags_root, start, last); n;
+         n = interval_tree_iter_next(n, start, last)) {
+        PageFlagsNode *p = container_of(n, PageFlagsNode, itree);
 
+        rc = fn(priv, n->start, n->last + 1, p->flags);
         if (rc != 0) {
-            return rc;
+            break;
         }
     }
+    mmap_unlock();
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, abi_ulong start,
@@ -1772,13 +1945,9 @@ void page_dump(FILE *f)
 
 int page_get_flags(target_ulong address)
 {
-    PageDesc *p;
+    PageFlagsNode *p = pageflags_find(address, address);
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        return 0;
-    }
-    return p->flags;
+    return p ? p->flags : 0;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -1786,8 +1955,6 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
-
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
        a missing call to h2g_valid.  */
@@ -1801,29 +1968,20 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
-    }
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
 
         /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL, false);
-        }
-        p->flags = flags;
+           the code inside.  Pages that are already writable cannot
+           contain any code, so this only finds the protected ones.  */
+        tb_invalidate_phys_range(start, end, 0);
     }
+
+    pageflags_set(start, end - 1, flags);
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
-    target_ulong end;
-    target_ulong addr;
+    PageFlagsNode *p;
+    target_ulong last;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1835,20 +1993,16 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     if (len == 0) {
         return 0;
     }
-    if (start + len - 1 < start) {
+    last = start + len - 1;
+    if (last < start) {
         /* We've wrapped around.  */
         return -1;
     }
 
-    /* must do before we loose bits in the next step */
-    end = TARGET_PAGE_ALIGN(start + len);
-    start = start & TARGET_PAGE_MASK;
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
+    while (true) {
+        p = pageflags_find(start, last);
+        if (!p || p->itree.start > start) {
+            /* Unmapped hole.  */
             return -1;
         }
         if (!(p->flags & PAGE_VALID)) {
@@ -1865,13 +2019,48 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
             /* unprotect the page if it was put read-only because it
                contains translated code */
             if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL)) {
+                if (!page_unprotect(start, 0, NULL)) {
                     return -1;
                 }
+                /* The tree has changed, look up START again.  */
+                continue;
             }
         }
+
+        if (p->itree.last >= last) {
+            return 0;
+        }
+        start = p->itree.last + 1;
     }
-    return 0;
+}
+
+/* Return the highest address ADDR in [min, max] such that ADDR is aligned
+   to ALIGN and [ADDR, ADDR + LEN - 1] is unmapped and within [min, max],
+   or -1 if there is no such address.  The mmap_lock should be held.  */
+target_ulong page_find_range_empty_top(target_ulong min, target_ulong max,
+                                       target_ulong len, target_ulong align)
+{
+    target_ulong addr, last = max;
+    PageFlagsNode *p;
+
+    assert(len != 0);
+
+    while (last >= min && last - min >= len - 1) {
+        addr = (last - (len - 1)) & -align;
+        if (addr < min) {
+            break;
+        }
+        p = pageflags_find(addr, addr + len - 1);
+        if (!p) {
+            return addr;
+        }
+        /* Anything above P's start would overlap it.  */
+        if (p->itree.start <= min) {
+            break;
+        }
+        last = p->itree.start - 1;
+    }
+    return -1;
 }
 
 /* called from signal handler: invalidate the code and unprotect the
@@ -1879,34 +2068,28 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
 {
     unsigned int prot;
-    PageDesc *p;
-    target_ulong host_start, host_end, addr;
+    int flags;
+    target_ulong host_start, host_last, addr;
 
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        mmap_unlock();
-        return 0;
-    }
+    flags = page_get_flags(address);
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if ((flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE)) {
         host_start = address & qemu_host_page_mask;
-        host_end = host_start + qemu_host_page_size;
+        host_last = host_start + qemu_host_page_size - 1;
 
-        prot = 0;
-        for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
-            p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
+        prot = pageflags_set_clear(host_start, host_last, PAGE_WRITE, 0);
+        prot |= PAGE_WRITE;
 
-            /* and since the content will be modified, we must invalidate
-               the corresponding translated code. */
+        /* and since the content will be modified, we must invalidate
+           the corresponding translated code. */
+        for (addr = host_start; addr < host_last; addr += TARGET_PAGE_SIZE) {
             tb_invalidate_phys_page(addr, pc, puc, true);
 #ifdef DEBUG_TB_CHECK
             tb_invalidate_check(addr);
@@ -0,0 +1,63 @@
+/*
+ * Host CPU feature detection
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/cpuid.h"
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+#include <cpuid.h>
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* XCR0 bits: SSE and AVX state, then opmask, ZMM0-15 upper and ZMM16-31 */
+#define XCR0_AVX        0x06
+#define XCR0_AVX512     0xe6
+
+/* Return the features in EBX of CPUID leaf 7, or 0 if the OS does not
+ * save the registers in @xcr0_mask.
+ */
+static unsigned host_features_7(unsigned xcr0_mask)
+{
+    unsigned a, b, c, d;
+    unsigned xcr0;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return 0;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return 0;
+    }
+    asm("xgetbv" : "=a"(xcr0), "=d"(d) : "c"(0));
+    if ((xcr0 & xcr0_mask) != xcr0_mask) {
+        return 0;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b;
+}
+#endif
+
+bool host_has_avx2(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    return (host_features_7(XCR0_AVX) & bit_AVX2) != 0;
+#else
+    return false;
+#endif
+}
+
+bool host_has_avx512f(void)
+{
+#ifdef CONFIG_AVX512F_OPT
+    return (host_features_7(XCR0_AVX512) & bit_AVX512F) != 0;
+#else
+    return false;
+#endif
+}
@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/cpuid.h"
 #include <math.h>
 #include <limits.h>
 #include <errno.h>
@@ -166,99 +167,218 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
+#define BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR 8
+
 /*
- * Searches for an area with non-zero content in a buffer
- *
- * Attention! The len must be a multiple of
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * and addr must be a multiple of sizeof(VECTYPE) due to
- * restriction of optimizations in this function.
- *
- * can_use_buffer_find_nonzero_offset() can be used to check
- * these requirements.
- *
- * The return value is the offset of the non-zero area rounded
- * down to a multiple of sizeof(VECTYPE) for the first
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
- *
- * If the buffer is all zero the return value is equal to len.
+ * Searches a buffer for non-zero content, using the host's vector type.
+ * The head and the tail of the buffer that are not aligned to the vector
+ * size are checked byte by byte.  Returns the offset of the first non-zero
+ * byte, or len if the buffer is all zero.
  */
-
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_vec(const void *buf, size_t len)
 {
-    const VECTYPE *p = buf;
+    const unsigned char *s = buf, *e = s + len, *p = s;
     const VECTYPE zero = (VECTYPE){0};
-    size_t i;
-
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
+    const VECTYPE *v, *ve;
 
-    if (!len) {
-        return 0;
-    }
-
-    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
-        if (!ALL_EQ(p[i], zero)) {
-            return i * sizeof(VECTYPE);
+    while (p < e && ((uintptr_t)p) % sizeof(VECTYPE)) {
+        if (*p) {
+            return p - s;
         }
+        p++;
     }
 
-    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
-         i < len / sizeof(VECTYPE);
-         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
-        VECTYPE tmp0 = p[i + 0] | p[i + 1];
-        VECTYPE tmp1 = p[i + 2] | p[i + 3];
-        VECTYPE tmp2 = p[i + 4] | p[i + 5];
-        VECTYPE tmp3 = p[i + 6] | p[i + 7];
+    v = (const VECTYPE *)p;
+    ve = v + (e - p) / sizeof(VECTYPE);
+    for (; v + BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR <= ve;
+         v += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        VECTYPE tmp0 = v[0] | v[1];
+        VECTYPE tmp1 = v[2] | v[3];
+        VECTYPE tmp2 = v[4] | v[5];
+        VECTYPE tmp3 = v[6] | v[7];
         VECTYPE tmp01 = tmp0 | tmp1;
         VECTYPE tmp23 = tmp2 | tmp3;
         if (!ALL_EQ(tmp01 | tmp23, zero)) {
             break;
         }
     }
+    for (; v < ve; v++) {
+        if (!ALL_EQ(*v, zero)) {
+            break;
+        }
+    }
 
-    return i * sizeof(VECTYPE);
+    /* Tail, or the chunk where non-zero content was found */
+    p = (const unsigned char *)v;
+    while (p < e && !*p) {
+        p++;
+    }
+    return p - s;
 }
 
 /*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * The AVX2 and AVX-512 versions need at least BUFFER_ACCEL_MIN_LEN bytes.
+ * They check the unaligned head and tail with a single unaligned load each,
+ * and only return the offset of the chunk containing the first non-zero
+ * byte, which is at or before that byte.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+#define BUFFER_ACCEL_MIN_LEN 64
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    const unsigned char *s = buf, *e = s + len;
+    const __m256i *p, *pe;
+    __m256i t;
 
-    size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
+    t = _mm256_loadu_si256(buf);
+    if (!_mm256_testz_si256(t, t)) {
+        return 0;
+    }
 
-    /* use vector optimized zero check if possible */
-    if (can_use_buffer_find_nonzero_offset(buf, len)) {
-        return buffer_find_nonzero_offset(buf, len) == len;
+    p = (const __m256i *)(((uintptr_t)s + 32) & ~(uintptr_t)31);
+    pe = (const __m256i *)((uintptr_t)e & ~(uintptr_t)31);
+    for (; p + 4 <= pe; p += 4) {
+        t = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                            _mm256_or_si256(p[2], p[3]));
+        if (!_mm256_testz_si256(t, t)) {
+            return (const unsigned char *)p - s;
+        }
+    }
+    for (; p < pe; p++) {
+        if (!_mm256_testz_si256(*p, *p)) {
+            return (const unsigned char *)p - s;
+        }
     }
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+    t = _mm256_loadu_si256((const __m256i *)(e - 32));
+    if (!_mm256_testz_si256(t, t)) {
+        return (const unsigned char *)p - s;
+    }
+    return len;
+}
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
+{
+    const unsigned char *s = buf, *e = s + len;
+    const __m512i *p, *pe;
+    __m512i t;
+
+    t = _mm512_loadu_si512(buf);
+    if (_mm512_test_epi64_mask(t, t)) {
+        return 0;
+    }
 
-        if (d0 || d1 || d2 || d3) {
-            return false;
+    p = (const __m512i *)(((uintptr_t)s + 64) & ~(uintptr_t)63);
+    pe = (const __m512i *)((uintptr_t)e & ~(uintptr_t)63);
+    for (; p + 4 <= pe; p += 4) {
+        t = _mm512_or_si512(_mm512_or_si512(p[0], p[1]),
+                            _mm512_or_si512(p[2], p[3]));
+        if (_mm512_test_epi64_mask(t, t)) {
+            return (const unsigned char *)p - s;
+        }
+    }
+    for (; p < pe; p++) {
+        if (_mm512_test_epi64_mask(*p, *p)) {
+            return (const unsigned char *)p - s;
         }
     }
 
-    return true;
+    t = _mm512_loadu_si512(e - 64);
+    if (_mm512_test_epi64_mask(t, t)) {
+        return (const unsigned char *)p - s;
+    }
+    return len;
+}
+
+#pragma GCC pop_options
+#endif
+
+typedef size_t BufferFindNonzeroFn(const void *buf, size_t len);
+
+/* Versions usable on this host, fastest first */
+static BufferFindNonzeroFn *buffer_accels[3] = {
+    buffer_find_nonzero_offset_vec,
+};
+static int buffer_accel_count = 1;
+static int buffer_accel_index;
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+static void __attribute__((constructor)) init_buffer_accels(void)
+{
+    int n = 0;
+
+#ifdef CONFIG_AVX512F_OPT
+    if (host_has_avx512f()) {
+        buffer_accels[n++] = buffer_find_nonzero_offset_avx512;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (host_has_avx2()) {
+        buffer_accels[n++] = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+    buffer_accels[n++] = buffer_find_nonzero_offset_vec;
+    buffer_accel_count = n;
+}
+#endif
+
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (++buffer_accel_index < buffer_accel_count) {
+        return true;
+    }
+    buffer_accel_index = 0;
+    return false;
+}
+
+/*
+ * Searches for an area with non-zero content in a buffer
+ *
+ * The buffer may have any alignment and length.
+ *
+ * The return value is the offset of the first non-zero byte.
+ * If the buffer is all zero the return value is equal to len.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t i;
+
+    if (len < BUFFER_ACCEL_MIN_LEN) {
+        return buffer_find_nonzero_offset_vec(buf, len);
+    }
+
+    i = buffer_accels[buffer_accel_index](buf, len);
+    while (i < len && !p[i]) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * The buffer may have any alignment and length.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    if (len < BUFFER_ACCEL_MIN_LEN) {
+        return buffer_find_nonzero_offset_vec(buf, len) == len;
+    }
+    return buffer_accels[buffer_accel_index](buf, len) == len;
 }
 
 #ifndef _WIN32
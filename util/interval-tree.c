@@ -0,0 +1,394 @@
+/*
+ * Interval trees
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <stddef.h>
+#include "qemu/interval-tree.h"
+
+/* This is a textbook red-black tree with parent pointers and NULL leaves,
+ * augmented with the maximum interval end of every subtree.  Rotations
+ * recompute the augmented value of the two nodes they move; insertion and
+ * removal additionally propagate it along the path to the root.
+ */
+
+static inline uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static inline bool is_red(IntervalTreeNode *node)
+{
+    return node && node->red;
+}
+
+static void update_subtree_last(IntervalTreeNode *node)
+{
+    uint64_t max = node->last;
+
+    if (node->left) {
+        max = max_u64(max, node->left->subtree_last);
+    }
+    if (node->right) {
+        max = max_u64(max, node->right->subtree_last);
+    }
+    node->subtree_last = max;
+}
+
+static void propagate_subtree_last(IntervalTreeNode *node)
+{
+    while (node) {
+        update_subtree_last(node);
+        node = node->parent;
+    }
+}
+
+static void change_child(IntervalTreeRoot *root, IntervalTreeNode *parent,
+                         IntervalTreeNode *old, IntervalTreeNode *new)
+{
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rotate_left(IntervalTreeRoot *root, IntervalTreeNode *x)
+{
+    IntervalTreeNode *y = x->right;
+
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    change_child(root, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+
+    update_subtree_last(x);
+    update_subtree_last(y);
+}
+
+static void rotate_right(IntervalTreeRoot *root, IntervalTreeNode *x)
+{
+    IntervalTreeNode *y = x->left;
+
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    change_child(root, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+
+    update_subtree_last(x);
+    update_subtree_last(y);
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode **link = &root->node;
+    IntervalTreeNode *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        parent->subtree_last = max_u64(parent->subtree_last, node->last);
+        link = node->start < parent->start ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    node->subtree_last = node->last;
+    *link = node;
+
+    while ((parent = node->parent) && parent->red) {
+        IntervalTreeNode *gparent = parent->parent;
+        IntervalTreeNode *uncle;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rotate_right(root, gparent);
+        } else {
+            uncle = gparent->left;
+            if (is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rotate_left(root, gparent);
+        }
+    }
+    root->node->red = false;
+}
+
+static void remove_fixup(IntervalTreeRoot *root, IntervalTreeNode *node,
+                         IntervalTreeNode *parent)
+{
+    IntervalTreeNode *sibling;
+
+    while (node != root->node && !is_red(node)) {
+        if (node == parent->left) {
+            sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(root, parent);
+        } else {
+            sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(root, parent);
+        }
+        node = root->node;
+        break;
+    }
+    if (node) {
+        node->red = false;
+    }
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *spliced, *child, *parent;
+    bool spliced_red;
+
+    /* Find the node that is physically unlinked: NODE itself if it has
+     * at most one child, otherwise its in-order successor.
+     */
+    if (!node->left || !node->right) {
+        spliced = node;
+    } else {
+        spliced = node->right;
+        while (spliced->left) {
+            spliced = spliced->left;
+        }
+    }
+
+    child = spliced->left ? spliced->left : spliced->right;
+    parent = spliced->parent;
+    spliced_red = spliced->red;
+    if (child) {
+        child->parent = parent;
+    }
+    change_child(root, parent, spliced, child);
+
+    if (spliced != node) {
+        /* Move the successor into the place of NODE.  */
+        spliced->left = node->left;
+        spliced->right = node->right;
+        spliced->parent = node->parent;
+        spliced->red = node->red;
+        if (spliced->left) {
+            spliced->left->parent = spliced;
+        }
+        if (spliced->right) {
+            spliced->right->parent = spliced;
+        }
+        change_child(root, node->parent, node, spliced);
+        if (parent == node) {
+            parent = spliced;
+        }
+    }
+
+    propagate_subtree_last(parent);
+
+    if (!spliced_red) {
+        remove_fixup(root, child, parent);
+    }
+}
+
+/* Return the leftmost node of the subtree rooted at NODE that overlaps
+ * [start, last].  NODE->subtree_last must be >= start.
+ */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *node,
+                                        uint64_t start, uint64_t last)
+{
+    while (true) {
+        if (node->left && start <= node->left->subtree_last) {
+            /* Some node in the left subtree ends at or after start.  If
+             * it does not overlap, then it starts after last, and so
+             * does everything to its right.
+             */
+            node = node->left;
+            continue;
+        }
+        if (node->start <= last) {
+            if (start <= node->last) {
+                return node;
+            }
+            if (node->right) {
+                node = node->right;
+                if (start <= node->subtree_last) {
+                    continue;
+                }
+            }
+        }
+        return NULL;
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = root->node;
+
+    if (!node || node->subtree_last < start) {
+        return NULL;
+    }
+    return subtree_search(node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right, *prev;
+
+    while (true) {
+        /* Invariant: node->start <= last.  Look in the right subtree
+         * first, then go up until we come from a left child.
+         */
+        if (right && start <= right->subtree_last) {
+            return subtree_search(right, start, last);
+        }
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (last < node->start) {
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+    }
+}
+
+IntervalTreeNode *interval_tree_first(IntervalTreeRoot *root)
+{
+    IntervalTreeNode *node = root->node;
+
+    if (node) {
+        while (node->left) {
+            node = node->left;
+        }
+    }
+    return node;
+}
+
+IntervalTreeNode *interval_tree_last(IntervalTreeRoot *root)
+{
+    IntervalTreeNode *node = root->node;
+
+    if (node) {
+        while (node->right) {
+            node = node->right;
+        }
+    }
+    return node;
+}
+
+IntervalTreeNode *interval_tree_next(IntervalTreeNode *node)
+{
+    IntervalTreeNode *parent;
+
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+    while ((parent = node->parent) && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
+
+IntervalTreeNode *interval_tree_prev(IntervalTreeNode *node)
+{
+    IntervalTreeNode *parent;
+
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return node;
+    }
+    while ((parent = node->parent) && node == parent->left) {
+        node = parent;
+    }
+    return parent;
+}
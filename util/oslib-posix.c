@@ -58,6 +58,8 @@ extern int daemon(int, int);
 #include "qemu/sockets.h"
 #include <sys/mman.h>
 #include <libgen.h>
+#include <setjmp.h>
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -156,6 +158,129 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     }
 }
 
+/* Preallocation threads.  A SIGBUS is delivered to the thread that
+   touched the page, so the handler looks up which worker it is running in
+   and jumps back to that worker's context.  */
+#define MAX_MEM_PREALLOC_THREADS 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t pagesize;
+    QemuThread thread;
+    QemuThread self;            /* set by the thread itself */
+    sigjmp_buf env;
+    bool failed;
+} MemsetThread;
+
+static MemsetThread *memset_thread;
+static int memset_num_threads;
+
+static void sigbus_handler(int signal)
+{
+    int i;
+
+    for (i = 0; i < memset_num_threads; i++) {
+        if (qemu_thread_is_self(&memset_thread[i].self)) {
+            siglongjmp(memset_thread[i].env, 1);
+        }
+    }
+    abort();
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *t = arg;
+    sigset_t set;
+    size_t i;
+
+    qemu_thread_get_self(&t->self);
+
+    /* qemu_thread_create blocks all signals in the new thread */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(t->env, 1)) {
+        t->failed = true;
+        return NULL;
+    }
+
+    /* MAP_POPULATE silently ignores failures */
+    for (i = 0; i < t->numpages; i++) {
+        memset(t->addr + t->pagesize * i, 0, 1);
+    }
+    return NULL;
+}
+
+static int get_mem_prealloc_threads(size_t numpages, int threads)
+{
+    if (threads <= 0) {
+        long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = MIN(MAX(host_cpus, 1), MAX_MEM_PREALLOC_THREADS);
+    }
+    return MIN(threads, numpages);
+}
+
+int os_mem_prealloc(void *area, size_t memory, size_t pagesize, int threads)
+{
+    struct sigaction act, oldact;
+    size_t numpages, pages_per_thread, leftover;
+    char *addr = area;
+    int ret = 0;
+    int i;
+
+    numpages = memory / pagesize;
+    if (!numpages) {
+        return 0;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &sigbus_handler;
+    act.sa_flags = 0;
+
+    if (sigaction(SIGBUS, &act, &oldact)) {
+        perror("os_mem_prealloc: failed to install signal handler");
+        exit(1);
+    }
+
+    memset_num_threads = get_mem_prealloc_threads(numpages, threads);
+    memset_thread = g_new0(MemsetThread, memset_num_threads);
+    pages_per_thread = numpages / memset_num_threads;
+    leftover = numpages % memset_num_threads;
+
+    /* Give each thread a contiguous slice, spreading the leftover pages
+       over the first ones.  */
+    for (i = 0; i < memset_num_threads; i++) {
+        MemsetThread *t = &memset_thread[i];
+
+        t->addr = addr;
+        t->numpages = pages_per_thread + (i < leftover);
+        t->pagesize = pagesize;
+        addr += t->numpages * pagesize;
+        qemu_thread_create(&t->thread, "touch_pages", do_touch_pages, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].thread);
+        if (memset_thread[i].failed) {
+            ret = -1;
+        }
+    }
+
+    g_free(memset_thread);
+    memset_thread = NULL;
+    memset_num_threads = 0;
+
+    if (sigaction(SIGBUS, &oldact, NULL)) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
+    }
+    return ret;
+}
+
 void qemu_set_block(int fd)
 {
     int f;
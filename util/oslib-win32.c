@@ -70,6 +70,18 @@ void *qemu_anon_ram_alloc(size_t size)
     return ptr;
 }
 
+int os_mem_prealloc(void *area, size_t memory, size_t pagesize, int threads)
+{
+    char *addr = area;
+    size_t i;
+
+    /* MEM_COMMIT already charged the memory, touch it to fault it in */
+    for (i = 0; i < memory / pagesize; i++) {
+        memset(addr + pagesize * i, 0, 1);
+    }
+    return 0;
+}
+
 void qemu_vfree(void *ptr)
 {
     trace_qemu_vfree(ptr);
@@ -0,0 +1,211 @@
+/*
+ * Read-copy-update
+ *
+ * The grace period detection follows the "memory barrier" flavor of
+ * liburcu: each registered thread publishes the value of the global
+ * counter that it saw on entering its outermost critical section, and
+ * synchronize_rcu() advances the counter and waits until no thread
+ * publishes an older value.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+
+unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+
+QemuEvent rcu_gp_event;
+static QemuMutex rcu_gp_lock;
+
+/* Registered threads; during synchronize_rcu() also the threads that
+ * still have to report a quiescent state.
+ */
+typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
+static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
+
+DEFINE_TLS(struct rcu_reader_data, rcu_reader);
+
+/* A reader is still in the grace period if it is in a critical section
+ * that started before the counter was last advanced.
+ */
+static inline int rcu_gp_ongoing(unsigned long *ctr)
+{
+    unsigned long v;
+
+    v = atomic_read(ctr);
+    return v && (v != rcu_gp_ctr);
+}
+
+static void wait_for_readers(void)
+{
+    ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
+    struct rcu_reader_data *index, *tmp;
+
+    for (;;) {
+        /* We want to be notified of changes made to rcu_gp_ongoing
+         * while we walk the list.
+         */
+        qemu_event_reset(&rcu_gp_event);
+
+        /* Instead of using atomic_mb_set for index->waiting, and
+         * atomic_mb_read for index->ctr, memory barriers are placed
+         * manually since writes to different threads are independent.
+         */
+        QLIST_FOREACH(index, &registry, node) {
+            atomic_set(&index->waiting, true);
+        }
+
+        smp_mb();
+
+        QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
+            if (!rcu_gp_ongoing(&index->ctr)) {
+                QLIST_REMOVE(index, node);
+                QLIST_INSERT_HEAD(&qsreaders, index, node);
+
+                /* No need for mb_set here, worst of all we
+                 * get some extra futex wakeups.
+                 */
+                atomic_set(&index->waiting, false);
+            }
+        }
+
+        /* Pairs with the atomic_xchg in rcu_read_unlock.  */
+        smp_mb();
+
+        if (QLIST_EMPTY(&registry)) {
+            break;
+        }
+
+        /* Wait for one thread to report a quiescent state and
+         * try again.
+         */
+        qemu_event_wait(&rcu_gp_event);
+    }
+
+    /* Put the readers back in the registry.  */
+    while (!QLIST_EMPTY(&qsreaders)) {
+        index = QLIST_FIRST(&qsreaders);
+        QLIST_REMOVE(index, node);
+        QLIST_INSERT_HEAD(&registry, index, node);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    if (!QLIST_EMPTY(&registry)) {
+        /* In either case, the atomic_mb_set below blocks stores that free
+         * old RCU-protected pointers.
+         */
+        if (sizeof(rcu_gp_ctr) < 8) {
+            /* For architectures with 32-bit longs, a two-subphases algorithm
+             * ensures we do not encounter overflow bugs.
+             *
+             * Switch parity: 0 -> 1, 1 -> 0.
+             */
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+            wait_for_readers();
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+        } else {
+            /* Increment current grace period.  */
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+        }
+
+        wait_for_readers();
+    }
+
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_register_thread(void)
+{
+    assert(tls_var(rcu_reader).ctr == 0);
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_INSERT_HEAD(&registry, &tls_var(rcu_reader), node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_unregister_thread(void)
+{
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_REMOVE(&tls_var(rcu_reader), node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+/* Callbacks queued by call_rcu1, and the thread that runs them.  A batch
+ * of callbacks is taken from the queue, and run after a single grace
+ * period.
+ */
+static QemuMutex rcu_call_lock;
+static QemuEvent rcu_call_ready_event;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_thread_started;
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *list, *node;
+
+    for (;;) {
+        qemu_event_reset(&rcu_call_ready_event);
+
+        qemu_mutex_lock(&rcu_call_lock);
+        list = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        if (!list) {
+            qemu_event_wait(&rcu_call_ready_event);
+            continue;
+        }
+
+        synchronize_rcu();
+
+        qemu_mutex_lock_iothread();
+        while (list) {
+            node = list;
+            list = node->next;
+            node->func(node);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    abort();
+}
+
+void call_rcu1(struct rcu_head *node, RCUCBFunc *func)
+{
+    QemuThread thread;
+
+    node->func = func;
+    node->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = node;
+    rcu_call_tail = &node->next;
+    if (!rcu_call_thread_started) {
+        rcu_call_thread_started = true;
+        qemu_thread_create(&thread, "call_rcu", call_rcu_thread,
+                           NULL, QEMU_THREAD_DETACHED);
+    }
+    qemu_mutex_unlock(&rcu_call_lock);
+
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+static void __attribute__((__constructor__)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_event_init(&rcu_gp_event, true);
+
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_event_init(&rcu_call_ready_event, false);
+
+    rcu_register_thread();
+}
@@ -117,6 +117,8 @@ int main(int argc, char **argv)
 #include "ui/qemu-spice.h"
 #include "qapi/string-input-visitor.h"
 #include "qom/object_interfaces.h"
+#include "exec/tcg-plugin.h"
+#include "sysemu/hostmem.h"
 
 #define DEFAULT_RAM_SIZE 128
 
@@ -133,6 +135,7 @@ const char* keyboard_layout = NULL;
 ram_addr_t ram_size;
 const char *mem_path = NULL;
 int mem_prealloc = 0; /* force preallocation of physical target memory */
+int mem_prealloc_threads; /* 0 means one per host CPU */
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
 int autostart;
@@ -197,6 +200,8 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+static char *node_memdev_id[MAX_NODES];
+static HostMemoryBackend *node_memdev[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 bool qemu_uuid_set;
@@ -296,6 +301,16 @@ static QemuOptsList qemu_trace_opts = {
     },
 };
 
+static QemuOptsList qemu_plugin_opts = {
+    .name = "plugin",
+    .implied_opt_name = "file",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_plugin_opts.head),
+    .desc = {
+        /* Validated by the plugin itself.  */
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_option_rom_opts = {
     .name = "option-rom",
     .implied_opt_name = "romfile",
@@ -370,6 +385,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        },{
+            .name = "bounce-buffer-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "total size of the DMA bounce buffers of an address space",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
@@ -598,6 +617,7 @@ static const RunStateTransition runstate_transitions_def[] = {
 
     { RUN_STATE_FINISH_MIGRATE, RUN_STATE_RUNNING },
     { RUN_STATE_FINISH_MIGRATE, RUN_STATE_POSTMIGRATE },
+    { RUN_STATE_FINISH_MIGRATE, RUN_STATE_PAUSED },
 
     { RUN_STATE_RESTORE_VM, RUN_STATE_RUNNING },
 
@@ -1342,8 +1362,14 @@ static void numa_add(const char *optarg)
             exit(1);
         }
 
+        if (get_param_value(option, 128, "memdev", optarg) != 0) {
+            node_memdev_id[nodenr] = g_strdup(option);
+        }
         if (get_param_value(option, 128, "mem", optarg) == 0) {
             node_mem[nodenr] = 0;
+        } else if (node_memdev_id[nodenr]) {
+            fprintf(stderr, "qemu: mem and memdev are mutually exclusive\n");
+            exit(1);
         } else {
             int64_t sval;
             sval = strtosz(option, &endptr);
@@ -1363,6 +1389,79 @@ static void numa_add(const char *optarg)
     }
 }
 
+/* Look up the memory backends given with -numa node,memdev=ID.  The size
+ * of each node is the size of its backend, and either all nodes or none
+ * must have one.
+ */
+static void numa_resolve_memdevs(void)
+{
+    Object *objects = container_get(object_get_root(), "/objects");
+    uint64_t total = 0;
+    int i, have = 0;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        Object *obj;
+
+        if (!node_memdev_id[i]) {
+            continue;
+        }
+        obj = object_resolve_path_component(objects, node_memdev_id[i]);
+        if (!obj || !object_dynamic_cast(obj, TYPE_MEMORY_BACKEND)) {
+            fprintf(stderr, "qemu: memdev=%s is not a memory backend\n",
+                    node_memdev_id[i]);
+            exit(1);
+        }
+        node_memdev[i] = MEMORY_BACKEND(obj);
+        node_mem[i] = node_memdev[i]->size;
+        total += node_mem[i];
+        have++;
+    }
+
+    if (have && have != nb_numa_nodes) {
+        fprintf(stderr, "qemu: memdev must be given for all NUMA nodes or "
+                "for none\n");
+        exit(1);
+    }
+    if (have && total != ram_size) {
+        fprintf(stderr, "qemu: total size of NUMA memdevs (%" PRIu64
+                ") differs from the RAM size (%" PRIu64 ")\n",
+                total, (uint64_t)ram_size);
+        exit(1);
+    }
+}
+
+void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
+                                          const char *name,
+                                          uint64_t ram_size)
+{
+    uint64_t addr = 0;
+    int i;
+
+    if (nb_numa_nodes == 0 || !node_memdev[0]) {
+        memory_region_init_ram(mr, owner, name, ram_size);
+        vmstate_register_ram_global(mr);
+        return;
+    }
+
+    /* Each node's memory is a separate RAMBlock, so that it can be
+     * migrated and bound to host nodes independently.
+     */
+    memory_region_init(mr, owner, name, ram_size);
+    for (i = 0; i < nb_numa_nodes; i++) {
+        MemoryRegion *seg = host_memory_backend_get_memory(node_memdev[i],
+                                                           &error_abort);
+
+        if (seg->parent) {
+            fprintf(stderr, "qemu: memdev %s is used more than once\n",
+                    node_memdev_id[i]);
+            exit(1);
+        }
+        memory_region_add_subregion(mr, addr, seg);
+        vmstate_register_ram_global(seg);
+        addr += node_mem[i];
+    }
+}
+
 static QemuOptsList qemu_smp_opts = {
     .name = "smp-opts",
     .implied_opt_name = "cpus",
@@ -2909,15 +3008,33 @@ static int object_set_property(const char *name, const char *value, void *opaque
     return 0;
 }
 
+/* Memory backends allocate guest RAM, which depends on the accelerator,
+ * so they are created once it is initialized.
+ */
+static bool object_create_initial(const char *type)
+{
+    return !g_str_has_prefix(type, "memory-backend-");
+}
+
+static bool object_create_delayed(const char *type)
+{
+    return !object_create_initial(type);
+}
+
 static int object_create(QemuOpts *opts, void *opaque)
 {
     const char *type = qemu_opt_get(opts, "qom-type");
     const char *id = qemu_opts_id(opts);
+    bool (*type_predicate)(const char *) = opaque;
     Error *local_err = NULL;
     Object *obj;
 
     g_assert(type != NULL);
 
+    if (!type_predicate(type)) {
+        return 0;
+    }
+
     if (id == NULL) {
         qerror_report(QERR_MISSING_PARAMETER, "id");
         return -1;
@@ -2953,6 +3070,37 @@ out:
     return 0;
 }
 
+#ifdef CONFIG_TCG_PLUGIN
+static int plugin_add_arg(const char *name, const char *value, void *opaque)
+{
+    GPtrArray *args = opaque;
+
+    if (strcmp(name, "file")) {
+        g_ptr_array_add(args, g_strdup_printf("%s=%s", name, value));
+    }
+    return 0;
+}
+
+static int plugin_load(QemuOpts *opts, void *opaque)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    GPtrArray *args;
+    int ret;
+
+    if (!file) {
+        error_report("-plugin: file name is missing");
+        return -1;
+    }
+
+    args = g_ptr_array_new_with_free_func(g_free);
+    qemu_opt_foreach(opts, plugin_add_arg, args, 0);
+    g_ptr_array_add(args, NULL);
+    ret = tcg_plugin_load(file, args->len - 1, (char **)args->pdata);
+    g_ptr_array_free(args, TRUE);
+    return ret;
+}
+#endif
+
 int main(int argc, char **argv, char **envp)
 {
     int i;
@@ -3012,6 +3160,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_global_opts);
     qemu_add_opts(&qemu_mon_opts);
     qemu_add_opts(&qemu_trace_opts);
+    qemu_add_opts(&qemu_plugin_opts);
     qemu_add_opts(&qemu_option_rom_opts);
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_mem_opts);
@@ -3382,6 +3531,17 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_mem_prealloc:
                 mem_prealloc = 1;
                 break;
+            case QEMU_OPTION_mem_prealloc_threads:
+                {
+                    char *r;
+                    mem_prealloc_threads = strtol(optarg, &r, 10);
+                    if (*r || mem_prealloc_threads <= 0) {
+                        fprintf(stderr, "qemu: invalid number of "
+                                "preallocation threads: %s\n", optarg);
+                        exit(1);
+                    }
+                    break;
+                }
             case QEMU_OPTION_d:
                 log_mask = optarg;
                 break;
@@ -3873,6 +4033,12 @@ int main(int argc, char **argv, char **envp)
                 trace_file = qemu_opt_get(opts, "file");
                 break;
             }
+            case QEMU_OPTION_plugin:
+                opts = qemu_opts_parse(qemu_find_opts("plugin"), optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_readconfig:
                 {
                     int ret = qemu_read_config_file(optarg);
@@ -4003,7 +4169,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     if (qemu_opts_foreach(qemu_find_opts("object"),
-                          object_create, NULL, 0) != 0) {
+                          object_create, object_create_initial, 0) != 0) {
         exit(1);
     }
 
@@ -4044,6 +4210,17 @@ int main(int argc, char **argv, char **envp)
         }
     }
 
+#ifdef CONFIG_TCG_PLUGIN
+    if (qemu_opts_foreach(qemu_find_opts("plugin"), plugin_load, NULL, 1)) {
+        exit(1);
+    }
+#else
+    if (qemu_opts_find(qemu_find_opts("plugin"), NULL)) {
+        fprintf(stderr, "-plugin: QEMU was built without TCG plugin support\n");
+        exit(1);
+    }
+#endif
+
     /* If no data_dir is specified then try to find it relative to the
        executable path.  */
     if (data_dir_idx < ARRAY_SIZE(data_dir)) {
@@ -4229,6 +4406,11 @@ int main(int argc, char **argv, char **envp)
 
     configure_accelerator(machine_class);
 
+    if (qemu_opts_foreach(qemu_find_opts("object"),
+                          object_create, object_create_delayed, 0) != 0) {
+        exit(1);
+    }
+
     if (qtest_chrdev) {
         Error *local_err = NULL;
         qtest_init(qtest_chrdev, qtest_log, &local_err);
@@ -4357,6 +4539,8 @@ int main(int argc, char **argv, char **envp)
             nb_numa_nodes = MAX_NODES;
         }
 
+        numa_resolve_memdevs();
+
         /* If no memory size if given for any node, assume the default case
          * and distribute the available memory equally across all nodes
          */
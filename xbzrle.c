@@ -11,6 +11,8 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/cpuid.h"
 #include "include/migration/migration.h"
 
 /*
@@ -23,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -125,6 +127,215 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders produce the same output as the one above.  They
+ * find the end of each run with a helper that compares whole vectors,
+ * and only look at single bytes in the tail of the page.
+ */
+typedef int XbzrleRunEnd(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     XbzrleRunEnd *zrun_end,
+                                     XbzrleRunEnd *nzrun_end)
+{
+    int d = 0, i = 0, j;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = zrun_end(old_buf, new_buf, i, slen);
+
+        /* buffer unchanged */
+        if (j - i == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (j == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, j - i);
+        i = j;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = nzrun_end(old_buf, new_buf, i, slen);
+        d += uleb128_encode_small(dst + d, j - i);
+        /* overflow */
+        if (d + (j - i) > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, j - i);
+        d += j - i;
+        i = j;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit n is set if byte n of the 16 bytes at @old_buf and @new_buf match */
+static inline uint32_t xbzrle_eq_mask_sse2(const uint8_t *old_buf,
+                                           const uint8_t *new_buf)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)old_buf);
+    __m128i y = _mm_loadu_si128((const __m128i *)new_buf);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+}
+
+static inline int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    uint32_t ne;
+
+    for (; i + 16 <= slen; i += 16) {
+        ne = ~xbzrle_eq_mask_sse2(old_buf + i, new_buf + i) & 0xffff;
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 16 <= slen; i += 16) {
+        eq = xbzrle_eq_mask_sse2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_sse2, xbzrle_nzrun_end_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t xbzrle_eq_mask_avx2(const uint8_t *old_buf,
+                                           const uint8_t *new_buf)
+{
+    __m256i x = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i y = _mm256_loadu_si256((const __m256i *)new_buf);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+}
+
+static inline int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    uint32_t ne;
+
+    for (; i + 32 <= slen; i += 32) {
+        ne = ~xbzrle_eq_mask_avx2(old_buf + i, new_buf + i);
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 32 <= slen; i += 32) {
+        eq = xbzrle_eq_mask_avx2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+
+#pragma GCC pop_options
+#endif
+
+typedef int XbzrleEncodeFn(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                           uint8_t *dst, int dlen);
+
+/* Encoders usable on this host, fastest first */
+static XbzrleEncodeFn *xbzrle_encoders[3];
+static int xbzrle_encoder_count;
+static int xbzrle_encoder_index;
+
+static void __attribute__((constructor)) xbzrle_init_encoders(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (host_has_avx2()) {
+        xbzrle_encoders[xbzrle_encoder_count++] = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef __SSE2__
+    xbzrle_encoders[xbzrle_encoder_count++] = xbzrle_encode_buffer_sse2;
+#endif
+    xbzrle_encoders[xbzrle_encoder_count++] = xbzrle_encode_buffer_int;
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (++xbzrle_encoder_index < xbzrle_encoder_count) {
+        return true;
+    }
+    xbzrle_encoder_index = 0;
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encoders[xbzrle_encoder_index](old_buf, new_buf, slen,
+                                                 dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;